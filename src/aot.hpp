@@ -0,0 +1,517 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdio>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "cfg.hpp"
+#include "reach.hpp"
+#include "os.hpp"
+
+namespace lc3 {
+    /// @brief A straight run of translated instructions, which becomes one C++ function.
+    struct AotBlock {
+        UInt start;
+        UInt size;
+    };
+
+    /// @brief The translated part of one image: the words reachable from its entry points, split in
+    ///        blocks at every address that control may arrive at.
+    struct AotRegion {
+        const Image &image;
+        vector<AotBlock> blocks;
+        UInt low, high; // Span of the translated words
+
+        AotRegion(const Image &image, const vector<UInt> &entries, const Image *over = nullptr): image(image), low(0xFFFF), high(0) {
+            Reachability reach(image, entries);
+
+            // Words loaded over this image are never translated from it
+            auto usable = [&](UInt addr) {
+                return image.contains(addr) && reach.reached.test(addr) && addr < IO_START
+                    && (over == nullptr || !over->contains(addr));
+            };
+
+            // Control arrives at branch targets, and returns after a call or a trap
+            vector<char> leader(0x10000, 0);
+            for (UInt e : entries) leader[e] = 1;
+            for (size_t i = 0; i < image.size(); i++) {
+                UInt addr = image.address(i);
+                if (!usable(addr)) continue;
+
+                UInt insn = image.words[i];
+                Flow f = flowOf(addr, insn);
+                if (f.jumps) leader[f.target] = 1;
+
+                UInt op = getBits(insn, 15, 12);
+                if (op == JSR || op == TRAP || op == RET || (op == BR && getBits(insn, 11, 9) != 0))
+                    leader[(UInt) (addr + 1)] = 1;
+            }
+
+            for (size_t i = 0; i < image.size(); i++) {
+                UInt addr = image.address(i);
+                if (!usable(addr)) continue;
+
+                if (!leader[addr] && !blocks.empty() && (UInt) (blocks.back().start + blocks.back().size) == addr) {
+                    blocks.back().size++;
+                } else {
+                    blocks.push_back({ addr, 1 });
+                }
+
+                if (addr < low) low = addr;
+                if (addr > high) high = addr;
+            }
+        }
+    };
+
+    /// @brief Translates a program to a C++ source file, with one function per block of code. The
+    ///        reachable code of the built-in operating system is translated too. The result includes
+    ///        machine.hpp, and runs on a Machine like Machine::run: whatever was not translated, or
+    ///        was changed in memory since, is executed by the interpreter of the machine, and so are
+    ///        trap routines that the machine runs natively.
+    class Translator {
+        public:
+        Translator(const Image &image): image(image), os(buildOS()),
+                program(image, { image.origin }), system(os, systemEntries(os), &image) {
+        }
+
+        /// @brief The amount of generated functions
+        size_t blocks() const {
+            return program.blocks.size() + system.blocks.size();
+        }
+
+        /// @brief Write the C++ source
+        /// @param out     Where to write it
+        /// @param source  The name of the translated file, for a comment
+        void write(ostream &out, const string &source) {
+            const AotRegion *regions[] = { &system, &program };
+
+            out << "// Translated from " << source << " by lc3aot. Build it with the lc3tools source" << endl;
+            out << "// directory on the include path, like: g++ -O2 -I lc3tools/src program.cpp" << endl;
+            out << "//" << endl;
+            out << "// Define LC3AOT_NO_MAIN to leave out main() and use lc3aot_load() and lc3aot_run()" << endl;
+            out << "// from other code." << endl;
+            out << endl;
+            out << "#include <iostream>" << endl;
+            out << "#include <cstring>" << endl;
+            out << "#include <memory>" << endl;
+            out << endl;
+            out << "#include \"machine.hpp\"" << endl;
+            out << endl;
+            out << "namespace {" << endl;
+            out << "    using lc3::UInt;" << endl;
+            out << endl;
+
+            // The image itself, to load it, and the words each block was made from
+            out << "    const UInt ORIGIN = " << hex(image.origin) << ";" << endl;
+            out << "    const UInt IMAGE[] = {";
+            words(out, image.words, 0, image.size());
+            out << "    };" << endl;
+            out << endl;
+
+            out << "    struct Block {" << endl;
+            out << "        UInt start, size;" << endl;
+            out << "        const UInt *words;" << endl;
+            out << "    };" << endl;
+            out << endl;
+
+            vector<UInt> original;
+            for (const AotRegion *r : regions) {
+                for (const AotBlock &b : r->blocks) {
+                    for (UInt i = 0; i < b.size; i++)
+                        original.push_back(r->image.words[r->image.index(b.start + i)]);
+                }
+            }
+            out << "    const UInt WORDS[] = {";
+            words(out, original, 0, original.size());
+            out << "    };" << endl;
+            out << endl;
+
+            out << "    const Block BLOCKS[] = {" << endl;
+            size_t offset = 0;
+            for (const AotRegion *r : regions) {
+                for (const AotBlock &b : r->blocks) {
+                    out << "        { " << hex(b.start) << ", " << b.size << ", WORDS + " << offset << " }," << endl;
+                    offset += b.size;
+                }
+            }
+            if (blocks() == 0) out << "        { 0, 0, WORDS }" << endl;
+            out << "    };" << endl;
+            out << endl;
+
+            out << "    const size_t BLOCK_COUNT = " << blocks() << ";" << endl;
+            out << endl;
+
+            out << PRELUDE_STATE;
+
+            // Stores into translated code make the translation check itself
+            out << "        static bool inCode(UInt addr) {" << endl;
+            out << "            return false";
+            for (const AotRegion *r : regions) {
+                if (r->blocks.empty()) continue;
+                out << endl << "                || (UInt) (addr - " << hex(r->low) << ") <= " << hex(r->high - r->low);
+            }
+            out << ";" << endl;
+            out << "        }" << endl;
+            out << "    };" << endl;
+            out << endl;
+
+            for (const AotRegion *r : regions) {
+                for (const AotBlock &b : r->blocks) block(out, *r, b);
+            }
+
+            out << "}" << endl;
+            out << endl;
+
+            out << PRELUDE_LOAD;
+
+            out << "lc3::Stop lc3aot_run(lc3::Machine &m, uint64_t limit) {" << endl;
+            out << "    if (m.halted()) return lc3::STOP_HALT;" << endl;
+            out << endl;
+            out << "    uint64_t end = m.instructions + limit < m.instructions ? UINT64_MAX : m.instructions + limit;" << endl;
+            out << endl;
+            out << "    State s(m);" << endl;
+            out << "    s.refresh();" << endl;
+            out << "    UInt pc = m.pc;" << endl;
+            out << "    lc3::Stop stop = lc3::STOP_LIMIT;" << endl;
+            out << endl;
+            out << "    for (;;) {" << endl;
+            out << "        switch (pc) {" << endl;
+            size_t index = 0;
+            for (const AotRegion *r : regions) {
+                for (const AotBlock &b : r->blocks) {
+                    // Blocks that stop at once are left to the interpreter
+                    if (stops(r->image.words[r->image.index(b.start)])) {
+                        index++;
+                        continue;
+                    }
+                    out << "            case " << hex(b.start) << ": if (!s.stale[" << index << "]) { pc = b" << name(b.start) << "(s); goto ran; } break;" << endl;
+                    index++;
+                }
+            }
+            out << "        }" << endl;
+            out << endl;
+            out << "        // Not translated, or changed since: leave one instruction to the interpreter" << endl;
+            out << "        interpret:" << endl;
+            out << "        s.save(pc);" << endl;
+            out << "        stop = m.run(1);" << endl;
+            out << "        s.reload();" << endl;
+            out << "        pc = m.pc;" << endl;
+            out << "        if (stop != lc3::STOP_LIMIT) return stop;" << endl;
+            out << "        s.refresh();" << endl;
+            out << "        if (s.n >= end) break;" << endl;
+            out << "        continue;" << endl;
+            out << endl;
+            out << "        ran:" << endl;
+            out << "        if (s.leave) {" << endl;
+            out << "            s.leave = false;" << endl;
+            out << "            if (s.interpret) { s.interpret = false; goto interpret; }" << endl;
+            out << "            if (m.halted()) { stop = lc3::STOP_HALT; break; }" << endl;
+            out << "            if (s.starved) { stop = lc3::STOP_INPUT; break; }" << endl;
+            out << "            s.refresh();" << endl;
+            out << "        }" << endl;
+            out << endl;
+            out << "        // Like the interpreter, events are handled after control instructions and devices, and" << endl;
+            out << "        // the limit is only checked after control instructions" << endl;
+            out << "        if (s.through) {" << endl;
+            out << "            s.through = false;" << endl;
+            out << "            continue;" << endl;
+            out << "        }" << endl;
+            out << "        if (s.n >= m.events.due()) {" << endl;
+            out << "            s.save(pc);" << endl;
+            out << "            m.handleEvents();" << endl;
+            out << "            s.reload();" << endl;
+            out << "            pc = m.pc;" << endl;
+            out << "        }" << endl;
+            out << "        if (s.device) {" << endl;
+            out << "            s.device = false;" << endl;
+            out << "            continue;" << endl;
+            out << "        }" << endl;
+            out << "        if (s.n >= end) break;" << endl;
+            out << "    }" << endl;
+            out << endl;
+            out << "    s.save(pc);" << endl;
+            out << "    m.console.flush();" << endl;
+            out << "    return stop;" << endl;
+            out << "}" << endl;
+
+            out << PRELUDE_MAIN;
+        }
+
+        private:
+        const Image &image;
+        Image os;
+        AotRegion program;
+        AotRegion system;
+
+        // The routines of the operating system are found through its vector tables
+        static vector<UInt> systemEntries(const Image &os) {
+            vector<UInt> entries;
+            for (UInt v = 0; v < OS_START && v < os.size(); v++) {
+                if (os.words[v] >= OS_START) entries.push_back(os.words[v]);
+            }
+            return entries;
+        }
+
+        // Instructions that need the machine itself, and end a block
+        static bool stops(UInt insn) {
+            UInt op = getBits(insn, 15, 12);
+            return op == RTI || op == 0xD;
+        }
+
+        static string hex(UInt v) {
+            char str[8];
+            sprintf(str, "0x%04X", v);
+            return string(str);
+        }
+
+        static string name(UInt v) {
+            char str[8];
+            sprintf(str, "%04X", v);
+            return string(str);
+        }
+
+        static void words(ostream &out, const vector<UInt> &w, size_t from, size_t to) {
+            for (size_t i = from; i < to; i++) {
+                if ((i - from) % 8 == 0) out << endl << "       ";
+                out << " " << hex(w[i]) << ",";
+            }
+            if (from == to) out << " 0";
+            out << endl;
+        }
+
+        // Write one block as a function that executes it, and returns the address to continue at
+        void block(ostream &out, const AotRegion &r, const AotBlock &b) {
+            out << "    inline UInt b" << name(b.start) << "(State &s) {" << endl;
+
+            bool ended = false;
+            for (UInt i = 0; i < b.size && !ended; i++) {
+                UInt addr = b.start + i;
+                UInt insn = r.image.words[r.image.index(addr)];
+
+                // Leave the rest to the interpreter
+                if (stops(insn)) {
+                    out << "        s.n += " << i << "; s.through = true; return " << hex(addr) << ";" << endl;
+                    ended = true;
+                    break;
+                }
+
+                out << "        // " << hex(addr) << ": " << Instruction(insn).assemblyString() << endl;
+                ended = instruction(out, addr, insn, i + 1);
+            }
+
+            if (!ended)
+                out << "        s.n += " << b.size << "; s.through = true; return " << hex(b.start + b.size) << ";" << endl;
+
+            out << "    }" << endl;
+            out << endl;
+        }
+
+        // Write one instruction, the k-th of its block. Returns whether it ends the block.
+        bool instruction(ostream &out, UInt addr, UInt insn, UInt k) {
+            UInt next = addr + 1;
+
+            string dr = "s.r[" + to_string(getBits(insn, 11, 9)) + "]";
+            string sr = "s.r[" + to_string(getBits(insn, 8, 6)) + "]";
+            string sr2 = "s.r[" + to_string(getBits(insn, 2, 0)) + "]";
+            string imm5 = hex(sext(getBits(insn, 4, 0), 5));
+            string off6 = hex(sext(getBits(insn, 5, 0), 6));
+            UInt target = next + sext(getBits(insn, 8, 0), 9);
+
+            string leave = "s.n += " + to_string(k) + ";";
+
+            // Loads and stores that may touch a device, or translated code, can end the block
+            string check = "        if (s.leave) { " + leave + " return " + hex(next) + "; }\n";
+
+            switch (getBits(insn, 15, 12)) {
+                case ADD:
+                    out << "        " << dr << " = " << sr << " + " << (getBit(insn, 5) ? imm5 : sr2) << "; s.setcc(" << dr << ");" << endl;
+                    return false;
+
+                case AND:
+                    out << "        " << dr << " = " << sr << " & " << (getBit(insn, 5) ? imm5 : sr2) << "; s.setcc(" << dr << ");" << endl;
+                    return false;
+
+                case NOT:
+                    out << "        " << dr << " = ~" << sr << "; s.setcc(" << dr << ");" << endl;
+                    return false;
+
+                case LEA:
+                    out << "        " << dr << " = " << hex(target) << "; s.setcc(" << dr << ");" << endl;
+                    return false;
+
+                case LD:
+                    if (target < IO_START) {
+                        out << "        " << dr << " = s.mem[" << hex(target) << "]; s.setcc(" << dr << ");" << endl;
+                        return false;
+                    }
+                    out << "        " << dr << " = s.load(" << hex(target) << ", " << k << "); s.setcc(" << dr << ");" << endl;
+                    out << check;
+                    return false;
+
+                case LDI:
+                    out << "        " << dr << " = s.load(" << load(target, k) << ", " << k << "); s.setcc(" << dr << ");" << endl;
+                    out << check;
+                    return false;
+
+                case LDR:
+                    out << "        " << dr << " = s.load(" << sr << " + " << off6 << ", " << k << "); s.setcc(" << dr << ");" << endl;
+                    out << check;
+                    return false;
+
+                case ST:
+                    out << "        s.store(" << hex(target) << ", " << dr << ", " << k << ");" << endl;
+                    out << check;
+                    return false;
+
+                case STI:
+                    out << "        s.store(" << load(target, k) << ", " << dr << ", " << k << ");" << endl;
+                    out << check;
+                    return false;
+
+                case STR:
+                    out << "        s.store(" << sr << " + " << off6 << ", " << dr << ", " << k << ");" << endl;
+                    out << check;
+                    return false;
+
+                case BR:
+                {
+                    UInt nzp = getBits(insn, 11, 9);
+                    if (nzp == 0) return false;
+                    if (nzp == 7) {
+                        out << "        " << leave << " return " << hex(target) << ";" << endl;
+                    } else {
+                        out << "        " << leave << " return (s.psr & " << nzp << ") ? " << hex(target) << " : " << hex(next) << ";" << endl;
+                    }
+                    return true;
+                }
+
+                case JSR:
+                    if (getBit(insn, 11)) {
+                        out << "        s.r[7] = " << hex(next) << "; " << leave << " return " << hex(next + sext(getBits(insn, 10, 0), 11)) << ";" << endl;
+                    } else {
+                        out << "        { UInt t = " << sr << "; s.r[7] = " << hex(next) << "; " << leave << " return t; }" << endl;
+                    }
+                    return true;
+
+                case RET:
+                    out << "        " << leave << " return " << sr << ";" << endl;
+                    return true;
+
+                case TRAP:
+                    // The machine may run this routine natively
+                    if (isServiced(getBits(insn, 7, 0))) {
+                        out << "        if (s.m.nativeTraps) { s.n += " << k - 1 << "; s.leave = s.interpret = true; return " << hex(addr) << "; }" << endl;
+                    }
+                    out << "        s.r[7] = " << hex(next) << "; " << leave << " return s.mem[" << hex(getBits(insn, 7, 0)) << "];" << endl;
+                    return true;
+            }
+            return false;
+        }
+
+        // A load of a fixed address by the k-th instruction of a block, straight from memory if it
+        // is not a device
+        static string load(UInt addr, UInt k) {
+            if (addr < IO_START) return "s.mem[" + hex(addr) + "]";
+            return "s.load(" + hex(addr) + ", " + to_string(k) + ")";
+        }
+
+        static constexpr const char *PRELUDE_STATE =
+            "    // The registers live here while translated code runs, and go back to the machine for\n"
+            "    // the interpreter\n"
+            "    struct State {\n"
+            "        lc3::Machine &m;\n"
+            "        UInt *mem;\n"
+            "        UInt r[8];\n"
+            "        UInt psr;\n"
+            "        uint64_t n;\n"
+            "        bool leave;   // The block must end after this instruction\n"
+            "        bool starved; // The keyboard was polled after the input ended\n"
+            "        bool interpret; // The interpreter must execute the next instruction\n"
+            "        bool through; // The block did not end at a control instruction, so the limit waits\n"
+            "        bool device;  // It ended at a device with events due, which are handled at once\n"
+            "        bool stale[BLOCK_COUNT + 1];\n"
+            "\n"
+            "        State(lc3::Machine &m): m(m), mem(m.mem), leave(false), starved(false), interpret(false), through(false), device(false) {\n"
+            "            reload();\n"
+            "        }\n"
+            "\n"
+            "        void reload() {\n"
+            "            memcpy(r, m.reg, sizeof(r));\n"
+            "            psr = m.psr;\n"
+            "            n = m.instructions;\n"
+            "        }\n"
+            "\n"
+            "        void save(UInt pc) {\n"
+            "            memcpy(m.reg, r, sizeof(r));\n"
+            "            m.psr = psr;\n"
+            "            m.instructions = n;\n"
+            "            m.pc = pc;\n"
+            "        }\n"
+            "\n"
+            "        // Find the blocks whose code is not what it was translated from\n"
+            "        void refresh() {\n"
+            "            for (size_t i = 0; i < BLOCK_COUNT; i++) {\n"
+            "                const Block &b = BLOCKS[i];\n"
+            "                stale[i] = memcmp(mem + b.start, b.words, b.size * sizeof(UInt)) != 0;\n"
+            "            }\n"
+            "        }\n"
+            "\n"
+            "        void setcc(UInt v) {\n"
+            "            psr = (psr & 0xFFF8) | lc3::conditionOf(v);\n"
+            "        }\n"
+            "\n"
+            "        // Loads and stores by the k-th instruction of a block. Devices may have events due after it.\n"
+            "        UInt load(UInt addr, UInt k) {\n"
+            "            if (addr < lc3::IO_START) return mem[addr];\n"
+            "            m.instructions = n + k;\n"
+            "            UInt v = m.read(addr);\n"
+            "            if (addr == lc3::KBSR && !(v & 0x8000) && m.console.ended) leave = starved = true;\n"
+            "            if (m.events.due() <= n + k) leave = device = true;\n"
+            "            return v;\n"
+            "        }\n"
+            "\n"
+            "        void store(UInt addr, UInt v, UInt k) {\n"
+            "            if (addr >= lc3::IO_START) {\n"
+            "                m.instructions = n + k;\n"
+            "                m.write(addr, v);\n"
+            "                if (m.halted()) leave = true;\n"
+            "                if (m.events.due() <= n + k) leave = device = true;\n"
+            "            } else {\n"
+            "                m.write(addr, v);\n"
+            "                if (inCode(addr)) leave = through = true;\n"
+            "            }\n"
+            "        }\n"
+            "\n";
+
+        static constexpr const char *PRELUDE_LOAD =
+            "/// @brief Load the translated program into a machine, which should have been reset\n"
+            "void lc3aot_load(lc3::Machine &m) {\n"
+            "    lc3::Image image(ORIGIN);\n"
+            "    image.words.assign(IMAGE, IMAGE + sizeof(IMAGE) / sizeof(UInt));\n"
+            "    m.load(image);\n"
+            "}\n"
+            "\n"
+            "/// @brief Run the machine like lc3::Machine::run, with the translated code where it applies\n";
+
+        static constexpr const char *PRELUDE_MAIN =
+            "\n"
+            "#ifndef LC3AOT_NO_MAIN\n"
+            "int main() {\n"
+            "    // The machine is over a megabyte, keep it off the stack\n"
+            "    std::unique_ptr<lc3::Machine> machine(new lc3::Machine());\n"
+            "    lc3aot_load(*machine);\n"
+            "    machine->console.in = &std::cin;\n"
+            "    machine->console.out = &std::cout;\n"
+            "\n"
+            "    if (lc3aot_run(*machine, UINT64_MAX) == lc3::STOP_INPUT) {\n"
+            "        std::cerr << \"the program waits for input, but the input has ended\" << std::endl;\n"
+            "        return 2;\n"
+            "    }\n"
+            "    return 0;\n"
+            "}\n"
+            "#endif\n";
+    };
+}
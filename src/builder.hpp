@@ -0,0 +1,138 @@
+#pragma once
+
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "lc3.hpp"
+
+namespace lc3 {
+    /// @brief Builds LC3 machine code from C++, with labels for PC-relative operands. Used for code the
+    ///        tools ship themselves, like the built-in operating system. This is not an assembler for
+    ///        user programs.
+    class CodeBuilder {
+        struct Fixup {
+            UInt at;
+            UInt bits;
+            string label;
+        };
+
+        UInt start;
+        vector<UInt> code;
+        map<string, UInt> labels;
+        vector<Fixup> fixups;
+
+        void ref(UInt bits, const string &label) {
+            fixups.push_back({ here(), bits, label });
+        }
+
+        public:
+        CodeBuilder(UInt origin): start(origin) {
+        }
+
+        /// @brief The address of the next word
+        UInt here() const {
+            return start + code.size();
+        }
+
+        /// @brief The origin of the code
+        UInt origin() const {
+            return start;
+        }
+
+        /// @brief Define a label at the next word
+        void label(const string &name) {
+            labels[name] = here();
+        }
+
+        /// @brief The address of a label, which must be defined already
+        UInt address(const string &name) const {
+            return labels.at(name);
+        }
+
+        void word(UInt w) {
+            code.push_back(w);
+        }
+
+        void stringz(const string &s) {
+            for (char c : s) word((unsigned char) c);
+            word(0);
+        }
+
+        void br(UInt nzp, const string &target) {
+            ref(9, target);
+            word((BR << 12) | (nzp << 9));
+        }
+
+        void add(UInt dr, UInt sr1, Int imm5) {
+            word((ADD << 12) | (dr << 9) | (sr1 << 6) | 0x20 | (imm5 & 0x1F));
+        }
+
+        void addr(UInt dr, UInt sr1, UInt sr2) {
+            word((ADD << 12) | (dr << 9) | (sr1 << 6) | sr2);
+        }
+
+        void andi(UInt dr, UInt sr1, Int imm5) {
+            word((AND << 12) | (dr << 9) | (sr1 << 6) | 0x20 | (imm5 & 0x1F));
+        }
+
+        void andr(UInt dr, UInt sr1, UInt sr2) {
+            word((AND << 12) | (dr << 9) | (sr1 << 6) | sr2);
+        }
+
+        void notr(UInt dr, UInt sr) {
+            word((NOT << 12) | (dr << 9) | (sr << 6) | 0x3F);
+        }
+
+        /// @brief LD, LDI, ST, STI or LEA with a label
+        void mem(UInt op, UInt r, const string &target) {
+            ref(9, target);
+            word((op << 12) | (r << 9));
+        }
+
+        /// @brief LDR or STR
+        void based(UInt op, UInt r, UInt base, Int off6) {
+            word((op << 12) | (r << 9) | (base << 6) | (off6 & 0x3F));
+        }
+
+        void jsr(const string &target) {
+            ref(11, target);
+            word((JSR << 12) | 0x800);
+        }
+
+        void jsrr(UInt base) {
+            word((JSR << 12) | (base << 6));
+        }
+
+        void jmp(UInt base) {
+            word((RET << 12) | (base << 6));
+        }
+
+        void ret() {
+            jmp(7);
+        }
+
+        void rti() {
+            word(RTI << 12);
+        }
+
+        void trap(UInt vector) {
+            word((TRAP << 12) | (vector & 0xFF));
+        }
+
+        /// @brief Resolve all labels and get the code. Throws out_of_range for undefined labels and
+        ///        labels out of reach.
+        vector<UInt> finish() {
+            for (const Fixup &f : fixups) {
+                int off = (Int) (labels.at(f.label) - (f.at + 1));
+                if (off < -(1 << (f.bits - 1)) || off >= (1 << (f.bits - 1)))
+                    throw out_of_range("label out of reach: " + f.label);
+
+                code[f.at - start] |= off & ((1 << f.bits) - 1);
+            }
+            fixups.clear();
+            return code;
+        }
+    };
+}
@@ -0,0 +1,552 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include "lc3.hpp"
+#include "image.hpp"
+
+namespace lc3 {
+    /// @brief The statically known control flow of a single instruction.
+    struct Flow {
+        bool falls;  // Execution may continue at the next word
+        bool jumps;  // Execution may continue at 'target'
+        bool call;   // The jump is a subroutine call (JSR), which is expected to return
+        UInt target;
+    };
+
+    /// @brief Determine where execution may continue after an instruction. Jumps to a register
+    ///        (JMP, RET, JSRR) have no statically known target, and TRAP x25 (HALT) and RTI are
+    ///        considered to not continue at all.
+    /// @param addr  The address of the instruction
+    /// @param insn  The instruction
+    /// @return      The control flow
+    inline Flow flowOf(UInt addr, UInt insn) {
+        UInt next = addr + 1;
+
+        switch (getBits(insn, 15, 12)) {
+            case BR:
+            {
+                UInt nzp = getBits(insn, 11, 9);
+                UInt target = next + sext(getBits(insn, 8, 0), 9);
+
+                if (nzp == 0) return { true, false, false, 0 };      // Never taken, a NOP
+                if (nzp == 7) return { false, true, false, target }; // Always taken
+                return { true, true, false, target };
+            }
+
+            case JSR:
+                if (!getBit(insn, 11))
+                    return { true, false, false, 0 };
+                return { true, true, true, (UInt) (next + sext(getBits(insn, 10, 0), 11)) };
+
+            case TRAP:
+                return { getBits(insn, 7, 0) != 0x25, false, false, 0 };
+
+            case RET:
+            case RTI:
+            case 0xD:
+                return { false, false, false, 0 };
+
+            default:
+                return { true, false, false, 0 };
+        }
+    }
+
+    /// @brief Check whether an instruction sets the condition codes.
+    inline bool setsCC(UInt insn) {
+        switch (getBits(insn, 15, 12)) {
+            case ADD: case AND: case NOT:
+            case LD: case LDI: case LDR: case LEA:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    /// @brief The control flow graph of an image, split in basic blocks. All edges are stored in flat
+    ///        arrays (compressed sparse rows). Node 'size()' is a virtual root whose successors are
+    ///        the entry points: the start of the image and all subroutines called with JSR.
+    struct CFG {
+        const Image &image;
+
+        vector<int> blockOf; // Block of each word in the image
+        vector<int> first;   // First word of each block
+        vector<int> last;    // Last word of each block
+
+        vector<int> succOff, succ;
+        vector<int> predOff, pred;
+
+        vector<int> entries;
+
+        CFG(const Image &image): image(image) {
+            size_t n = image.size();
+            if (n == 0) {
+                succOff.assign(2, 0);
+                predOff.assign(2, 0);
+                return;
+            }
+
+            // Find leaders
+            vector<char> leader(n, 0);
+            vector<char> entry(n, 0);
+            leader[0] = entry[0] = 1;
+
+            for (size_t i = 0; i < n; i++) {
+                Flow f = flowOf(image.address(i), image.words[i]);
+
+                if (f.jumps && image.contains(f.target)) {
+                    size_t t = image.index(f.target);
+                    leader[t] = 1;
+                    if (f.call) entry[t] = 1;
+                }
+
+                if ((f.jumps || !f.falls || getBits(image.words[i], 15, 12) == JSR) && i + 1 < n)
+                    leader[i + 1] = 1;
+            }
+
+            blockOf.resize(n);
+            for (size_t i = 0; i < n; i++) {
+                if (leader[i]) {
+                    if (!first.empty()) last.push_back(i - 1);
+                    first.push_back(i);
+                    if (entry[i]) entries.push_back(first.size() - 1);
+                }
+                blockOf[i] = first.size() - 1;
+            }
+            last.push_back(n - 1);
+
+            // Edges, stored as pairs first so we can bucket them
+            int nb = first.size();
+            vector<pair<int, int>> edges;
+            for (int b = 0; b < nb; b++) {
+                Flow f = flowOf(image.address(last[b]), image.words[last[b]]);
+
+                if (f.falls && (size_t) last[b] + 1 < n)
+                    edges.push_back({ b, b + 1 });
+                if (f.jumps && !f.call && image.contains(f.target))
+                    edges.push_back({ b, blockOf[image.index(f.target)] });
+            }
+            for (int e : entries)
+                edges.push_back({ nb, e });
+
+            bucket(edges, nb + 1, succOff, succ, false);
+            bucket(edges, nb + 1, predOff, pred, true);
+        }
+
+        /// @brief The amount of basic blocks, excluding the virtual root
+        int size() const {
+            return first.size();
+        }
+
+        /// @brief The virtual root node
+        int root() const {
+            return first.size();
+        }
+
+        private:
+        static void bucket(const vector<pair<int, int>> &edges, int nodes, vector<int> &off, vector<int> &to, bool reverse) {
+            off.assign(nodes + 1, 0);
+            to.resize(edges.size());
+
+            for (auto &e : edges)
+                off[(reverse ? e.second : e.first) + 1]++;
+            for (int i = 0; i < nodes; i++)
+                off[i + 1] += off[i];
+
+            vector<int> fill(off.begin(), off.end() - 1);
+            for (auto &e : edges) {
+                if (reverse) to[fill[e.second]++] = e.first;
+                else         to[fill[e.first]++] = e.second;
+            }
+        }
+    };
+
+    /// @brief Dominator tree of a CFG, computed with the iterative algorithm of Cooper, Harvey and
+    ///        Kennedy over the reverse postorder.
+    struct Dominators {
+        vector<int> idom;  // Immediate dominator of each node, -1 if unreachable. The root is its own.
+        vector<int> rpo;   // Reachable nodes in reverse postorder
+        vector<int> pre;   // Preorder number in the dominator tree
+        vector<int> post;  // Postorder number in the dominator tree
+
+        Dominators(const CFG &cfg) {
+            int nodes = cfg.size() + 1;
+            int root = cfg.root();
+
+            // Reverse postorder, iterative DFS
+            vector<int> order(nodes, -1);
+            vector<int> stack, edge(nodes, 0);
+            vector<char> seen(nodes, 0);
+
+            stack.push_back(root);
+            seen[root] = 1;
+            while (!stack.empty()) {
+                int v = stack.back();
+                int e = cfg.succOff[v] + edge[v];
+                if (e < cfg.succOff[v + 1]) {
+                    edge[v]++;
+                    int w = cfg.succ[e];
+                    if (!seen[w]) {
+                        seen[w] = 1;
+                        stack.push_back(w);
+                    }
+                } else {
+                    order[v] = rpo.size();
+                    rpo.push_back(v);
+                    stack.pop_back();
+                }
+            }
+            reverse(rpo.begin(), rpo.end());
+
+            // 'order' is the postorder number, higher means closer to the root
+            idom.assign(nodes, -1);
+            idom[root] = root;
+
+            bool changed = true;
+            while (changed) {
+                changed = false;
+
+                for (int b : rpo) {
+                    if (b == root) continue;
+
+                    int nidom = -1;
+                    for (int e = cfg.predOff[b]; e < cfg.predOff[b + 1]; e++) {
+                        int p = cfg.pred[e];
+                        if (idom[p] < 0) continue;
+
+                        if (nidom < 0) {
+                            nidom = p;
+                        } else {
+                            int x = p, y = nidom;
+                            while (x != y) {
+                                while (order[x] < order[y]) x = idom[x];
+                                while (order[y] < order[x]) y = idom[y];
+                            }
+                            nidom = x;
+                        }
+                    }
+
+                    if (idom[b] != nidom) {
+                        idom[b] = nidom;
+                        changed = true;
+                    }
+                }
+            }
+
+            // Number the dominator tree so that dominance queries are constant time
+            vector<int> childOff(nodes + 1, 0), child;
+            for (int v : rpo)
+                if (v != root) childOff[idom[v] + 1]++;
+            for (int i = 0; i < nodes; i++)
+                childOff[i + 1] += childOff[i];
+            child.resize(childOff[nodes]);
+            vector<int> fill(childOff.begin(), childOff.end() - 1);
+            for (int v : rpo)
+                if (v != root) child[fill[idom[v]]++] = v;
+
+            pre.assign(nodes, -1);
+            post.assign(nodes, -1);
+            fill.assign(nodes, 0);
+
+            int counter = 0;
+            stack.clear();
+            stack.push_back(root);
+            pre[root] = counter++;
+            while (!stack.empty()) {
+                int v = stack.back();
+                int c = childOff[v] + fill[v];
+                if (c < childOff[v + 1]) {
+                    fill[v]++;
+                    pre[child[c]] = counter++;
+                    stack.push_back(child[c]);
+                } else {
+                    post[v] = counter++;
+                    stack.pop_back();
+                }
+            }
+        }
+
+        /// @brief Check whether node a dominates node b. Every node dominates itself.
+        bool dominates(int a, int b) const {
+            if (pre[a] < 0 || pre[b] < 0) return false;
+            return pre[a] <= pre[b] && post[b] <= post[a];
+        }
+    };
+
+    /// @brief An estimate of how many times a loop runs, derived from a counter register that is
+    ///        stepped right before the branch that closes the loop, like:
+    ///            ADD    R1 R1 #-1
+    ///            BRp    [OFFSET -4]
+    struct TripCount {
+        bool counted;    // A counter pattern was found
+        UInt reg;        // The counter register
+        Int  step;       // The immediate added to the counter every iteration
+        UInt nzp;        // The condition of the closing branch
+        bool known;      // The initial value of the counter is known
+        Int  init;       // The initial value of the counter
+        long iterations; // The amount of iterations, -1 if not known
+    };
+
+    /// @brief A natural loop: a header plus every block that can reach a back edge into the header
+    ///        without passing the header.
+    struct Loop {
+        int header;
+        int parent;          // The innermost loop containing this one, -1 if none
+        int depth;           // 1 for outermost loops
+        vector<int> blocks;  // Including the header
+        vector<int> latches; // Blocks with a back edge to the header
+        TripCount trip;
+    };
+
+    /// @brief All natural loops of a CFG and how they nest.
+    struct LoopNest {
+        vector<Loop> loops;   // Outermost loops first
+        vector<int> innermost; // Innermost loop of each block, -1 if none
+
+        LoopNest(const CFG &cfg, const Dominators &dom) {
+            int nb = cfg.size();
+            innermost.assign(nb, -1);
+
+            // Back edges, grouped by header
+            vector<int> loopOf(nb, -1);
+            for (int t = 0; t < nb; t++) {
+                for (int e = cfg.succOff[t]; e < cfg.succOff[t + 1]; e++) {
+                    int h = cfg.succ[e];
+                    if (!dom.dominates(h, t)) continue;
+
+                    if (loopOf[h] < 0) {
+                        loopOf[h] = loops.size();
+                        loops.push_back({ h, -1, 0, {}, {}, {} });
+                    }
+                    loops[loopOf[h]].latches.push_back(t);
+                }
+            }
+
+            // Bodies
+            vector<int> stamp(nb, -1), work;
+            for (size_t l = 0; l < loops.size(); l++) {
+                Loop &loop = loops[l];
+
+                stamp[loop.header] = l;
+                loop.blocks.push_back(loop.header);
+                for (int t : loop.latches) {
+                    if (stamp[t] != (int) l) {
+                        stamp[t] = l;
+                        loop.blocks.push_back(t);
+                        work.push_back(t);
+                    }
+                }
+
+                while (!work.empty()) {
+                    int v = work.back();
+                    work.pop_back();
+
+                    for (int e = cfg.predOff[v]; e < cfg.predOff[v + 1]; e++) {
+                        int p = cfg.pred[e];
+                        if (p == cfg.root() || stamp[p] == (int) l) continue;
+                        stamp[p] = l;
+                        loop.blocks.push_back(p);
+                        work.push_back(p);
+                    }
+                }
+
+                sort(loop.blocks.begin(), loop.blocks.end());
+            }
+
+            // Nesting: natural loops with distinct headers are either disjoint or nested, so by
+            // visiting larger loops first, the innermost loop of a header is its parent.
+            stable_sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b) {
+                return a.blocks.size() > b.blocks.size();
+            });
+
+            for (size_t l = 0; l < loops.size(); l++) {
+                Loop &loop = loops[l];
+                loop.parent = innermost[loop.header];
+                loop.depth = loop.parent < 0 ? 1 : loops[loop.parent].depth + 1;
+
+                for (int b : loop.blocks)
+                    innermost[b] = l;
+            }
+
+            for (Loop &loop : loops)
+                loop.trip = tripCount(cfg, loop);
+        }
+
+        /// @brief The loop depth of a block, 0 if it is not in a loop.
+        int depth(int block) const {
+            return innermost[block] < 0 ? 0 : loops[innermost[block]].depth;
+        }
+
+        private:
+        static TripCount tripCount(const CFG &cfg, const Loop &loop) {
+            const Image &image = cfg.image;
+            TripCount none = { false, 0, 0, 0, false, 0, -1 };
+
+            if (loop.latches.size() != 1) return none;
+
+            // The latch must end in a conditional branch back to the header, right after the
+            // counter is stepped
+            int latch = loop.latches[0];
+            UInt br = image.words[cfg.last[latch]];
+            if (getBits(br, 15, 12) != BR) return none;
+
+            TripCount trip = none;
+            trip.nzp = getBits(br, 11, 9);
+            if (trip.nzp == 0 || trip.nzp == 7) return none;
+
+            int cc = -1;
+            for (int i = cfg.last[latch] - 1; i >= cfg.first[latch]; i--) {
+                if (setsCC(image.words[i])) {
+                    cc = i;
+                    break;
+                }
+            }
+            if (cc < 0) return none;
+
+            UInt step = image.words[cc];
+            if (getBits(step, 15, 12) != ADD || !getBit(step, 5)) return none;
+            if (getBits(step, 11, 9) != getBits(step, 8, 6)) return none;
+
+            trip.reg = getBits(step, 11, 9);
+            trip.step = sext(getBits(step, 4, 0), 5);
+            if (trip.step == 0) return none;
+
+            // Nothing else in the loop may write the counter
+            for (int b : loop.blocks) {
+                for (int i = cfg.first[b]; i <= cfg.last[b]; i++) {
+                    if (i != cc && writes(image.words[i], trip.reg)) return none;
+                }
+            }
+
+            trip.counted = true;
+
+            // The initial value comes from the preheader: the only block outside the loop that
+            // enters the header.
+            int preheader = -1;
+            for (int e = cfg.predOff[loop.header]; e < cfg.predOff[loop.header + 1]; e++) {
+                int p = cfg.pred[e];
+                if (binary_search(loop.blocks.begin(), loop.blocks.end(), p)) continue;
+                if (preheader >= 0 || p == cfg.root()) return trip;
+                preheader = p;
+            }
+            if (preheader < 0) return trip;
+
+            // Constant propagation over the chain of blocks leading into the preheader
+            vector<int> chain = { preheader };
+            while (chain.size() < 8) {
+                int b = chain.back();
+                if (cfg.predOff[b + 1] - cfg.predOff[b] != 1) break;
+                int p = cfg.pred[cfg.predOff[b]];
+                if (p == cfg.root() || find(chain.begin(), chain.end(), p) != chain.end()) break;
+                chain.push_back(p);
+            }
+
+            bool known[8] = { false };
+            Int value[8] = { 0 };
+            for (auto it = chain.rbegin(); it != chain.rend(); it++)
+                for (int i = cfg.first[*it]; i <= cfg.last[*it]; i++)
+                    propagate(image, i, known, value);
+
+            if (!known[trip.reg]) return trip;
+
+            trip.known = true;
+            trip.init = value[trip.reg];
+
+            // The loop body runs, steps the counter, and continues while the condition holds
+            long x = trip.init;
+            long s = trip.step < 0 ? -trip.step : trip.step;
+            long n = -1;
+
+            if (trip.step < 0 && trip.nzp == 1) n = x > 0 ? (x + s - 1) / s : 1;   // BRp
+            if (trip.step < 0 && trip.nzp == 3) n = x >= 0 ? x / s + 1 : 1;        // BRzp
+            if (trip.step > 0 && trip.nzp == 4) n = x < 0 ? (-x + s - 1) / s : 1;  // BRn
+            if (trip.step > 0 && trip.nzp == 6) n = x <= 0 ? -x / s + 1 : 1;       // BRnz
+
+            trip.iterations = n;
+            return trip;
+        }
+
+        /// @brief Check whether an instruction may write a register
+        static bool writes(UInt insn, UInt reg) {
+            switch (getBits(insn, 15, 12)) {
+                case ADD: case AND: case NOT:
+                case LD: case LDI: case LDR: case LEA:
+                    return getBits(insn, 11, 9) == reg;
+                case JSR:
+                    return reg == 7;
+                case TRAP:
+                    return reg == 7 || reg == 0;
+                default:
+                    return false;
+            }
+        }
+
+        /// @brief Track registers holding a known constant through a single instruction
+        static void propagate(const Image &image, int i, bool known[8], Int value[8]) {
+            UInt insn = image.words[i];
+            UInt dr = getBits(insn, 11, 9);
+            UInt sr = getBits(insn, 8, 6);
+
+            switch (getBits(insn, 15, 12)) {
+                case ADD:
+                case AND:
+                {
+                    bool isAdd = getBits(insn, 15, 12) == ADD;
+                    bool kb;
+                    Int b;
+                    if (getBit(insn, 5)) {
+                        kb = true;
+                        b = sext(getBits(insn, 4, 0), 5);
+                    } else {
+                        kb = known[getBits(insn, 2, 0)];
+                        b = value[getBits(insn, 2, 0)];
+                    }
+
+                    if (!isAdd && kb && b == 0) {
+                        known[dr] = true;
+                        value[dr] = 0;
+                    } else if (known[sr] && kb) {
+                        value[dr] = isAdd ? value[sr] + b : value[sr] & b;
+                        known[dr] = true;
+                    } else {
+                        known[dr] = false;
+                    }
+                    break;
+                }
+
+                case NOT:
+                    known[dr] = known[sr];
+                    value[dr] = ~value[sr];
+                    break;
+
+                case LEA:
+                    known[dr] = true;
+                    value[dr] = image.address(i) + 1 + sext(getBits(insn, 8, 0), 9);
+                    break;
+
+                case LD:
+                {
+                    UInt addr = image.address(i) + 1 + sext(getBits(insn, 8, 0), 9);
+                    known[dr] = image.contains(addr);
+                    if (known[dr]) value[dr] = image.words[image.index(addr)];
+                    break;
+                }
+
+                case LDI:
+                case LDR:
+                    known[dr] = false;
+                    break;
+
+                case JSR:
+                    known[7] = false;
+                    break;
+
+                case TRAP:
+                    known[7] = false;
+                    known[0] = false;
+                    break;
+            }
+        }
+    };
+}
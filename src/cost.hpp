@@ -0,0 +1,251 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "cfg.hpp"
+
+namespace lc3 {
+    /// @brief The cost of executing something: clock cycles and data memory accesses. Instruction
+    ///        fetches are included in the cycles but not counted as memory accesses.
+    struct Cost {
+        unsigned cycles;
+        unsigned memory;
+    };
+
+    /// @brief Builds the cost of every opcode. Cycles are the amount of states the LC3 control FSM
+    ///        visits (3 for fetch, 1 for decode, then execution), assuming memory responds in a
+    ///        single cycle.
+    constexpr array<Cost, 16> makeOpcodeCosts() {
+        array<Cost, 16> costs = {};
+
+        costs[BR]   = { 6, 0 };
+        costs[ADD]  = { 5, 0 };
+        costs[LD]   = { 7, 1 };
+        costs[ST]   = { 7, 1 };
+        costs[JSR]  = { 6, 0 };
+        costs[AND]  = { 5, 0 };
+        costs[LDR]  = { 7, 1 };
+        costs[STR]  = { 7, 1 };
+        costs[RTI]  = { 12, 2 };
+        costs[NOT]  = { 5, 0 };
+        costs[LDI]  = { 9, 2 };
+        costs[STI]  = { 9, 2 };
+        costs[RET]  = { 5, 0 };
+        costs[0xD]  = { 4, 0 };
+        costs[LEA]  = { 5, 0 };
+        costs[TRAP] = { 7, 1 };
+
+        return costs;
+    }
+
+    /// @brief The cost of every opcode, indexed by the instruction constants
+    inline constexpr array<Cost, 16> OPCODE_COSTS = makeOpcodeCosts();
+
+    /// @brief The cost of the service routine behind each trap vector, on top of the TRAP instruction
+    ///        itself. The defaults are rough counts for the usual OS routines, without any time spent
+    ///        waiting on the keyboard or display. PUTS and PUTSP assume a string of 16 characters.
+    struct TrapCosts {
+        array<Cost, 256> routines;
+
+        TrapCosts(): routines() {
+            routines[0x20] = { 35, 3 };   // GETC
+            routines[0x21] = { 50, 5 };   // OUT
+            routines[0x22] = { 700, 64 }; // PUTS
+            routines[0x23] = { 250, 22 }; // IN
+            routines[0x24] = { 800, 56 }; // PUTSP
+            routines[0x25] = { 180, 16 }; // HALT
+        }
+    };
+
+    /// @brief A cost estimate, where UNBOUNDED marks that no bound could be derived
+    struct Estimate {
+        static constexpr uint64_t UNBOUNDED = UINT64_MAX;
+
+        uint64_t cycles;
+        uint64_t memory;
+
+        static uint64_t add(uint64_t a, uint64_t b) {
+            return (a == UNBOUNDED || b == UNBOUNDED || a + b < a) ? UNBOUNDED : a + b;
+        }
+
+        static uint64_t mul(uint64_t a, uint64_t b) {
+            if (a == 0 || b == 0) return 0;
+            if (a == UNBOUNDED || b == UNBOUNDED || a > UNBOUNDED / b) return UNBOUNDED;
+            return a * b;
+        }
+
+        Estimate operator+(const Estimate &o) const {
+            return { add(cycles, o.cycles), add(memory, o.memory) };
+        }
+
+        Estimate operator*(uint64_t n) const {
+            return { mul(cycles, n), mul(memory, n) };
+        }
+    };
+
+    /// @brief Best and worst case cost of every entry of a CFG (the program and each subroutine),
+    ///        including the subroutines it calls. Loops run their derived iteration count, or at
+    ///        least once in the best case and unboundedly often in the worst case when no count is
+    ///        known.
+    struct CostEstimate {
+        vector<Estimate> best;  // Per entry, in the order of cfg.entries
+        vector<Estimate> worst;
+
+        CostEstimate(const CFG &cfg, const Dominators &dom, const LoopNest &nest, const TrapCosts &traps):
+            cfg(cfg), dom(dom), nest(nest), traps(traps) {
+
+            size_t n = cfg.entries.size();
+            best.resize(n);
+            worst.resize(n);
+            state.assign(n, 0);
+
+            for (size_t e = 0; e < n; e++)
+                estimate(e);
+        }
+
+        private:
+        const CFG &cfg;
+        const Dominators &dom;
+        const LoopNest &nest;
+        const TrapCosts &traps;
+
+        vector<char> state; // 0 = not visited, 1 = being estimated, 2 = done
+
+        void estimate(int e) {
+            if (state[e]) return;
+            state[e] = 1;
+
+            const Image &image = cfg.image;
+            int nb = cfg.size();
+            int entry = cfg.entries[e];
+
+            // Topological order of the blocks of this entry, with back edges removed
+            vector<char> color(nb, 0);
+            vector<int> order, stack, edge(nb, 0);
+            bool cyclic = false;
+
+            stack.push_back(entry);
+            color[entry] = 1;
+            while (!stack.empty()) {
+                int v = stack.back();
+                int i = cfg.succOff[v] + edge[v];
+                if (i < cfg.succOff[v + 1]) {
+                    edge[v]++;
+                    int w = cfg.succ[i];
+                    if (dom.dominates(w, v)) continue;
+                    if (color[w] == 1) cyclic = true; // Irreducible
+                    if (color[w]) continue;
+                    color[w] = 1;
+                    stack.push_back(w);
+                } else {
+                    color[v] = 2;
+                    order.push_back(v);
+                    stack.pop_back();
+                }
+            }
+            reverse(order.begin(), order.end());
+
+            // Cost of each block, weighted by the iterations of the loops it is in
+            vector<Estimate> lo(nb), hi(nb);
+            for (int b : order) {
+                Estimate bl = { 0, 0 }, bh = { 0, 0 };
+
+                for (int i = cfg.first[b]; i <= cfg.last[b]; i++) {
+                    UInt insn = image.words[i];
+                    UInt op = getBits(insn, 15, 12);
+                    Estimate c = { OPCODE_COSTS[op].cycles, OPCODE_COSTS[op].memory };
+                    bl = bl + c;
+                    bh = bh + c;
+
+                    if (op == TRAP) {
+                        Cost r = traps.routines[getBits(insn, 7, 0)];
+                        bl = bl + Estimate { r.cycles, r.memory };
+                        bh = bh + Estimate { r.cycles, r.memory };
+                    } else if (op == JSR) {
+                        Flow f = flowOf(image.address(i), insn);
+                        int callee = -1;
+                        if (f.jumps && image.contains(f.target)) {
+                            int t = cfg.blockOf[image.index(f.target)];
+                            callee = find(cfg.entries.begin(), cfg.entries.end(), t) - cfg.entries.begin();
+                        }
+
+                        if (callee >= 0 && callee < (int) cfg.entries.size()) {
+                            estimate(callee);
+                        }
+
+                        if (callee < 0 || callee >= (int) cfg.entries.size() || state[callee] != 2) {
+                            // JSRR, a target outside the image, or recursion
+                            bh = { Estimate::UNBOUNDED, Estimate::UNBOUNDED };
+                        } else {
+                            bl = bl + best[callee];
+                            bh = bh + worst[callee];
+                        }
+                    }
+                }
+
+                uint64_t ml = 1, mh = 1;
+                for (int l = nest.innermost[b]; l >= 0; l = nest.loops[l].parent) {
+                    long it = nest.loops[l].trip.iterations;
+                    if (it < 0) {
+                        mh = Estimate::UNBOUNDED;
+                    } else {
+                        ml = Estimate::mul(ml, it);
+                        mh = Estimate::mul(mh, it);
+                    }
+                }
+
+                lo[b] = bl * ml;
+                hi[b] = bh * mh;
+            }
+
+            // Shortest and longest paths from the entry to any block without successors
+            const Estimate none = { Estimate::UNBOUNDED, Estimate::UNBOUNDED };
+            vector<Estimate> dl(nb, none), dh(nb, { 0, 0 });
+            vector<char> reached(nb, 0);
+
+            dl[entry] = lo[entry];
+            dh[entry] = hi[entry];
+            reached[entry] = 1;
+
+            Estimate rl = none, rh = { 0, 0 };
+            bool exits = false;
+
+            for (int v : order) {
+                if (!reached[v]) continue;
+
+                if (cfg.succOff[v] == cfg.succOff[v + 1]) {
+                    exits = true;
+                    rl = { min(rl.cycles, dl[v].cycles), min(rl.memory, dl[v].memory) };
+                    rh = { max(rh.cycles, dh[v].cycles), max(rh.memory, dh[v].memory) };
+                }
+
+                for (int i = cfg.succOff[v]; i < cfg.succOff[v + 1]; i++) {
+                    int w = cfg.succ[i];
+                    if (dom.dominates(w, v) || color[w] != 2) continue;
+
+                    Estimate pl = dl[v] + lo[w];
+                    Estimate ph = dh[v] + hi[w];
+                    if (!reached[w]) {
+                        dl[w] = pl;
+                        dh[w] = ph;
+                        reached[w] = 1;
+                    } else {
+                        dl[w] = { min(dl[w].cycles, pl.cycles), min(dl[w].memory, pl.memory) };
+                        dh[w] = { max(dh[w].cycles, ph.cycles), max(dh[w].memory, ph.memory) };
+                    }
+                }
+            }
+
+            if (!exits || cyclic) rh = none;
+
+            best[e] = rl;
+            worst[e] = rh;
+            state[e] = 2;
+        }
+    };
+}
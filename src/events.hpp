@@ -0,0 +1,55 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "lc3.hpp"
+
+namespace lc3 {
+    /// @brief What a device has to do at some point in time
+    enum EventKind : uint8_t {
+        EVENT_TIMER,    // The interval of the timer has passed
+        EVENT_INTERRUPT // Something an interrupt depends on changed, see if one can be taken
+    };
+
+    struct Event {
+        uint64_t at; // The instruction count at which it is due
+        EventKind kind;
+    };
+
+    /// @brief The events of the devices, as a min-heap on when they are due. A machine only looks at
+    ///        its devices when the first event is due, or when a device register is accessed, so
+    ///        that devices cost nothing while they are idle.
+    class EventQueue {
+        public:
+        /// @brief When the first event is due, or UINT64_MAX if there are no events
+        uint64_t due() const {
+            return heap.empty() ? UINT64_MAX : heap.front().at;
+        }
+
+        void schedule(uint64_t at, EventKind kind) {
+            heap.push_back({ at, kind });
+            push_heap(heap.begin(), heap.end(), later);
+        }
+
+        /// @brief Remove the first event
+        Event next() {
+            pop_heap(heap.begin(), heap.end(), later);
+            Event e = heap.back();
+            heap.pop_back();
+            return e;
+        }
+
+        void clear() {
+            heap.clear();
+        }
+
+        private:
+        vector<Event> heap;
+
+        static bool later(const Event &a, const Event &b) {
+            return a.at > b.at;
+        }
+    };
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "lc3.hpp"
+#include "machine.hpp"
+
+namespace lc3 {
+    class ExpressionError {
+        public:
+        string problem;
+        ExpressionError(string problem): problem(problem) {
+        }
+    };
+
+    /// @brief The operations of compiled expressions, on a stack of words
+    enum ExprOp : uint8_t {
+        EXPR_CONST, // Push 'arg'
+        EXPR_REG,   // Push register 'arg'
+        EXPR_PC,
+        EXPR_PSR,
+        EXPR_MEM,   // Replace the top with the word at that address
+        EXPR_NEG,   // Unary operators replace the top
+        EXPR_NOT,
+        EXPR_LNOT,
+        EXPR_MUL,   // Binary operators replace the top two
+        EXPR_ADD,
+        EXPR_SUB,
+        EXPR_LT,
+        EXPR_LE,
+        EXPR_GT,
+        EXPR_GE,
+        EXPR_EQ,
+        EXPR_NE,
+        EXPR_AND,
+        EXPR_XOR,
+        EXPR_OR,
+        EXPR_LAND,
+        EXPR_LOR
+    };
+
+    struct ExprCode {
+        ExprOp op;
+        UInt arg;
+    };
+
+    /// @brief An expression over the state of a machine, compiled to code for a small stack
+    ///        machine, so that evaluating it is a loop over a few operations. Values are words, and
+    ///        wrap around like LC3 arithmetic. Comparisons are signed, like the condition codes, and
+    ///        give 1 or 0.
+    struct Expression {
+        // The deepest stack compileExpression allows
+        static const size_t MAX_DEPTH = 16;
+
+        vector<ExprCode> code;
+
+        UInt evaluate(const Machine &m) const {
+            UInt stack[MAX_DEPTH];
+            size_t top = 0;
+
+            #define BINARY(expr) { UInt b = stack[--top], a = stack[top - 1]; stack[top - 1] = (expr); break; }
+
+            for (const ExprCode &c : code) {
+                switch (c.op) {
+                    case EXPR_CONST: stack[top++] = c.arg; break;
+                    case EXPR_REG:   stack[top++] = m.reg[c.arg]; break;
+                    case EXPR_PC:    stack[top++] = m.pc; break;
+                    case EXPR_PSR:   stack[top++] = m.psr; break;
+                    case EXPR_MEM:   stack[top - 1] = m.mem[stack[top - 1]]; break;
+                    case EXPR_NEG:   stack[top - 1] = -stack[top - 1]; break;
+                    case EXPR_NOT:   stack[top - 1] = ~stack[top - 1]; break;
+                    case EXPR_LNOT:  stack[top - 1] = !stack[top - 1]; break;
+                    case EXPR_MUL:   BINARY(a * b)
+                    case EXPR_ADD:   BINARY(a + b)
+                    case EXPR_SUB:   BINARY(a - b)
+                    case EXPR_LT:    BINARY((Int) a < (Int) b)
+                    case EXPR_LE:    BINARY((Int) a <= (Int) b)
+                    case EXPR_GT:    BINARY((Int) a > (Int) b)
+                    case EXPR_GE:    BINARY((Int) a >= (Int) b)
+                    case EXPR_EQ:    BINARY(a == b)
+                    case EXPR_NE:    BINARY(a != b)
+                    case EXPR_AND:   BINARY(a & b)
+                    case EXPR_XOR:   BINARY(a ^ b)
+                    case EXPR_OR:    BINARY(a | b)
+                    case EXPR_LAND:  BINARY(a && b)
+                    case EXPR_LOR:   BINARY(a || b)
+                }
+            }
+
+            #undef BINARY
+
+            return stack[0];
+        }
+    };
+
+    /// @brief Compile an expression like 'R3 == x4000 && mem[R6] > 0'. Operands are the registers
+    ///        R0 to R7, PC and PSR, words of memory as mem[address], numbers like lc3c writes them
+    ///        (x4000, #-1 or 12) and characters like 'A'. The operators and their precedence are
+    ///        those of C: unary - ~ !, then *, + -, < <= > >=, == !=, &, ^, |, && and ||.
+    ///        Memory is read as it is, reading device registers has no side effects.
+    /// @param source  The expression
+    /// @return        The compiled expression
+    inline Expression compileExpression(const string &source) {
+        Expression expr;
+        size_t at = 0;
+        size_t depth = 0;
+
+        auto emit = [&](ExprOp op, UInt arg, int change) {
+            expr.code.push_back({ op, arg });
+            depth += change;
+            if (depth > Expression::MAX_DEPTH)
+                throw ExpressionError("expression too deeply nested: '" + source + "'");
+        };
+
+        auto skip = [&]() {
+            while (at < source.size() && isspace((unsigned char) source[at])) at++;
+        };
+
+        // Take 'token' if it comes next. Not when it is the start of a longer operator, like '<'
+        // in '<=' or '&' in '&&'.
+        auto take = [&](const string &token) {
+            skip();
+            if (source.compare(at, token.size(), token) != 0) return false;
+            if (token.size() == 1 && at + 1 < source.size()) {
+                char next = source[at + 1];
+                if ((token == "&" || token == "|") && next == token[0]) return false;
+                if ((token == "<" || token == ">" || token == "!") && next == '=') return false;
+            }
+            at += token.size();
+            return true;
+        };
+
+        auto unexpected = [&]() {
+            skip();
+            if (at == source.size()) return ExpressionError("unexpected end of expression '" + source + "'");
+            return ExpressionError("unexpected '" + source.substr(at) + "' in expression '" + source + "'");
+        };
+
+        // Binary operators by precedence, loosest first
+        struct Level {
+            vector<pair<string, ExprOp>> ops;
+        };
+        static const vector<Level> levels = {
+            { { { "||", EXPR_LOR } } },
+            { { { "&&", EXPR_LAND } } },
+            { { { "|", EXPR_OR } } },
+            { { { "^", EXPR_XOR } } },
+            { { { "&", EXPR_AND } } },
+            { { { "==", EXPR_EQ }, { "!=", EXPR_NE } } },
+            { { { "<=", EXPR_LE }, { ">=", EXPR_GE }, { "<", EXPR_LT }, { ">", EXPR_GT } } },
+            { { { "+", EXPR_ADD }, { "-", EXPR_SUB } } },
+            { { { "*", EXPR_MUL } } }
+        };
+
+        auto unary = [&](auto &self, auto &binary) -> void {
+            if (take("-")) { self(self, binary); emit(EXPR_NEG, 0, 0); return; }
+            if (take("~")) { self(self, binary); emit(EXPR_NOT, 0, 0); return; }
+            if (take("!")) { self(self, binary); emit(EXPR_LNOT, 0, 0); return; }
+
+            if (take("(")) {
+                binary(binary, 0);
+                if (!take(")")) throw unexpected();
+                return;
+            }
+
+            skip();
+            size_t start = at;
+            while (at < source.size() && (isalnum((unsigned char) source[at]) || source[at] == '#'
+                    || (source[at] == '-' && at > start && source[start] == '#' && at == start + 1)))
+                at++;
+            string word = source.substr(start, at - start);
+            string name = word;
+            for (char &c : name) c = toupper(c);
+
+            if (word.empty() && at + 2 < source.size() && source[at] == '\'' && source[at + 2] == '\'') {
+                emit(EXPR_CONST, (unsigned char) source[at + 1], 1);
+                at += 3;
+            } else if (name.size() == 2 && name[0] == 'R' && name[1] >= '0' && name[1] <= '7') {
+                emit(EXPR_REG, name[1] - '0', 1);
+            } else if (name == "PC") {
+                emit(EXPR_PC, 0, 1);
+            } else if (name == "PSR") {
+                emit(EXPR_PSR, 0, 1);
+            } else if (name == "MEM") {
+                if (!take("[")) throw unexpected();
+                binary(binary, 0);
+                if (!take("]")) throw unexpected();
+                emit(EXPR_MEM, 0, 0);
+            } else if (!word.empty()) {
+                int base = 10;
+                size_t digits = 0;
+                if (name[0] == 'X') {
+                    base = 16;
+                    digits = 1;
+                } else if (name[0] == '#') {
+                    digits = 1;
+                }
+                bool negative = base == 10 && digits < word.size() && word[digits] == '-';
+                if (negative) digits++;
+
+                char *p;
+                unsigned long long n = strtoull(word.c_str() + digits, &p, base);
+                if (digits == word.size() || *p != 0 || n > 0xFFFF)
+                    throw ExpressionError("invalid operand '" + word + "' in expression '" + source + "'");
+                emit(EXPR_CONST, negative ? -n : n, 1);
+            } else {
+                at = start;
+                throw unexpected();
+            }
+        };
+
+        auto binary = [&](auto &self, size_t level) -> void {
+            if (level == levels.size()) {
+                unary(unary, self);
+                return;
+            }
+
+            self(self, level + 1);
+            for (;;) {
+                bool found = false;
+                for (const auto &op : levels[level].ops) {
+                    if (take(op.first)) {
+                        self(self, level + 1);
+                        emit(op.second, 0, -1);
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found) return;
+            }
+        };
+
+        binary(binary, 0);
+        skip();
+        if (at != source.size()) throw unexpected();
+        return expr;
+    }
+}
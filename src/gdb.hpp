@@ -0,0 +1,467 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+
+#include "lc3.hpp"
+#include "machine.hpp"
+#include "expression.hpp"
+#include "history.hpp"
+
+namespace lc3 {
+    /// @brief Serves the GDB remote serial protocol to one client, over a connected socket. Only
+    ///        for systems with POSIX sockets.
+    ///
+    ///        GDB sees memory in bytes, so every word is two bytes at twice its address, low byte
+    ///        first. The PC is such a byte address too, so that it matches the addresses GDB sets
+    ///        breakpoints at. The registers are R0 to R7, PC and PSR, described to GDB in
+    ///        target.xml. Breakpoints, software and hardware alike, and write watchpoints are those
+    ///        of the machine, so that continuing runs at full speed on its engine until one is hit.
+    ///        'monitor list' prints instructions like lc3c does.
+    ///
+    ///        The program runs through a History, so that GDB can step and continue backwards.
+    ///        Changing registers or memory starts the history over.
+    class GdbStub {
+        public:
+        // Instructions between looks at the connection for an interrupt, while continuing
+        static const uint64_t SLICE = 1 << 22;
+
+        GdbStub(Machine &machine, int fd): machine(machine), history(machine), fd(fd), taken(0), acks(true),
+                breaks(0x10000, 0), watches(0x10000, 0), watchedAt(0) {
+            machine.breakCondition = nullptr;
+            machine.watchCondition = [this](UInt addr) {
+                watchedAt = addr;
+                return true;
+            };
+        }
+
+        /// @brief Serve the client until it detaches or kills the program, or the connection closes
+        void serve() {
+            string packet;
+            while (receive(packet)) {
+                bool done = false;
+                string reply = handle(packet, done);
+                if (done && reply.empty()) return;
+                send(reply);
+                if (packet == "QStartNoAckMode") acks = false;
+                if (done) return;
+            }
+        }
+
+        private:
+        Machine &machine;
+        History history;
+        int fd;
+
+        string input;  // Received but not handled yet
+        size_t taken;  // Characters of 'input' already handled
+        bool acks;     // Whether packets are acknowledged, until the client turns that off
+
+        vector<uint8_t> breaks;  // Breakpoints at each address: 1 when software, 2 when hardware
+        vector<uint8_t> watches; // Watchpoints the client set on each word, they may overlap
+        UInt watchedAt;          // The word the last watchpoint hit was on
+
+        // Registers in the order of target.xml
+        static const int REGISTERS = 10;
+
+        static constexpr const char *TARGET_XML =
+            "<?xml version=\"1.0\"?>"
+            "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+            "<target version=\"1.0\">"
+            "<feature name=\"org.lc3tools.lc3\">"
+            "<reg name=\"r0\" bitsize=\"16\" type=\"int16\"/>"
+            "<reg name=\"r1\" bitsize=\"16\" type=\"int16\"/>"
+            "<reg name=\"r2\" bitsize=\"16\" type=\"int16\"/>"
+            "<reg name=\"r3\" bitsize=\"16\" type=\"int16\"/>"
+            "<reg name=\"r4\" bitsize=\"16\" type=\"int16\"/>"
+            "<reg name=\"r5\" bitsize=\"16\" type=\"int16\"/>"
+            "<reg name=\"r6\" bitsize=\"16\" type=\"int16\"/>"
+            "<reg name=\"r7\" bitsize=\"16\" type=\"int16\"/>"
+            "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+            "<reg name=\"psr\" bitsize=\"16\" type=\"uint16\"/>"
+            "</feature>"
+            "</target>";
+
+        // The next character from the client, or -1 when the connection is closed
+        int get() {
+            if (taken == input.size()) {
+                input.clear();
+                taken = 0;
+                char buf[4096];
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n <= 0) return -1;
+                input.append(buf, n);
+            }
+            return (unsigned char) input[taken++];
+        }
+
+        void put(const string &data) {
+            size_t done = 0;
+            while (done < data.size()) {
+                ssize_t n = write(fd, data.data() + done, data.size() - done);
+                if (n <= 0) return;
+                done += n;
+            }
+        }
+
+        // Read the next packet, acknowledging it. A lone interrupt character is returned as is.
+        // @return False when the connection is closed
+        bool receive(string &packet) {
+            for (;;) {
+                int c = get();
+                if (c < 0) return false;
+                if (c == 0x03) {
+                    packet = "\x03";
+                    return true;
+                }
+                if (c != '$') continue; // Acknowledgements, and noise
+
+                packet.clear();
+                while ((c = get()) >= 0 && c != '#') packet.push_back(c);
+                int high = get(), low = get();
+                if (low < 0) return false;
+
+                unsigned sum = 0;
+                for (char ch : packet) sum += (unsigned char) ch;
+                bool ok = (sum & 0xFF) == (unsigned) (digit(high) << 4 | digit(low));
+                if (acks) put(ok ? "+" : "-");
+                if (ok) return true;
+            }
+        }
+
+        void send(const string &payload) {
+            unsigned sum = 0;
+            for (char ch : payload) sum += (unsigned char) ch;
+            char check[4];
+            snprintf(check, sizeof(check), "%02x", sum & 0xFF);
+            string framed = "$" + payload + "#" + check;
+
+            for (;;) {
+                put(framed);
+                if (!acks) return;
+                int c = get();
+                if (c != '-') return; // Anything but a request to send it again
+            }
+        }
+
+        // Whether the client interrupted a continue. Does not wait.
+        bool interrupted() {
+            struct pollfd p = { fd, POLLIN, 0 };
+            if (taken == input.size() && poll(&p, 1, 0) <= 0) return false;
+            int c = get();
+            if (c == 0x03 || c < 0) return true;
+            taken--; // Something else, leave it for later
+            return false;
+        }
+
+        static int digit(int c) {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return 0;
+        }
+
+        static string hexBytes(const string &data) {
+            static const char digits[] = "0123456789abcdef";
+            string hex;
+            for (char c : data) {
+                hex.push_back(digits[(unsigned char) c >> 4]);
+                hex.push_back(digits[c & 0xF]);
+            }
+            return hex;
+        }
+
+        static string fromHexBytes(const string &hex) {
+            string data;
+            for (size_t i = 0; i + 1 < hex.size(); i += 2)
+                data.push_back(digit(hex[i]) << 4 | digit(hex[i + 1]));
+            return data;
+        }
+
+        // A number as GDB sees it, low byte first
+        static string hexNumber(uint32_t v, int bytes) {
+            string data;
+            for (int i = 0; i < bytes; i++) data.push_back((char) (v >> i * 8));
+            return hexBytes(data);
+        }
+
+        static uint32_t parseNumber(const string &hex) {
+            string data = fromHexBytes(hex);
+            uint32_t v = 0;
+            for (size_t i = 0; i < data.size() && i < 4; i++) v |= (uint32_t) (unsigned char) data[i] << i * 8;
+            return v;
+        }
+
+        // The size of a register in bytes. The PC is a byte address, which does not fit in a word.
+        static int registerSize(int n) {
+            return n == 8 ? 4 : 2;
+        }
+
+        uint32_t getRegister(int n) const {
+            return n < 8 ? machine.reg[n] : n == 8 ? machine.pc * 2 : machine.psr;
+        }
+
+        void setRegister(int n, uint32_t v) {
+            if (n < 8) machine.reg[n] = v;
+            else if (n == 8) machine.pc = v / 2;
+            else machine.psr = v;
+        }
+
+        // The reply to a packet that stops the program, after it stopped
+        string stopReply(Stop stop) {
+            char reply[32];
+            switch (stop) {
+                case STOP_HALT:
+                    return "W00";
+
+                case STOP_INPUT:
+                    // Like lc3sim, which exits with 2 when the input has ended
+                    return "W02";
+
+                case STOP_WATCH:
+                    snprintf(reply, sizeof(reply), "T05watch:%x;", watchedAt * 2);
+                    return reply;
+
+                default:
+                    return "S05";
+            }
+        }
+
+        // Set or clear breakpoints and watchpoints, like 'Z0,3000,2'
+        string point(const string &packet) {
+            bool set = packet[0] == 'Z';
+            int type = packet[1] - '0';
+            size_t comma = packet.find(',', 3);
+            if (packet.size() < 4 || comma == string::npos) return "E01";
+            uint32_t addr = strtoul(packet.c_str() + 3, nullptr, 16);
+            uint32_t len = strtoul(packet.c_str() + comma + 1, nullptr, 16);
+
+            if (type == 0 || type == 1) {
+                UInt word = addr / 2;
+                uint8_t kind = type == 0 ? 1 : 2;
+                breaks[word] = set ? breaks[word] | kind : breaks[word] & ~kind;
+                machine.setBreakpoint(word, breaks[word] != 0);
+                return "OK";
+            }
+
+            if (type == 2) {
+                if (len == 0) len = 1;
+                for (uint32_t w = addr / 2; w <= (addr + len - 1) / 2 && w < IO_START; w++) {
+                    if (!set && watches[w] == 0) continue;
+                    watches[w] += set ? 1 : -1;
+                    machine.setWatchpoint(w, watches[w] != 0);
+                }
+                return "OK";
+            }
+
+            return ""; // Read and access watchpoints are not supported
+        }
+
+        // 'monitor' commands
+        string monitor(const string &command) {
+            istringstream tokens(command);
+            string name, from, count;
+            tokens >> name >> from >> count;
+
+            if (name == "list") {
+                UInt addr = machine.pc;
+                uint64_t n = 10;
+                try {
+                    if (!from.empty()) addr = compileExpression(from).evaluate(machine);
+                } catch (ExpressionError exc) {
+                    return exc.problem + "\n";
+                }
+                if (!count.empty()) n = strtoull(count.c_str(), nullptr, 10);
+
+                string text;
+                char prefix[16];
+                for (uint64_t i = 0; i < n; i++) {
+                    UInt at = addr + i;
+                    Instruction insn(machine.mem[at]);
+                    snprintf(prefix, sizeof(prefix), "%s x%04X | ", at == machine.pc ? "=>" : "  ", at);
+                    text += prefix + insn.hexString() + " | " + insn.assemblyString() + "\n";
+                }
+                return text;
+            }
+
+            return "Commands:\n"
+                   "  list [<address>] [<count>]: Print instructions like lc3c, 10 from the PC by default.\n"
+                   "      Addresses are LC3 word addresses, like x3000.\n";
+        }
+
+        string query(const string &packet) {
+            if (packet.rfind("qSupported", 0) == 0)
+                return "PacketSize=4000;qXfer:features:read+;QStartNoAckMode+;ReverseStep+;ReverseContinue+";
+
+            static const string xfer = "qXfer:features:read:target.xml:";
+            if (packet.rfind(xfer, 0) == 0) {
+                size_t comma = packet.find(',', xfer.size());
+                if (comma == string::npos) return "E01";
+                size_t offset = strtoul(packet.c_str() + xfer.size(), nullptr, 16);
+                size_t length = strtoul(packet.c_str() + comma + 1, nullptr, 16);
+                string xml = TARGET_XML;
+                if (offset >= xml.size()) return "l";
+                string part = xml.substr(offset, length);
+                return (offset + part.size() < xml.size() ? "m" : "l") + part;
+            }
+
+            if (packet.rfind("qRcmd,", 0) == 0) return hexBytes(monitor(fromHexBytes(packet.substr(6))));
+            if (packet == "qAttached") return "1";
+            if (packet == "qC") return "QC1";
+            if (packet == "qfThreadInfo") return "m1";
+            if (packet == "qsThreadInfo") return "l";
+            return "";
+        }
+
+        // The reply to a packet, empty when it is not supported
+        // @param done  Set when the client is done with the program
+        string handle(const string &packet, bool &done) {
+            if (packet.empty()) return "";
+
+            switch (packet[0]) {
+                case 0x03: // Interrupted while stopped
+                case '?':
+                    return "S05";
+
+                case 'g':
+                {
+                    string reply;
+                    for (int r = 0; r < REGISTERS; r++) reply += hexNumber(getRegister(r), registerSize(r));
+                    return reply;
+                }
+
+                case 'G':
+                {
+                    size_t at = 1;
+                    for (int r = 0; r < REGISTERS; r++) {
+                        size_t digits = registerSize(r) * 2;
+                        if (at + digits > packet.size()) return "E01";
+                        setRegister(r, parseNumber(packet.substr(at, digits)));
+                        at += digits;
+                    }
+                    history.clear();
+                    return "OK";
+                }
+
+                case 'p':
+                {
+                    int r = strtoul(packet.c_str() + 1, nullptr, 16);
+                    return r < REGISTERS ? hexNumber(getRegister(r), registerSize(r)) : "E01";
+                }
+
+                case 'P':
+                {
+                    size_t eq = packet.find('=');
+                    int r = strtoul(packet.c_str() + 1, nullptr, 16);
+                    if (eq == string::npos || r >= REGISTERS) return "E01";
+                    setRegister(r, parseNumber(packet.substr(eq + 1)));
+                    history.clear();
+                    return "OK";
+                }
+
+                case 'm':
+                case 'M':
+                {
+                    size_t comma = packet.find(',');
+                    if (comma == string::npos) return "E01";
+                    uint32_t addr = strtoul(packet.c_str() + 1, nullptr, 16);
+                    uint32_t len = strtoul(packet.c_str() + comma + 1, nullptr, 16);
+                    if (addr + len > 0x20000) return "E01";
+
+                    if (packet[0] == 'm') {
+                        string bytes;
+                        for (uint32_t b = addr; b < addr + len; b++) {
+                            UInt w = machine.mem[b / 2];
+                            bytes.push_back(b & 1 ? w >> 8 : w & 0xFF);
+                        }
+                        return hexBytes(bytes);
+                    }
+
+                    size_t colon = packet.find(':', comma);
+                    if (colon == string::npos) return "E01";
+                    string bytes = fromHexBytes(packet.substr(colon + 1));
+                    if (bytes.size() < len) return "E01";
+                    for (uint32_t i = 0; i < len; i++) {
+                        uint32_t b = addr + i;
+                        UInt w = machine.mem[b / 2];
+                        UInt v = (unsigned char) bytes[i];
+                        w = b & 1 ? (w & 0x00FF) | v << 8 : (w & 0xFF00) | v;
+                        machine.write(b / 2, w);
+                    }
+                    history.clear();
+                    return "OK";
+                }
+
+                case 'c':
+                {
+                    if (packet.size() > 1) {
+                        machine.pc = strtoul(packet.c_str() + 1, nullptr, 16) / 2;
+                        history.clear();
+                    }
+
+                    // The client steps off a breakpoint itself, but not every client does
+                    machine.passBreak = true;
+                    for (;;) {
+                        Stop stop = history.run(SLICE);
+                        if (stop != STOP_LIMIT) return stopReply(stop);
+                        if (interrupted()) return "S02";
+                    }
+                }
+
+                case 's':
+                    if (packet.size() > 1) {
+                        machine.pc = strtoul(packet.c_str() + 1, nullptr, 16) / 2;
+                        history.clear();
+                    }
+                    return stopReply(history.step());
+
+                case 'b':
+                    // At the start of the history, GDB is told the replay log begins there
+                    if (packet == "bs") return history.stepBack(1) ? "S05" : "T05replaylog:begin;";
+                    if (packet == "bc") {
+                        Stop stop = history.continueBack();
+                        return stop == STOP_LIMIT ? "T05replaylog:begin;" : stopReply(stop);
+                    }
+                    return "";
+
+                case 'Z':
+                case 'z':
+                    return point(packet);
+
+                case 'q':
+                    return query(packet);
+
+                case 'Q':
+                    return packet == "QStartNoAckMode" ? "OK" : "";
+
+                case 'H':
+                case 'T':
+                    return "OK";
+
+                case 'v':
+                    if (packet.rfind("vKill", 0) == 0) {
+                        done = true;
+                        return "OK";
+                    }
+                    return "";
+
+                case 'k':
+                    done = true;
+                    return "";
+
+                case 'D':
+                    done = true;
+                    return "OK";
+
+                default:
+                    return "";
+            }
+        }
+    };
+}
@@ -0,0 +1,511 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <streambuf>
+#include <vector>
+
+#include "lc3.hpp"
+#include "machine.hpp"
+
+namespace lc3 {
+    /// @brief The history of a machine, to go back in: a step back, or back to where a run would
+    ///        have stopped last. Run the machine through run() and step() here, which take a
+    ///        checkpoint every so many instructions, and the machine can go back to any instruction
+    ///        count since the history started by restoring the last checkpoint before it and
+    ///        replaying from there.
+    ///
+    ///        Replaying only needs the keys the program read: the timer counts instructions and a
+    ///        step leaves the same state a run passes through, so the machine does the same every
+    ///        time. The console keeps every key it read from console.in, and a checkpoint how many
+    ///        of them the program had taken, so that is the log of all there is to replay. Keys
+    ///        must come from console.in, not be added to console.input between runs.
+    ///
+    ///        A checkpoint holds the registers, and the pages of 256 words that changed since the
+    ///        one before it: the stores mark their pages, and only marked pages that differ from
+    ///        their last version are kept. The interval adapts to how fast the machine runs, so
+    ///        that replaying from a checkpoint takes about REPLAY_SECONDS. When the checkpoints take
+    ///        more than MAX_BYTES, every other older one is dropped, which leaves the recent ones
+    ///        dense. Going back far then replays more, and takes checkpoints again on the way.
+    ///
+    ///        After going back, the program writes what it wrote before to the display again. The
+    ///        history passes on only what was not shown yet. Don't save() and restore() the machine
+    ///        while it has a history, they track the same stores.
+    class History {
+        public:
+        // How long replaying from a checkpoint may take
+        static constexpr double REPLAY_SECONDS = 0.001;
+
+        static const uint64_t MIN_INTERVAL = 1 << 12;
+        static const uint64_t MAX_INTERVAL = (uint64_t) 1 << 30;
+
+        // The memory checkpoints may take before older ones are thinned out, and how many of the
+        // most recent ones are never
+        static const size_t MAX_BYTES = (size_t) 1 << 27;
+        static const size_t RECENT = 64;
+
+        // Instructions before a point to replay to that are stepped instead of run, since a run
+        // only stops at control instructions
+        static const uint64_t MARGIN = 256;
+
+        // Instructions between checkpoints. Adapts to how fast the machine runs, on every run.
+        uint64_t interval;
+
+        /// @brief Start the history of a machine at the state it is in
+        History(Machine &machine): interval(MIN_INTERVAL), machine(machine), stream(&display) {
+            if (machine.console.out != nullptr) {
+                display.out = machine.console.out;
+                machine.console.out = &stream;
+            }
+            clear();
+        }
+
+        History(const History &) = delete;
+
+        ~History() {
+            if (display.out != nullptr) machine.console.out = display.out;
+        }
+
+        /// @brief Forget the history, and start it over at the state the machine is in. Do so after
+        ///        changing the state other than by running it.
+        void clear() {
+            checkpoints.clear();
+            words.clear();
+            unused.clear();
+            for (vector<Version> &v : versions) v.clear();
+
+            // The first checkpoint holds every page
+            Checkpoint c = state();
+            for (size_t page = 0; page < 0x100; page++)
+                versions[page].push_back({ c.at, store(page) });
+            memset(machine.dirty, 0, sizeof(machine.dirty));
+            checkpoints.push_back(c);
+        }
+
+        /// @brief The instruction count the history starts at, which the machine can't go back past
+        uint64_t start() const {
+            return checkpoints.front().at;
+        }
+
+        /// @brief Run the machine like Machine::run, taking checkpoints on the way
+        Stop run(uint64_t limit) {
+            uint64_t end = machine.instructions + limit < machine.instructions ? UINT64_MAX : machine.instructions + limit;
+            for (;;) {
+                uint64_t from = machine.instructions;
+                size_t keys = machine.console.input.size();
+                auto began = chrono::steady_clock::now();
+
+                Stop stop = machine.run(min(end - from, interval));
+
+                // Waiting for a key says nothing about how fast the machine runs
+                chrono::duration<double> took = chrono::steady_clock::now() - began;
+                if (machine.console.input.size() == keys) measure(machine.instructions - from, took.count());
+
+                checkpoint();
+                if (stop != STOP_LIMIT || machine.instructions >= end) return stop;
+            }
+        }
+
+        /// @brief Execute one instruction like Machine::step
+        Stop step() {
+            Stop stop = machine.step();
+            checkpoint();
+            return stop;
+        }
+
+        /// @brief Go back a number of instructions, or to the start of the history if that is closer
+        /// @return False when it stopped at the start of the history
+        bool stepBack(uint64_t count) {
+            uint64_t back = min(count, machine.instructions - start());
+            if (back > 0) travel(machine.instructions - back);
+            return back == count;
+        }
+
+        /// @brief Go back to the last point before this one where a run would have stopped: at a
+        ///        breakpoint, or after a store to a watchpoint, when its condition holds. The
+        ///        conditions are asked like a run asks them, and once more at the point gone back to.
+        /// @return STOP_BREAK or STOP_WATCH, or STOP_LIMIT when it went back to the start of the
+        ///         history without finding one
+        Stop continueBack() {
+            // Look for the last stop from one checkpoint on, and from the one before if there is
+            // none, up to where the search before started. A store to a watchpoint that ends right
+            // where that search started is in this one.
+            uint64_t to = machine.instructions;
+            bool here = true;
+            while (to > start()) {
+                uint64_t from = before(to - 1)->at;
+                uint64_t found = UINT64_MAX;
+                Stop stop = STOP_LIMIT;
+                UInt where = 0;
+                {
+                    Replaying replaying(*this, true);
+                    UInt watched = 0;
+                    function<bool(UInt)> watch = machine.watchCondition;
+                    machine.watchCondition = [&](UInt addr) {
+                        if (watch && !watch(addr)) return false;
+                        watched = addr;
+                        return true;
+                    };
+
+                    restore(*before(from));
+                    bool passing = false;
+                    while (machine.instructions < to) {
+                        machine.passBreak = passing;
+                        Stop s = machine.run(min(to - machine.instructions, interval));
+                        checkpoint();
+                        uint64_t at = machine.instructions;
+                        if ((s == STOP_BREAK && at < to) || (s == STOP_WATCH && (at < to || (at == to && !here)))) {
+                            found = at;
+                            stop = s;
+                            where = s == STOP_BREAK ? machine.pc : watched;
+                        }
+                        if (s == STOP_HALT || s == STOP_INPUT) break;
+
+                        // Go on like a continue does, past a breakpoint at the PC
+                        passing = true;
+                    }
+                }
+                to = from;
+                here = false;
+
+                if (found != UINT64_MAX) {
+                    travel(found);
+
+                    // Let the conditions see the stop again, they may remember which it was
+                    const function<bool(UInt)> &condition = stop == STOP_BREAK ? machine.breakCondition : machine.watchCondition;
+                    if (condition) condition(where);
+                    return stop;
+                }
+            }
+
+            travel(start());
+            return STOP_LIMIT;
+        }
+
+        /// @brief Replay from the start of the history, and compare the state at every checkpoint
+        ///        to what restoring it gives. Slow, for lc3bench. The machine ends up where it was.
+        /// @return The instruction count of the first checkpoint that restores something else, or
+        ///         UINT64_MAX if they are all right
+        uint64_t check() {
+            uint64_t now = machine.instructions;
+            vector<uint64_t> counts;
+            for (const Checkpoint &c : checkpoints) counts.push_back(c.at);
+
+            uint64_t wrong = UINT64_MAX;
+            {
+                Replaying replaying(*this, false);
+                restore(checkpoints.front());
+                for (uint64_t at : counts) {
+                    while (machine.instructions < at) {
+                        uint64_t left = at - machine.instructions;
+                        Stop stop = left > MARGIN ? machine.run(left - MARGIN) : machine.step();
+                        if (stop == STOP_HALT || stop == STOP_INPUT) break;
+                    }
+                    // A run can't stop in a long stretch without control instructions
+                    if (machine.instructions != at) continue;
+
+                    const Checkpoint &c = *before(at);
+                    bool same = memcmp(machine.reg, c.reg, sizeof(c.reg)) == 0 && machine.pc == c.pc
+                        && machine.psr == c.psr && machine.savedSSP == c.savedSSP && machine.savedUSP == c.savedUSP
+                        && machine.tick == c.tick && machine.console.taken == c.taken;
+                    for (size_t p = 0; p < 0x100 && same; p++)
+                        same = memcmp(machine.mem + (p << 8), page(p, at), PAGE_BYTES) == 0;
+                    if (!same) {
+                        wrong = at;
+                        break;
+                    }
+                }
+            }
+
+            travel(now);
+            return wrong;
+        }
+
+        private:
+        static const size_t PAGE_BYTES = 0x100 * sizeof(UInt);
+
+        struct Checkpoint {
+            uint64_t at;        // The instruction count
+            UInt reg[8];
+            UInt pc;
+            UInt psr;
+            UInt savedSSP;
+            UInt savedUSP;
+            uint64_t fusions[FUSIONS];
+            EventQueue events;
+            uint64_t tick;
+            size_t taken;       // Keys the program had taken
+            uint64_t written;   // Characters the program had written to the display
+        };
+
+        // A page as it is from a checkpoint on, up to the next version
+        struct Version {
+            uint64_t at;
+            uint32_t slot;      // Where its words are in 'words', in pages
+        };
+
+        // Passes on what the program writes to the display, except what it already showed before
+        // it went back
+        class Display : public streambuf {
+            public:
+            ostream *out = nullptr;
+            uint64_t written = 0; // Characters the program wrote, up to the point it is at
+            uint64_t shown = 0;   // Characters shown, the most it ever wrote
+            bool muted = false;   // While replaying
+
+            protected:
+            streamsize xsputn(const char *s, streamsize n) override {
+                uint64_t from = written;
+                written += n;
+                if (muted || written <= shown) return n;
+                uint64_t skip = shown > from ? shown - from : 0;
+                out->write(s + skip, n - skip);
+                shown = written;
+                return n;
+            }
+
+            int overflow(int c) override {
+                if (c == EOF) return 0;
+                char ch = c;
+                xsputn(&ch, 1);
+                return c;
+            }
+
+            int sync() override {
+                out->flush();
+                return 0;
+            }
+        };
+
+        // While replaying, the display is muted and the keyboard only has the keys read before. The
+        // breakpoints and watchpoints don't stop the machine, unless 'stopping'.
+        class Replaying {
+            public:
+            Replaying(History &history, bool stopping): history(history), in(history.machine.console.in),
+                    breakCondition(history.machine.breakCondition), watchCondition(history.machine.watchCondition) {
+                Machine &m = history.machine;
+                history.display.muted = true;
+                m.console.in = nullptr;
+                if (!stopping) {
+                    m.breakCondition = [](UInt) { return false; };
+                    m.watchCondition = [](UInt) { return false; };
+                }
+            }
+
+            ~Replaying() {
+                Machine &m = history.machine;
+                history.display.muted = false;
+                m.console.in = in;
+                m.breakCondition = breakCondition;
+                m.watchCondition = watchCondition;
+            }
+
+            private:
+            History &history;
+            istream *in;
+            function<bool(UInt)> breakCondition;
+            function<bool(UInt)> watchCondition;
+        };
+
+        Machine &machine;
+        Display display;
+        ostream stream;                  // Writes to 'display'
+
+        vector<Checkpoint> checkpoints;  // By instruction count, the first is where the history starts
+        vector<Version> versions[0x100]; // Of every page, by instruction count
+        vector<UInt> words;              // The words of the versions, a page at a time
+        vector<uint32_t> unused;         // Pages in 'words' of versions that were dropped
+
+        // The machine ran 'count' instructions in 'seconds', adapt the interval to that
+        void measure(uint64_t count, double seconds) {
+            if (count < MIN_INTERVAL || seconds <= 0) return;
+            double wanted = count / seconds * REPLAY_SECONDS;
+            wanted = (interval + wanted) / 2;
+            interval = wanted < MIN_INTERVAL ? MIN_INTERVAL : wanted > MAX_INTERVAL ? MAX_INTERVAL : (uint64_t) wanted;
+        }
+
+        Checkpoint state() const {
+            Checkpoint c;
+            c.at = machine.instructions;
+            memcpy(c.reg, machine.reg, sizeof(c.reg));
+            c.pc = machine.pc;
+            c.psr = machine.psr;
+            c.savedSSP = machine.savedSSP;
+            c.savedUSP = machine.savedUSP;
+            memcpy(c.fusions, machine.fusions, sizeof(c.fusions));
+            c.events = machine.events;
+            c.tick = machine.tick;
+            c.taken = machine.console.taken;
+            c.written = display.written + machine.console.output.size();
+            return c;
+        }
+
+        // The last checkpoint at or before an instruction count
+        vector<Checkpoint>::iterator before(uint64_t at) {
+            return prev(upper_bound(checkpoints.begin(), checkpoints.end(), at, [](uint64_t at, const Checkpoint &c) {
+                return at < c.at;
+            }));
+        }
+
+        // The words of a page at an instruction count
+        const UInt *page(size_t page, uint64_t at) const {
+            const vector<Version> &v = versions[page];
+            auto after = upper_bound(v.begin(), v.end(), at, [](uint64_t at, const Version &version) {
+                return at < version.at;
+            });
+            return &words[(size_t) prev(after)->slot << 8];
+        }
+
+        // Room for a page in 'words'
+        uint32_t allocate() {
+            if (!unused.empty()) {
+                uint32_t slot = unused.back();
+                unused.pop_back();
+                return slot;
+            }
+            words.resize(words.size() + 0x100);
+            return (words.size() >> 8) - 1;
+        }
+
+        // Keep a copy of a page of memory
+        uint32_t store(size_t page) {
+            uint32_t slot = allocate();
+            memcpy(&words[(size_t) slot << 8], machine.mem + (page << 8), PAGE_BYTES);
+            return slot;
+        }
+
+        size_t bytes() const {
+            return ((words.size() >> 8) - unused.size()) * PAGE_BYTES + checkpoints.size() * sizeof(Checkpoint);
+        }
+
+        // Take a checkpoint, unless there is one less than an interval away
+        void checkpoint() {
+            uint64_t now = machine.instructions;
+            auto next = upper_bound(checkpoints.begin(), checkpoints.end(), now, [](uint64_t at, const Checkpoint &c) {
+                return at < c.at;
+            });
+            if (now - prev(next)->at < interval) return;
+            if (next != checkpoints.end() && next->at - now < interval) return;
+
+            for (size_t p = 0; p < 0x100; p++) {
+                // Device registers change without stores, so their pages are always compared
+                if (!machine.dirty[p] && p < IO_START >> 8) continue;
+                machine.dirty[p] = 0;
+                if (memcmp(machine.mem + (p << 8), page(p, now), PAGE_BYTES) == 0) continue;
+
+                vector<Version> &v = versions[p];
+                auto after = upper_bound(v.begin(), v.end(), now, [](uint64_t at, const Version &version) {
+                    return at < version.at;
+                });
+
+                // Between two checkpoints, the one after may have the page as it is before this one,
+                // without a version of its own. It needs one now.
+                if (next != checkpoints.end() && (after == v.end() || after->at != next->at)) {
+                    uint32_t slot = allocate();
+                    memcpy(&words[(size_t) slot << 8], &words[(size_t) prev(after)->slot << 8], PAGE_BYTES);
+                    after = v.insert(after, { next->at, slot });
+                }
+                v.insert(after, { now, store(p) });
+            }
+            checkpoints.insert(next, state());
+
+            while (bytes() > MAX_BYTES && thin());
+        }
+
+        // Drop every other checkpoint but the first and the recent ones
+        // @return Whether there were any to drop
+        bool thin() {
+            if (checkpoints.size() <= RECENT + 2) return false;
+            size_t recent = checkpoints.size() - RECENT;
+            size_t kept = 1;
+            for (size_t i = 1; i < checkpoints.size(); i++) {
+                if (i < recent && i % 2 == 1) continue;
+                checkpoints[kept++] = move(checkpoints[i]);
+            }
+            checkpoints.resize(kept);
+
+            // A version holds from the first checkpoint left at or after it, and of the versions that
+            // end up at the same one the last is the page at that point
+            for (vector<Version> &v : versions) {
+                size_t left = 0;
+                for (Version version : v) {
+                    version.at = lower_bound(checkpoints.begin(), checkpoints.end(), version.at, [](const Checkpoint &c, uint64_t at) {
+                        return c.at < at;
+                    })->at;
+                    if (left > 0 && v[left - 1].at == version.at) {
+                        unused.push_back(v[left - 1].slot);
+                        v[left - 1] = version;
+                    } else {
+                        v[left++] = version;
+                    }
+                }
+                v.resize(left);
+            }
+            return true;
+        }
+
+        // Put the machine in the state of a checkpoint, and its display at that point
+        void restore(const Checkpoint &c) {
+            for (size_t p = 0; p < 0x100; p++) {
+                machine.dirty[p] = 0;
+                const UInt *from = page(p, c.at);
+                UInt *to = machine.mem + (p << 8);
+                if (memcmp(to, from, PAGE_BYTES) == 0) continue;
+                for (size_t i = 0; i < 0x100; i++) {
+                    if (to[i] == from[i]) continue;
+                    to[i] = from[i];
+                    machine.invalidate((p << 8) + i);
+                }
+            }
+
+            machine.instructions = c.at;
+            memcpy(machine.reg, c.reg, sizeof(c.reg));
+            machine.pc = c.pc;
+            machine.psr = c.psr;
+            machine.savedSSP = c.savedSSP;
+            machine.savedUSP = c.savedUSP;
+            memcpy(machine.fusions, c.fusions, sizeof(c.fusions));
+            machine.events = c.events;
+            machine.tick = c.tick;
+            machine.console.taken = c.taken;
+            if (display.out != nullptr) {
+                machine.console.output.clear();
+                display.written = c.written;
+            } else {
+                // Without a display, the console keeps all output
+                machine.console.output.resize(c.written);
+            }
+        }
+
+        // Go to the state after an instruction count, from the last checkpoint before it
+        void travel(uint64_t at) {
+            Replaying replaying(*this, false);
+            for (uint64_t margin = MARGIN;; margin *= 16) {
+                restore(*before(at));
+                if (replay(at, margin)) return;
+            }
+        }
+
+        // Replay up to an instruction count, running until 'margin' before it and stepping from there
+        // @return False when a run went past it, on a long stretch without control instructions
+        bool replay(uint64_t at, uint64_t margin) {
+            while (machine.instructions < at) {
+                uint64_t left = at - machine.instructions;
+                Stop stop;
+                if (left > margin) {
+                    stop = machine.run(min(left - margin, interval));
+                    checkpoint();
+                } else {
+                    stop = machine.step();
+                }
+                if (stop == STOP_HALT || stop == STOP_INPUT) break;
+            }
+            return machine.instructions <= at;
+        }
+    };
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "lc3.hpp"
+
+namespace lc3 {
+    /// @brief A contiguous piece of LC3 memory, as read from an input file.
+    struct Image {
+        UInt origin;
+        vector<UInt> words;
+
+        Image(): origin(0x3000) {
+        }
+
+        Image(UInt origin): origin(origin) {
+        }
+
+        /// @brief The amount of words in the image
+        size_t size() const {
+            return words.size();
+        }
+
+        /// @brief Get the address of the word at the specified index. Addresses wrap around at xFFFF.
+        /// @param index The index into the image
+        /// @return      The address in LC3 memory
+        UInt address(size_t index) const {
+            return (UInt) (origin + index);
+        }
+
+        /// @brief Get the index of the word at the specified address. This does not check whether the
+        ///        address is actually in the image, use contains() for that.
+        /// @param addr The address in LC3 memory
+        /// @return     The index into the image
+        size_t index(UInt addr) const {
+            return (UInt) (addr - origin);
+        }
+
+        /// @brief Check whether an address lies within the image.
+        /// @param addr The address in LC3 memory
+        /// @return     True if the image has a word at that address
+        bool contains(UInt addr) const {
+            return index(addr) < words.size();
+        }
+    };
+
+    /// @brief Read a program that has a number on each line. Empty lines are skipped, or end the input
+    ///        if it is interactive. Invalid lines are reported on the standard error.
+    /// @param in           The input
+    /// @param base         16 for hexadecimal input, 2 for binary input
+    /// @param interactive  Whether an empty line ends the input
+    /// @param word         Called for every non-empty line as word(value, valid)
+    template <typename F>
+    void readLines(istream &in, int base, bool interactive, F word) {
+        for (string line; getline(in, line);) {
+            if (line.length() == 0) { // Empty line
+                if (interactive) {
+                    break;
+                } else {
+                    continue;
+                }
+            }
+
+            char *p;
+            unsigned long long n = strtoull(line.c_str(), &p, base);
+            if (*p != 0) {
+                std::cerr << "Invalid opcode: " << p << endl;
+                word((UInt) 0, false);
+            } else {
+                word((UInt) n, true);
+            }
+        }
+    }
+
+    /// @brief Read an LC3 object file. It consists of big-endian words, the first of which is the
+    ///        origin of the program.
+    /// @param in     The input, opened in binary mode
+    /// @param image  The image to read into, its origin is replaced
+    /// @return       False if the file has no origin or ends halfway a word
+    inline bool readObj(istream &in, Image &image) {
+        char buf[4096];
+        bool header = true;
+        int high = -1;
+
+        while (in) {
+            in.read(buf, sizeof(buf));
+            streamsize n = in.gcount();
+
+            for (streamsize i = 0; i < n; i++) {
+                unsigned char c = buf[i];
+                if (high < 0) {
+                    high = c;
+                    continue;
+                }
+
+                UInt w = (high << 8) | c;
+                high = -1;
+
+                if (header) {
+                    image.origin = w;
+                    header = false;
+                } else {
+                    image.words.push_back(w);
+                }
+            }
+        }
+
+        return !header && high < 0;
+    }
+}
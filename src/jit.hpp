@@ -0,0 +1,753 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "lc3.hpp"
+#include "machine.hpp"
+
+namespace lc3 {
+    /// @brief The state shared between the JIT compiled code and the dispatcher. Compiled code keeps
+    ///        a pointer to it in rdi.
+    struct JitState {
+        UInt *mem;
+        UInt *reg;
+        uint8_t *cached;
+        uint8_t *dirty;
+        const void *const *entries; // Code of the block at each address, or the exit stub
+        Machine *machine;
+        uint64_t n;                 // Instructions executed
+        uint64_t end;               // Instruction limit or first event, checked at control instructions
+        uint32_t cc;                // The last result, the condition codes are derived from it
+        uint32_t pc;
+        uint8_t limited;            // Set when compiled code left because of 'end'
+    };
+
+    /// @brief Writes x86-64 machine code into a buffer. Only what the JIT needs.
+    class Emitter {
+        public:
+        // Host registers
+        enum {
+            RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+            R8 = 8, R9, R10, R11, R12, R13, R14, R15
+        };
+
+        // Condition codes of jcc and cmovcc
+        enum {
+            CC_NE = 0x5, CC_AE = 0x3, CC_S = 0x8, CC_NS = 0x9, CC_E = 0x4, CC_LE = 0xE, CC_G = 0xF
+        };
+
+        // A memory operand: [base + index * scale + disp]
+        struct Mem {
+            int base;
+            int index; // Or -1
+            int scale; // 1, 2, 4 or 8
+            int32_t disp;
+        };
+
+        uint8_t *code;
+        size_t size;
+        size_t pos;
+
+        Emitter(uint8_t *code, size_t size): code(code), size(size), pos(0) {
+        }
+
+        uint8_t *here() const {
+            return code + pos;
+        }
+
+        void byte(uint8_t b) {
+            code[pos++] = b;
+        }
+
+        void dword(uint32_t d) {
+            memcpy(code + pos, &d, 4);
+            pos += 4;
+        }
+
+        void qword(uint64_t q) {
+            memcpy(code + pos, &q, 8);
+            pos += 8;
+        }
+
+        void bytes(initializer_list<uint8_t> bs) {
+            for (uint8_t b : bs) byte(b);
+        }
+
+        /// @brief Operand size prefix and REX prefix, as needed
+        void prefix(int bits, int reg, int index, int base) {
+            if (bits == 16) byte(0x66);
+            uint8_t rex = 0x40 | (bits == 64 ? 8 : 0) | ((reg >> 3) & 1) << 2 | ((index >> 3) & 1) << 1 | ((base >> 3) & 1);
+            if (rex != 0x40) byte(rex);
+        }
+
+        /// @brief An instruction with a register operand and a register r/m operand
+        void rr(int bits, initializer_list<uint8_t> opcode, int reg, int rm) {
+            prefix(bits, reg, 0, rm);
+            bytes(opcode);
+            byte(0xC0 | (reg & 7) << 3 | (rm & 7));
+        }
+
+        /// @brief An instruction with a register operand and a memory r/m operand
+        void rm(int bits, initializer_list<uint8_t> opcode, int reg, Mem m) {
+            prefix(bits, reg, m.index < 0 ? 0 : m.index, m.base);
+            bytes(opcode);
+
+            int mod = (m.disp == 0 && (m.base & 7) != RBP) ? 0 : (m.disp >= -128 && m.disp < 128) ? 1 : 2;
+            if (m.index < 0 && (m.base & 7) != RSP) {
+                byte(mod << 6 | (reg & 7) << 3 | (m.base & 7));
+            } else {
+                int ss = m.scale == 8 ? 3 : m.scale == 4 ? 2 : m.scale == 2 ? 1 : 0;
+                byte(mod << 6 | (reg & 7) << 3 | RSP);
+                byte(ss << 6 | ((m.index < 0 ? RSP : m.index) & 7) << 3 | (m.base & 7));
+            }
+
+            if (mod == 1) byte((uint8_t) m.disp);
+            if (mod == 2) dword((uint32_t) m.disp);
+        }
+
+        void movImm(int reg, uint32_t imm) {
+            prefix(32, 0, 0, reg);
+            byte(0xB8 | (reg & 7));
+            dword(imm);
+        }
+
+        void movImm64(int reg, uint64_t imm) {
+            prefix(64, 0, 0, reg);
+            byte(0xB8 | (reg & 7));
+            qword(imm);
+        }
+
+        void push(int reg) {
+            if (reg >= 8) byte(0x41);
+            byte(0x50 | (reg & 7));
+        }
+
+        void pop(int reg) {
+            if (reg >= 8) byte(0x41);
+            byte(0x58 | (reg & 7));
+        }
+
+        /// @brief A jump or conditional jump with a 32-bit offset to fill in later
+        /// @return Where to patch the offset
+        size_t jump(int cc = -1) {
+            if (cc < 0) {
+                byte(0xE9);
+            } else {
+                byte(0x0F);
+                byte(0x80 | cc);
+            }
+            dword(0);
+            return pos - 4;
+        }
+
+        void jumpTo(const void *target, int cc = -1) {
+            size_t at = jump(cc);
+            patch(at, target);
+        }
+
+        void patch(size_t at, const void *target) {
+            int32_t rel = (int32_t) ((const uint8_t *) target - (code + at + 4));
+            memcpy(code + at, &rel, 4);
+        }
+    };
+
+    /// @brief Compiles basic blocks to x86-64 code. LC3 registers R0 to R7 live in r8 to r15 for
+    ///        as long as compiled code runs, with only the low 16 bits meaningful, and the condition
+    ///        codes are not computed: rbx holds the last result, which is only tested by branches.
+    ///        Within a block the register holding the last result is tracked while compiling, so
+    ///        most instructions don't touch rbx at all.
+    ///
+    ///        Blocks are chained through a table with the code of every address, which holds an exit
+    ///        stub for addresses without code, so control only returns to the dispatcher for new
+    ///        code, devices, RTI and such. Compiled code marks its words in Machine::cached, and a
+    ///        store to such a word invalidates every block containing it.
+    class Jit {
+        public:
+        // The longest block, in words
+        static const UInt MAX_BLOCK = 32;
+
+        // Code buffer size, flushed as a whole when full
+        static const size_t CODE_SIZE = 16 << 20;
+
+        // The most code a block can take, in bytes. Half of it for breakpoints.
+        static const size_t MAX_BLOCK_CODE = MAX_BLOCK * 320 + 64;
+
+        Machine &machine;
+        JitState state;
+
+        bool ok; // Whether the code buffer could be allocated
+
+        Jit(Machine &machine): machine(machine), entries(0x10000), length(0x10000) {
+            void *map = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            ok = map != MAP_FAILED;
+            buffer = ok ? (uint8_t *) map : nullptr;
+
+            state.mem = machine.mem;
+            state.reg = machine.reg;
+            state.cached = machine.cached;
+            state.dirty = machine.dirty;
+            state.entries = entries.data();
+            state.machine = &machine;
+            state.limited = 0;
+
+            if (ok) {
+                stubs();
+                flush();
+            }
+        }
+
+        Jit(const Jit &) = delete;
+
+        ~Jit() {
+            if (ok) munmap(buffer, CODE_SIZE);
+        }
+
+        /// @brief Forget all compiled code
+        void flush() {
+            for (size_t i = 0; i < 0x10000; i++) entries[i] = exitStub;
+            memset(length.data(), 0, length.size());
+            used = stubsEnd;
+        }
+
+        /// @brief Invalidate all blocks containing an address. Sets 'invalidated' if there were any.
+        void invalidate(UInt addr) {
+            for (UInt i = 0; i < MAX_BLOCK; i++) {
+                UInt start = addr - i;
+                if (length[start] > i) {
+                    entries[start] = exitStub;
+                    length[start] = 0;
+                    invalidated = true;
+                }
+            }
+        }
+
+        /// @brief Run compiled code, compiling blocks as they are reached. Falls back to the
+        ///        interpreter for what is not compiled: code in device register space, RTI, reserved
+        ///        opcodes, native trap routines, and condition codes that are not exactly one of n, z
+        ///        or p (after an RTI). Device events are handled where the interpreter handles them,
+        ///        so interrupts come at the same instructions.
+        Stop run(uint64_t limit) {
+            Machine &m = machine;
+            if (m.halted()) return STOP_HALT;
+
+            uint64_t end = m.instructions + limit < m.instructions ? UINT64_MAX : m.instructions + limit;
+
+            Stop stop = STOP_LIMIT;
+            m.waiting = false;
+
+            while (m.instructions < end) {
+                state.end = min(end, m.events.due());
+
+                UInt nzp = m.psr & 7;
+                const void *block = nullptr;
+
+                if (nzp == 1 || nzp == 2 || nzp == 4) {
+                    block = entries[m.pc];
+                    if (block == exitStub) block = compile(m.pc);
+                }
+
+                if (block == nullptr) {
+                    UInt at = m.pc;
+                    stop = m.execute<false>(1);
+                    if (stop != STOP_LIMIT) return stop;
+
+                    // A native trap routine waiting for a key, see Machine::execute
+                    if (m.pc == at && m.nativeTraps) {
+                        MicroOp u = decodeMicroOp(at, m.mem[at]);
+                        if (u.kind == UOP_TRAP && isServiced(u.imm) && m.instructions < end)
+                            m.instructions = end;
+                    }
+                    continue;
+                }
+
+                state.n = m.instructions;
+                state.cc = nzp == 4 ? 0x8000 : nzp == 2 ? 0 : 1;
+                state.pc = m.pc;
+
+                ((void (*)(JitState *, const void *)) enterStub)(&state, block);
+
+                m.pc = state.pc;
+                m.instructions = state.n;
+                m.psr = (m.psr & 0xFFF8) | conditionOf(state.cc);
+
+                if (m.waiting) {
+                    stop = STOP_INPUT;
+                    break;
+                }
+                if (m.halted()) {
+                    stop = STOP_HALT;
+                    break;
+                }
+
+                if (stopped) {
+                    stopped = false;
+                    stop = STOP_BREAK;
+                    break;
+                }
+
+                // The condition of a watchpoint sees the registers, so it is only checked out here
+                if (watchedAt != NO_WATCH_HIT) {
+                    UInt addr = watchedAt;
+                    watchedAt = NO_WATCH_HIT;
+                    if (!m.watchCondition || m.watchCondition(addr)) {
+                        stop = STOP_WATCH;
+                        break;
+                    }
+                }
+
+                // Like the interpreter, only at control instructions and device accesses
+                bool limited = state.limited;
+                bool handle = (limited || device) && m.instructions >= m.events.due();
+                state.limited = 0;
+                device = false;
+                if (handle) {
+                    polled = false;
+                    m.handleEvents();
+                } else if (polled) {
+                    polled = false;
+                    m.instructions += m.skipPolling(m.pc - 1, m.instructions, min(end, m.events.due()));
+                }
+
+                // Compiled code only stops at control instructions, so should the interpreter
+                if (!limited && m.instructions >= end) {
+                    stop = m.execute<false>(1);
+                    break;
+                }
+            }
+
+            m.console.flush();
+            return stop;
+        }
+
+        private:
+        uint8_t *buffer;
+        size_t used;
+        size_t stubsEnd;
+
+        vector<const void *> entries;
+        vector<uint8_t> length; // Words in the block at each address, or 0
+
+        const void *enterStub;
+        const void *exitStub;
+        const void *limitStub; // Leaves like the exit stub, setting JitState::limited
+
+        bool invalidated = false;
+        bool polled = false; // Set when compiled code read a device that is not ready
+        bool device = false; // Set when compiled code left after accessing a device
+        uint32_t watchedAt = NO_WATCH_HIT; // Set to the address when compiled code stored to a watchpoint
+        bool stopped = false; // Set when compiled code left to stop at a breakpoint
+
+        static const uint32_t NO_WATCH_HIT = 0x10000;
+
+        static int host(int r) {
+            return Emitter::R8 + r;
+        }
+
+        static int32_t offset(size_t field) {
+            return (int32_t) field;
+        }
+
+        // Whether compiled code has to leave after accessing a device, when 'n' instructions have
+        // been executed: to stop the machine, to handle an event, or to check the new first event
+        bool deviceExit(uint64_t n) {
+            Machine &m = machine;
+            uint64_t due = m.events.due();
+            device = m.waiting || m.halted() || polled || due <= n || due < state.end;
+            return device;
+        }
+
+        // Device register access from compiled code, after 'n' instructions including this one. Bit
+        // 16 of the result is set when the machine has to stop.
+        static uint32_t load(Machine *m, uint32_t addr, uint64_t n) {
+            Jit *jit = m->jit;
+            m->instructions = n;
+            UInt v = m->read(addr);
+            // A device that is not ready, leave to see if the code is polling it
+            if ((addr == KBSR || addr == DSR) && !(v & 0x8000)) jit->polled = true;
+            return v | (jit->deviceExit(n) ? 0x10000 : 0);
+        }
+
+        // Stores to device registers, to words with cached code and to watched pages. Nonzero when
+        // compiled code has to exit: to stop the machine, for an event, because code may have changed,
+        // or for a watchpoint.
+        static uint32_t store(Machine *m, uint32_t addr, uint32_t value, uint64_t n) {
+            Jit *jit = m->jit;
+            jit->invalidated = false;
+            m->instructions = n;
+            m->write(addr, value);
+            if (addr >= IO_START) return jit->deviceExit(n);
+            if (m->watchpoint(addr)) {
+                jit->watchedAt = addr;
+                return 1;
+            }
+            return m->waiting || m->halted() || jit->invalidated;
+        }
+
+        // At a breakpoint, with the registers written back. Nonzero when compiled code has to exit
+        // to stop there.
+        static uint32_t breakpoint(Machine *m, uint32_t pc, uint32_t cc, uint64_t n) {
+            if (m->passing == pc) {
+                m->passing = Machine::NO_PASSING;
+                return 0;
+            }
+            m->pc = pc;
+            m->instructions = n;
+            m->psr = (m->psr & 0xFFF8) | conditionOf(cc);
+            if (m->breakCondition && !m->breakCondition(pc)) return 0;
+            m->jit->stopped = true;
+            return 1;
+        }
+
+        /// @brief The stub that enters compiled code, called as void enter(JitState *, code), and the
+        ///        stubs that leave it with the PC in eax
+        void stubs() {
+            Emitter e(buffer, CODE_SIZE);
+            using E = Emitter;
+
+            enterStub = e.here();
+            for (int r : { E::RBX, E::RBP, E::R12, E::R13, E::R14, E::R15 }) e.push(r);
+            e.bytes({ 0x48, 0x83, 0xEC, 0x08 });                                        // sub rsp, 8
+            e.rr(64, { 0x89 }, E::RSI, E::RAX);                                         // mov rax, rsi
+            e.rm(64, { 0x8B }, E::RCX, { E::RDI, -1, 1, offset(offsetof(JitState, reg)) });
+            for (int r = 0; r < 8; r++)
+                e.rm(32, { 0x0F, 0xB7 }, host(r), { E::RCX, -1, 1, r * 2 });            // movzx
+            e.rm(32, { 0x8B }, E::RBX, { E::RDI, -1, 1, offset(offsetof(JitState, cc)) });
+            e.rm(64, { 0x8B }, E::RSI, { E::RDI, -1, 1, offset(offsetof(JitState, n)) });
+            e.rm(64, { 0x8B }, E::RBP, { E::RDI, -1, 1, offset(offsetof(JitState, mem)) });
+            e.bytes({ 0xFF, 0xE0 });                                                    // jmp rax
+
+            exitStub = e.here();
+            e.rm(32, { 0x89 }, E::RAX, { E::RDI, -1, 1, offset(offsetof(JitState, pc)) });
+            e.rm(64, { 0x8B }, E::RCX, { E::RDI, -1, 1, offset(offsetof(JitState, reg)) });
+            for (int r = 0; r < 8; r++)
+                e.rm(16, { 0x89 }, host(r), { E::RCX, -1, 1, r * 2 });
+            e.rm(32, { 0x89 }, E::RBX, { E::RDI, -1, 1, offset(offsetof(JitState, cc)) });
+            e.rm(64, { 0x89 }, E::RSI, { E::RDI, -1, 1, offset(offsetof(JitState, n)) });
+            e.bytes({ 0x48, 0x83, 0xC4, 0x08 });                                        // add rsp, 8
+            for (int r : { E::R15, E::R14, E::R13, E::R12, E::RBP, E::RBX }) e.pop(r);
+            e.byte(0xC3);                                                               // ret
+
+            limitStub = e.here();
+            e.rm(32, { 0xC6 }, 0, { E::RDI, -1, 1, offset(offsetof(JitState, limited)) }); // mov byte [limited], 1
+            e.byte(1);
+            e.jumpTo(exitStub);
+
+            stubsEnd = e.pos;
+        }
+
+        /// @brief Compile the block at an address
+        /// @return The code, or null if the first instruction can't be compiled
+        const void *compile(UInt start) {
+            if (!ok || start >= IO_START) return nullptr;
+            if (CODE_SIZE - used < MAX_BLOCK_CODE) flush();
+
+            Emitter e(buffer + used, CODE_SIZE - used);
+            using E = Emitter;
+            const void *code = e.here();
+
+            int last = -1; // LC3 register holding the last result, or -1 for rbx
+            UInt count = 0;
+            UInt pc = start;
+
+            auto settle = [&]() {
+                if (last >= 0) e.rr(32, { 0x89 }, host(last), E::RBX);                 // mov ebx, last
+            };
+
+            // R7 is about to change, and may hold the last result
+            auto link = [&]() {
+                settle();
+                last = -1;
+            };
+
+            // Count the instructions and leave for the PC in eax, through the table. Like the
+            // interpreter, the limit is only checked after control instructions, and before running
+            // into device register space.
+            auto next = [&](UInt executed, bool check) {
+                settle();
+                e.bytes({ 0x48, 0x83, 0xC6, (uint8_t) executed });                     // add rsi, executed
+                if (check) {
+                    e.rm(64, { 0x3B }, E::RSI, { E::RDI, -1, 1, offset(offsetof(JitState, end)) });
+                    e.jumpTo(limitStub, E::CC_AE);
+                }
+                e.rm(64, { 0x8B }, E::RCX, { E::RDI, -1, 1, offset(offsetof(JitState, entries)) });
+                e.rm(64, { 0xFF }, 4, { E::RCX, E::RAX, 8, 0 });                        // jmp [rcx + rax * 8]
+            };
+
+            // Leave for the PC in eax, straight to the dispatcher
+            auto leave = [&](UInt executed) {
+                settle();
+                e.bytes({ 0x48, 0x83, 0xC6, (uint8_t) executed });                     // add rsi, executed
+                e.jumpTo(exitStub);
+            };
+
+            // Call a helper with eax, edx if there is a value, and the instruction count as
+            // arguments, keeping the caller saved registers
+            auto call = [&](uint64_t fn, int value, UInt executed) {
+                for (int r : { E::R8, E::R9, E::R10, E::R11, E::RSI, E::RDI }) e.push(r);
+                if (value >= 0) e.rr(32, { 0x89 }, value, E::RDX);                     // mov edx, value
+                e.rm(64, { 0x8D }, value >= 0 ? E::RCX : E::RDX, { E::RSI, -1, 1, (int32_t) executed }); // lea
+                e.rr(32, { 0x89 }, E::RAX, E::RSI);                                     // mov esi, eax
+                e.rm(64, { 0x8B }, E::RDI, { E::RDI, -1, 1, offset(offsetof(JitState, machine)) });
+                e.movImm64(E::RAX, fn);
+                e.bytes({ 0xFF, 0xD0 });                                                // call rax
+                for (int r : { E::RDI, E::RSI, E::R11, E::R10, E::R9, E::R8 }) e.pop(r);
+            };
+
+            // Load the word at the address in eax into a register
+            auto loadTo = [&](int dr, UInt executed, UInt resume) {
+                e.byte(0x3D);                                                           // cmp eax, IO_START
+                e.dword(IO_START);
+                size_t slow = e.jump(E::CC_AE);
+                e.rm(32, { 0x0F, 0xB7 }, dr, { E::RBP, E::RAX, 2, 0 });                 // movzx dr, [rbp + rax * 2]
+                size_t done = e.jump();
+                e.patch(slow, e.here());
+                call((uint64_t) &Jit::load, -1, executed);
+                e.rr(32, { 0x89 }, E::RAX, dr);                                         // mov dr, eax
+                e.bytes({ 0xA9, 0x00, 0x00, 0x01, 0x00 });                              // test eax, 0x10000
+                size_t fine = e.jump(E::CC_E);
+                e.movImm(E::RAX, resume);
+                leave(executed);
+                e.patch(fine, e.here());
+                e.patch(done, e.here());
+            };
+
+            // Store a register to the address in eax
+            auto storeFrom = [&](int sr, UInt executed, UInt resume) {
+                e.byte(0x3D);                                                           // cmp eax, IO_START
+                e.dword(IO_START);
+                size_t slow1 = e.jump(E::CC_AE);
+                e.rm(64, { 0x8B }, E::RCX, { E::RDI, -1, 1, offset(offsetof(JitState, cached)) });
+                e.rm(32, { 0x80 }, 7, { E::RCX, E::RAX, 1, 0 });                        // cmp byte [rcx + rax], 0
+                e.byte(0);
+                size_t slow2 = e.jump(E::CC_NE);
+                e.rm(16, { 0x89 }, sr, { E::RBP, E::RAX, 2, 0 });                       // mov [rbp + rax * 2], sr
+                e.rr(32, { 0x89 }, E::RAX, E::RDX);                                     // mov edx, eax
+                e.rr(32, { 0xC1 }, 5, E::RDX);                                          // shr edx, 8
+                e.byte(8);
+                e.rm(64, { 0x8B }, E::RCX, { E::RDI, -1, 1, offset(offsetof(JitState, dirty)) });
+                e.rm(32, { 0xC6 }, 0, { E::RCX, E::RDX, 1, 0 });                        // mov byte [rcx + rdx], 1
+                e.byte(1);
+                size_t done = e.jump();
+                e.patch(slow1, e.here());
+                e.patch(slow2, e.here());
+                call((uint64_t) &Jit::store, sr, executed);
+                e.rr(32, { 0x85 }, E::RAX, E::RAX);                                     // test eax, eax
+                size_t fine = e.jump(E::CC_E);
+                e.movImm(E::RAX, resume);
+                leave(executed);
+                e.patch(fine, e.here());
+                e.patch(done, e.here());
+            };
+
+            bool ended = false;
+            while (!ended) {
+                if (count == MAX_BLOCK || pc >= IO_START) {
+                    e.movImm(E::RAX, pc);
+                    next(count, pc >= IO_START);
+                    break;
+                }
+
+                MicroOp u = decodeMicroOp(pc, machine.mem[pc]);
+                int a = host(u.a), b = host(u.b), c = host(u.c);
+                UInt after = pc + 1;
+
+                // Instructions left to the interpreter end the block before them
+                bool interpret = u.kind == UOP_RTI || u.kind == UOP_RESERVED
+                    || ((u.kind == UOP_LDI || u.kind == UOP_STI) && u.imm >= IO_START)
+                    || (u.kind == UOP_TRAP && machine.nativeTraps && isServiced(u.imm));
+                if (interpret) {
+                    if (count == 0) return nullptr;
+                    e.movImm(E::RAX, pc);
+                    leave(count);
+                    break;
+                }
+
+                // Ask the machine whether to stop at a breakpoint, with the registers written back
+                // for its condition. Stopping leaves before the instruction.
+                if (machine.breakpoint(pc)) {
+                    settle();
+                    e.rm(64, { 0x8B }, E::RCX, { E::RDI, -1, 1, offset(offsetof(JitState, reg)) });
+                    for (int r = 0; r < 8; r++)
+                        e.rm(16, { 0x89 }, host(r), { E::RCX, -1, 1, r * 2 });
+                    e.movImm(E::RAX, pc);
+                    call((uint64_t) &Jit::breakpoint, E::RBX, count);
+                    e.rr(32, { 0x85 }, E::RAX, E::RAX);                                 // test eax, eax
+                    size_t fine = e.jump(E::CC_E);
+                    e.movImm(E::RAX, pc);
+                    leave(count);
+                    e.patch(fine, e.here());
+                }
+
+                count++;
+
+                switch (u.kind) {
+                    case UOP_NOP:
+                        break;
+
+                    case UOP_ADD_REG:
+                        e.rm(32, { 0x8D }, a, { b, c, 1, 0 });                          // lea a, [b + c]
+                        last = u.a;
+                        break;
+
+                    case UOP_ADD_IMM:
+                        e.rm(32, { 0x8D }, a, { b, -1, 1, (Int) u.imm });               // lea a, [b + imm]
+                        last = u.a;
+                        break;
+
+                    case UOP_AND_REG:
+                        if (u.a == u.b) {
+                            e.rr(32, { 0x21 }, c, a);                                   // and a, c
+                        } else if (u.a == u.c) {
+                            e.rr(32, { 0x21 }, b, a);                                   // and a, b
+                        } else {
+                            e.rr(32, { 0x89 }, b, a);                                   // mov a, b
+                            e.rr(32, { 0x21 }, c, a);                                   // and a, c
+                        }
+                        last = u.a;
+                        break;
+
+                    case UOP_AND_IMM:
+                        if (u.a != u.b) e.rr(32, { 0x89 }, b, a);                       // mov a, b
+                        e.rr(32, { 0x81 }, 4, a);                                       // and a, imm
+                        e.dword(u.imm);
+                        last = u.a;
+                        break;
+
+                    case UOP_NOT:
+                        if (u.a != u.b) e.rr(32, { 0x89 }, b, a);                       // mov a, b
+                        e.rr(32, { 0xF7 }, 2, a);                                       // not a
+                        last = u.a;
+                        break;
+
+                    case UOP_LEA:
+                        e.movImm(a, u.imm);
+                        last = u.a;
+                        break;
+
+                    case UOP_LD:
+                        last = u.a;
+                        if (u.imm < IO_START) {
+                            e.rm(32, { 0x0F, 0xB7 }, a, { E::RBP, -1, 1, u.imm * 2 });  // movzx a, [rbp + imm * 2]
+                        } else {
+                            e.movImm(E::RAX, u.imm);
+                            loadTo(a, count, after);
+                        }
+                        break;
+
+                    case UOP_LDR:
+                        e.rm(32, { 0x8D }, E::RAX, { b, -1, 1, (Int) u.imm });          // lea eax, [b + imm]
+                        e.bytes({ 0x0F, 0xB7, 0xC0 });                                  // movzx eax, ax
+                        last = u.a;
+                        loadTo(a, count, after);
+                        break;
+
+                    case UOP_LDI:
+                        e.rm(32, { 0x0F, 0xB7 }, E::RAX, { E::RBP, -1, 1, u.imm * 2 }); // movzx eax, [rbp + imm * 2]
+                        last = u.a;
+                        loadTo(a, count, after);
+                        break;
+
+                    case UOP_ST:
+                        e.movImm(E::RAX, u.imm);
+                        storeFrom(a, count, after);
+                        break;
+
+                    case UOP_STR:
+                        e.rm(32, { 0x8D }, E::RAX, { b, -1, 1, (Int) u.imm });          // lea eax, [b + imm]
+                        e.bytes({ 0x0F, 0xB7, 0xC0 });                                  // movzx eax, ax
+                        storeFrom(a, count, after);
+                        break;
+
+                    case UOP_STI:
+                        e.rm(32, { 0x0F, 0xB7 }, E::RAX, { E::RBP, -1, 1, u.imm * 2 }); // movzx eax, [rbp + imm * 2]
+                        storeFrom(a, count, after);
+                        break;
+
+                    case UOP_BR:
+                    {
+                        // n, z and p of the last result as in 'test', after which s, e and g hold
+                        static const int conditions[8] = { -1, E::CC_G, E::CC_E, E::CC_NS, E::CC_S, E::CC_NE, E::CC_LE, -1 };
+                        settle();
+                        last = -1;
+                        e.rr(16, { 0x85 }, E::RBX, E::RBX);                             // test bx, bx
+                        e.movImm(E::RAX, after);
+                        e.movImm(E::RCX, u.imm);
+                        e.rr(32, { 0x0F, (uint8_t) (0x40 | conditions[u.a]) }, E::RAX, E::RCX); // cmovcc eax, ecx
+                        next(count, true);
+                        ended = true;
+                        break;
+                    }
+
+                    case UOP_JUMP:
+                        e.movImm(E::RAX, u.imm);
+                        next(count, true);
+                        ended = true;
+                        break;
+
+                    case UOP_JMP:
+                        e.rr(32, { 0x0F, 0xB7 }, E::RAX, b);                            // movzx eax, b
+                        next(count, true);
+                        ended = true;
+                        break;
+
+                    case UOP_JSR:
+                        link();
+                        e.movImm(host(7), after);
+                        e.movImm(E::RAX, u.imm);
+                        next(count, true);
+                        ended = true;
+                        break;
+
+                    case UOP_JSRR:
+                        e.rr(32, { 0x0F, 0xB7 }, E::RAX, b);                            // movzx eax, b
+                        link();
+                        e.movImm(host(7), after);
+                        next(count, true);
+                        ended = true;
+                        break;
+
+                    case UOP_TRAP:
+                        link();
+                        e.movImm(host(7), after);
+                        e.rm(32, { 0x0F, 0xB7 }, E::RAX, { E::RBP, -1, 1, u.imm * 2 }); // movzx eax, [rbp + vector * 2]
+                        next(count, true);
+                        ended = true;
+                        break;
+                }
+
+                pc = after;
+            }
+
+            used += e.pos;
+
+            length[start] = count;
+            for (UInt i = 0; i < count; i++) machine.cached[(UInt) (start + i)] = 1;
+            entries[start] = code;
+            return code;
+        }
+    };
+
+    inline Machine::~Machine() {
+        delete jit;
+    }
+
+    inline Stop Machine::runJit(uint64_t limit) {
+        if (jit == nullptr) jit = new Jit(*this);
+        if (!jit->ok) return execute<false>(limit);
+        return jit->run(limit);
+    }
+
+    inline void Machine::invalidateJit(UInt addr) {
+        jit->invalidate(addr);
+    }
+
+    inline void Machine::flushJit() {
+        if (jit != nullptr && jit->ok) jit->flush();
+    }
+}
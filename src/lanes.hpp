@@ -0,0 +1,547 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "os.hpp"
+#include "machine.hpp"
+
+// Vector types, for running machines in lockstep
+#if defined(__GNUC__)
+#define LC3_LANES
+#endif
+
+#ifdef LC3_LANES
+namespace lc3 {
+    /// @brief Vectors of N 16-bit lanes, for 8 and 16 lanes
+    template <int N> struct LaneVectors;
+
+    template <> struct LaneVectors<8> {
+        typedef UInt Vec __attribute__((vector_size(16)));
+        typedef Int SVec __attribute__((vector_size(16)));
+    };
+
+    template <> struct LaneVectors<16> {
+        typedef UInt Vec __attribute__((vector_size(32)));
+        typedef Int SVec __attribute__((vector_size(32)));
+    };
+
+    // As many lanes as fit in a SIMD register of the target
+#ifdef __AVX2__
+    const int DEFAULT_LANES = 16;
+#else
+    const int DEFAULT_LANES = 8;
+#endif
+
+    /// @brief N LC3 machines that run the same program in lockstep, for running one program on many
+    ///        inputs. Every step executes one instruction in all lanes that are at the same PC and
+    ///        find the same instruction there. Each register, and each word of memory, is a vector
+    ///        of N lanes, so that most of a step is a few SIMD instructions. Lanes that branch
+    ///        differently diverge, and the lanes at the lowest PC step first, so that the others are
+    ///        caught up with after a loop or an if. Each lane ends in the same state as a Machine
+    ///        running the same program with the same input.
+    template <int N = DEFAULT_LANES>
+    class Lanes {
+        public:
+        typedef typename LaneVectors<N>::Vec Vec;
+        typedef typename LaneVectors<N>::SVec SVec;
+
+        // Word 'addr' of lane 'i' is mem[addr][i], so that the lanes at one PC fetch their
+        // instruction, or load from a fixed address, with one vector load
+        Vec mem[0x10000];
+        Vec reg[8];
+        Vec pc;
+        Vec psr;
+        Vec savedSSP;
+        Vec savedUSP;
+
+        uint64_t instructions[N];    // Instructions executed so far, by lane
+        uint64_t steps;              // Steps so far, each executing an instruction in one or more lanes
+
+        Console console[N];
+        Stop stop[N];                // Why each lane stopped, after run()
+        bool interrupts[N];          // Set when a lane enabled an interrupt, which lanes do not
+                                     // model. It stopped there and has to run on a Machine instead
+        int count;                   // Lanes in use, the others never run
+        bool nativeTraps;            // Like Machine::nativeTraps
+
+        Lanes(): nativeTraps(true) {
+            reset(N);
+        }
+
+        Lanes(const Lanes &) = delete;
+
+        /// @brief Reset all lanes like Machine::reset, and use the first 'count' of them, at most N
+        void reset(int count) {
+            this->count = count;
+
+            memset(mem, 0, sizeof(mem));
+            memset(reg, 0, sizeof(reg));
+            psr = splat(0x8002);
+            savedSSP = splat(OS_STACK);
+            savedUSP = splat(0);
+            for (int i = 0; i < N; i++) {
+                instructions[i] = 0;
+                console[i] = Console();
+                stop[i] = STOP_HALT;
+                interrupts[i] = false;
+            }
+            steps = 0;
+
+            load(buildOS());
+            mem[MCR] = splat(0x8000);
+            pc = splat(0x3000);
+        }
+
+        /// @brief Copy an image into the memory of every lane, and point their PC at its origin.
+        void load(const Image &image) {
+            for (size_t j = 0; j < image.size(); j++)
+                mem[image.address(j)] = splat(image.words[j]);
+            pc = splat(image.origin);
+        }
+
+        /// @brief Whether the clock of a lane has been stopped
+        bool halted(int lane) const {
+            return !(mem[MCR][lane] & 0x8000);
+        }
+
+        /// @brief Run all lanes until each has stopped, and set 'stop' for each.
+        /// @param limit  The amount of instructions each lane may execute
+        void run(uint64_t limit) {
+            uint64_t end[N];
+            Vec live; // xFFFF for the lanes still running
+
+            for (int i = 0; i < N; i++) {
+                end[i] = instructions[i] + limit < instructions[i] ? UINT64_MAX : instructions[i] + limit;
+                live[i] = i < count && !halted(i) ? 0xFFFF : 0;
+                stop[i] = STOP_HALT;
+                waiting[i] = false;
+                interrupts[i] = false;
+            }
+
+            Vec on, v, addr;
+
+            // Stop the lanes where a device asked for it
+            auto deviceCheck = [&](const bool *touched) {
+                for (int i = 0; i < N; i++) {
+                    if (!touched[i] || !(waiting[i] || halted(i) || interrupts[i])) continue;
+                    stop[i] = waiting[i] ? STOP_INPUT : STOP_HALT;
+                    live[i] = 0;
+                }
+            };
+
+            // Instructions are counted in 16 bits per lane, and added to 'instructions' every so many
+            // steps. Until then, 'headroom' is how many more a lane may execute, at most xFFFF.
+            Vec executed = splat(0), headroom;
+            int flushIn = 0;
+
+            auto flush = [&]() {
+                for (int i = 0; i < N; i++) {
+                    instructions[i] += executed[i];
+                    uint64_t left = end[i] > instructions[i] ? end[i] - instructions[i] : 0;
+                    headroom[i] = left < 0xFFFF ? left : 0xFFFF;
+                }
+                executed = splat(0);
+                flushIn = 0x8000;
+            };
+            flush();
+
+            // Stop the lanes among 'on' that reached the limit, like Machine does after control flow.
+            // Not those that just stopped for another reason, which Machine looks at first.
+            auto limitCheck = [&]() {
+                Vec over = on & live & (Vec) (executed >= headroom);
+                if (!anyOf(over)) return;
+                for (int i = 0; i < N; i++) {
+                    if (!over[i]) continue;
+                    stop[i] = STOP_LIMIT;
+                    live[i] = 0;
+                }
+            };
+
+            // Set the condition codes of the lanes in 'on' from 'v'
+            auto setcc = [&]() {
+                Vec zero = (Vec) (v == 0);
+                Vec negative = (Vec) ((SVec) v >> 15);
+                Vec cc = (zero & 2) | (negative & 4) | (~(zero | negative) & 1);
+                psr = blend(psr, (psr & 0xFFF8) | cc, on);
+            };
+
+            // Load from per lane addresses, leaving devices to the lanes that touch them. Like
+            // Machine, STI does not stop a lane when it reads its pointer from a device.
+            auto gather = [&](bool check) {
+                Vec io = (Vec) (addr >= IO_START) & on;
+                bool any = false;
+                for (int i = 0; i < N; i++) any |= io[i];
+                if (!any) {
+                    for (int i = 0; i < N; i++) v[i] = mem[addr[i]][i];
+                    return;
+                }
+
+                bool touched[N];
+                for (int i = 0; i < N; i++) {
+                    touched[i] = io[i];
+                    v[i] = !on[i] ? 0 : touched[i] ? ioRead(i, addr[i]) : mem[addr[i]][i];
+                }
+                if (check) deviceCheck(touched);
+            };
+
+            auto scatter = [&](Vec value) {
+                bool touched[N];
+                bool any = false;
+                for (int i = 0; i < N; i++) {
+                    touched[i] = on[i] && addr[i] >= IO_START;
+                    any |= touched[i];
+                    if (!on[i]) continue;
+                    if (touched[i]) ioWrite(i, addr[i], value[i]);
+                    else mem[addr[i]][i] = value[i];
+                }
+                if (any) deviceCheck(touched);
+            };
+
+            UInt at = 0;
+            int lead = 0;
+            bool rescan = true;
+
+            for (;;) {
+                // The lanes at the lowest PC go first. Stopped lanes count as being at xFFFF, which
+                // only matters when no lane is running at all.
+                if (rescan) {
+                    Vec keys = pc | ~live;
+                    if (!anyOf(live)) break;
+
+                    at = 0xFFFF;
+                    for (int i = 0; i < N; i++) at = keys[i] < at ? keys[i] : at;
+
+                    lead = 0;
+                    while (keys[lead] != at || !live[lead]) lead++;
+                }
+
+                UInt insn = mem[at][lead];
+                Vec here = live & (Vec) (pc == at);
+                on = here & (Vec) (mem[at] == insn);
+
+                // Running into the device registers, which Machine checks the limit for
+                if (at >= IO_START) {
+                    rescan = true;
+                    limitCheck();
+                    on &= live;
+                    if (!anyOf(on)) continue;
+                }
+
+                executed -= on;
+                steps++;
+                if (--flushIn == 0) flush();
+
+                UInt next = at + 1;
+                UInt op = getBits(insn, 15, 12);
+                Vec &dr = reg[getBits(insn, 11, 9)];
+                Vec &sr = reg[getBits(insn, 8, 6)];
+                UInt imm5 = sext(getBits(insn, 4, 0), 5);
+                UInt off6 = sext(getBits(insn, 5, 0), 6);
+                UInt target = next + sext(getBits(insn, 8, 0), 9);
+
+                switch (op) {
+                    case ADD:
+                        v = sr + (getBit(insn, 5) ? splat(imm5) : reg[getBits(insn, 2, 0)]);
+                        dr = blend(dr, v, on);
+                        setcc();
+                        pc = blend(pc, splat(next), on);
+                        break;
+
+                    case AND:
+                        v = sr & (getBit(insn, 5) ? splat(imm5) : reg[getBits(insn, 2, 0)]);
+                        dr = blend(dr, v, on);
+                        setcc();
+                        pc = blend(pc, splat(next), on);
+                        break;
+
+                    case NOT:
+                        v = ~sr;
+                        dr = blend(dr, v, on);
+                        setcc();
+                        pc = blend(pc, splat(next), on);
+                        break;
+
+                    case LEA:
+                        v = splat(target);
+                        dr = blend(dr, v, on);
+                        setcc();
+                        pc = blend(pc, splat(next), on);
+                        break;
+
+                    case LD:
+                        pc = blend(pc, splat(next), on);
+                        if (target < IO_START) {
+                            v = mem[target];
+                        } else {
+                            addr = splat(target);
+                            gather(true);
+                        }
+                        dr = blend(dr, v, on);
+                        setcc();
+                        break;
+
+                    case LDR:
+                        addr = sr + off6;
+                        pc = blend(pc, splat(next), on);
+                        gather(true);
+                        dr = blend(dr, v, on);
+                        setcc();
+                        break;
+
+                    case LDI:
+                        addr = splat(target);
+                        pc = blend(pc, splat(next), on);
+                        gather(true);
+                        addr = v;
+                        gather(true);
+                        dr = blend(dr, v, on);
+                        setcc();
+                        break;
+
+                    case ST:
+                        pc = blend(pc, splat(next), on);
+                        if (target < IO_START) {
+                            mem[target] = blend(mem[target], dr, on);
+                        } else {
+                            addr = splat(target);
+                            scatter(dr);
+                        }
+                        break;
+
+                    case STR:
+                        addr = sr + off6;
+                        pc = blend(pc, splat(next), on);
+                        scatter(dr);
+                        break;
+
+                    case STI:
+                    {
+                        Vec value = dr;
+                        addr = splat(target);
+                        pc = blend(pc, splat(next), on);
+                        gather(false);
+                        addr = v;
+                        scatter(value);
+                        break;
+                    }
+
+                    case BR:
+                    {
+                        Vec taken = (Vec) ((psr & getBits(insn, 11, 9)) != 0);
+                        pc = blend(pc, blend(splat(next), splat(target), taken), on);
+                        // Like Machine, a BR without conditions is a NOP and no control instruction
+                        if (getBits(insn, 11, 9) != 0) limitCheck();
+                        break;
+                    }
+
+                    case RET:
+                        pc = blend(pc, sr, on);
+                        limitCheck();
+                        break;
+
+                    case JSR:
+                    {
+                        Vec to = getBit(insn, 11) ? splat(next + sext(getBits(insn, 10, 0), 11)) : sr;
+                        reg[7] = blend(reg[7], splat(next), on);
+                        pc = blend(pc, to, on);
+                        limitCheck();
+                        break;
+                    }
+
+                    case TRAP:
+                        if (nativeTraps && isServiced(getBits(insn, 7, 0))) {
+                            for (int i = 0; i < N; i++) {
+                                if (!on[i] || service(i, getBits(insn, 7, 0))) continue;
+                                // Like Machine, a TRAP that waits for input that has ended did
+                                // not execute
+                                if (waiting[i]) {
+                                    executed[i]--;
+                                    stop[i] = STOP_INPUT;
+                                    live[i] = 0;
+                                }
+                            }
+                            for (int i = 0; i < N; i++) {
+                                if (!on[i] || !live[i] || !halted(i)) continue;
+                                stop[i] = STOP_HALT;
+                                live[i] = 0;
+                            }
+                            limitCheck();
+                            break;
+                        }
+                        reg[7] = blend(reg[7], splat(next), on);
+                        pc = blend(pc, mem[getBits(insn, 7, 0)], on);
+                        limitCheck();
+                        break;
+
+                    case RTI:
+                        for (int i = 0; i < N; i++) {
+                            if (!on[i]) continue;
+                            pc[i] = next;
+                            if (psr[i] & 0x8000) {
+                                exception(i, 0x00);
+                            } else {
+                                pc[i] = read(i, reg[6][i]);
+                                psr[i] = read(i, reg[6][i] + 1);
+                                reg[6][i] += 2;
+                                if (psr[i] & 0x8000) {
+                                    savedSSP[i] = reg[6][i];
+                                    reg[6][i] = savedUSP[i];
+                                }
+                            }
+                        }
+                        limitCheck();
+                        break;
+
+                    default:
+                        for (int i = 0; i < N; i++) {
+                            if (!on[i]) continue;
+                            pc[i] = next;
+                            exception(i, 0x01);
+                        }
+                        limitCheck();
+                        break;
+                }
+
+                // Without control flow, the lanes that stepped are still at the lowest PC, unless
+                // some other lane was already there with a different instruction. With control
+                // flow, only when all lanes went the same way.
+                bool control = op == BR || op == JSR || op == RET || op == TRAP || op == RTI || op == 0xD;
+                if (!control && live[lead] && !anyOf(here & ~on)) {
+                    at = next;
+                    rescan = false;
+                } else if (control && live[lead] && !anyOf(live & (Vec) (pc != pc[lead]))) {
+                    at = pc[lead];
+                    rescan = false;
+                } else {
+                    rescan = true;
+                }
+            }
+
+            flush();
+            for (int i = 0; i < count; i++) console[i].flush();
+        }
+
+        private:
+        bool waiting[N]; // Set when a lane polls the keyboard after its input has ended
+
+        static Vec splat(UInt value) {
+            Vec v;
+            for (int i = 0; i < N; i++) v[i] = value;
+            return v;
+        }
+
+        // Whether any lane is not zero
+        static bool anyOf(Vec v) {
+            uint64_t words[sizeof(Vec) / 8];
+            memcpy(words, &v, sizeof(v));
+            uint64_t any = 0;
+            for (size_t k = 0; k < sizeof(Vec) / 8; k++) any |= words[k];
+            return any != 0;
+        }
+
+        // The lanes of 'b' where 'mask' is set, and of 'a' elsewhere
+        static Vec blend(Vec a, Vec b, Vec mask) {
+            return (a & ~mask) | (b & mask);
+        }
+
+        UInt read(int lane, UInt addr) {
+            return addr < IO_START ? mem[addr][lane] : ioRead(lane, addr);
+        }
+
+        void write(int lane, UInt addr, UInt value) {
+            if (addr >= IO_START) ioWrite(lane, addr, value);
+            else mem[addr][lane] = value;
+        }
+
+        // Like Machine::service, for one lane
+        bool service(int lane, UInt vector) {
+            UInt r[8];
+            for (int k = 0; k < 8; k++) r[k] = reg[k][lane];
+            UInt p = psr[lane];
+            UInt mcr = mem[MCR][lane];
+
+            bool done = serviceTrap(vector, r, p, mcr, console[lane], nullptr, [&](UInt addr) {
+                return read(lane, addr);
+            });
+            if (!done) {
+                if (console[lane].ended) waiting[lane] = true;
+                return false;
+            }
+
+            pc[lane]++;
+            if (vector != 0x25) r[7] = pc[lane];
+            for (int k = 0; k < 8; k++) reg[k][lane] = r[k];
+            psr[lane] = p;
+            write(lane, MCR, mcr);
+            return true;
+        }
+
+        // Like Machine::exception, for one lane
+        void exception(int lane, UInt vector) {
+            UInt old = psr[lane];
+            if (old & 0x8000) {
+                savedUSP[lane] = reg[6][lane];
+                reg[6][lane] = savedSSP[lane];
+            }
+            psr[lane] = old & 0x7FFF;
+
+            reg[6][lane] -= 2;
+            write(lane, reg[6][lane] + 1, old);
+            write(lane, reg[6][lane], pc[lane]);
+            pc[lane] = mem[0x0100 | vector][lane];
+        }
+
+        UInt ioRead(int lane, UInt addr) {
+            switch (addr) {
+                case KBSR:
+                    if (console[lane].available()) return 0x8000 | (mem[KBSR][lane] & 0x4000);
+                    if (console[lane].ended) waiting[lane] = true;
+                    return mem[KBSR][lane] & 0x4000;
+
+                case KBDR:
+                    return console[lane].take();
+
+                case DSR:
+                    return 0x8000;
+
+                default:
+                    return mem[addr][lane];
+            }
+        }
+
+        void ioWrite(int lane, UInt addr, UInt value) {
+            switch (addr) {
+                case KBSR:
+                    mem[KBSR][lane] = value & 0x4000;
+                    if (value & 0x4000) interrupts[lane] = true;
+                    break;
+
+                case TMR:
+                    if (value & 0x4000) interrupts[lane] = true;
+                    break;
+
+                case TMI:
+                    if (value) interrupts[lane] = true;
+                    mem[TMI][lane] = value;
+                    break;
+
+                case DDR:
+                    console[lane].put(value & 0xFF);
+                    break;
+
+                case KBDR:
+                case DSR:
+                    break;
+
+                default:
+                    mem[addr][lane] = value;
+                    break;
+            }
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <sstream>
+
+using namespace std;
+
+// Instruction constants
+#define BR   0x0
+#define ADD  0x1
+#define LD   0x2
+#define ST   0x3
+#define JSR  0x4
+#define AND  0x5
+#define LDR  0x6
+#define STR  0x7
+#define RTI  0x8
+#define NOT  0x9
+#define LDI  0xA
+#define STI  0xB
+#define RET  0xC
+#define LEA  0xE
+#define TRAP 0xF
+
+namespace lc3 {
+    // For easier programming because Samū is lazy
+    typedef uint16_t UInt;
+    typedef int16_t Int;
+
+    /// @brief Get the specified range of bits from an opcode. Both ends of the range are inclusive.
+    ///        MSB is 15, LSB is 0.
+    /// @param op    The opcode
+    /// @param from  The most significant bit that must be returned
+    /// @param to    The least significant bit that must be returned
+    /// @return      The bits, in a 0 padded integer
+    inline constexpr UInt getBits(UInt op, UInt from, UInt to) {
+        const UInt mask = ~(0xFFFF << ((from + 1) - to));
+        return (op >> to) & mask;
+    }
+
+    /// @brief Get the specified bit from an opcode. MSB is 15, LSB is 0.
+    /// @param op   The opcode
+    /// @param bit  The bit
+    /// @return     The bit
+    inline constexpr bool getBit(UInt op, UInt bit) {
+        return (op >> bit) & 1;
+    }
+
+    /// @brief Sign-extend a range of bits, given the bitlength.
+    /// @param op        The bits
+    /// @param bitlength The amount of bits that matter
+    /// @return          The sign-extended bits
+    inline constexpr Int sext(UInt op, UInt bitlength) {
+        if (op >> (bitlength - 1)) { // Sign
+            return ((0xFFFF << bitlength) | op);
+        } else {
+            return op;
+        }
+    }
+
+    // Memory mapped device registers
+    const UInt KBSR = 0xFE00; // Keyboard status
+    const UInt KBDR = 0xFE02; // Keyboard data
+    const UInt DSR  = 0xFE04; // Display status
+    const UInt DDR  = 0xFE06; // Display data
+    const UInt TMR  = 0xFE08; // Timer status, not in the standard LC3
+    const UInt TMI  = 0xFE0A; // Timer interval in instructions, 0 stops the timer
+    const UInt MCR  = 0xFFFE; // Machine control
+
+    // Interrupts of the devices: where their vector is in the interrupt vector table at x0100, and
+    // the priority they run at
+    const UInt KEYBOARD_VECTOR   = 0x80;
+    const UInt KEYBOARD_PRIORITY = 4;
+    const UInt TIMER_VECTOR      = 0x81;
+    const UInt TIMER_PRIORITY    = 5;
+
+    // Device registers live at or above this address
+    const UInt IO_START = 0xFE00;
+
+    struct Instruction {
+        const UInt name;
+        const UInt instruction;
+
+        Instruction(UInt instruction): name(getBits(instruction, 16, 12)), instruction(instruction) {
+        }
+
+        /// @brief Converts the instruction into a binary string of 16 bits
+        /// @return The binary string
+        string binaryString() {
+            string str = "";
+
+            UInt insn = instruction;
+            for (int i = 0; i < 16; i++) {
+                if (insn & 0x8000) {
+                    str += "1";
+                } else {
+                    str += "0";
+                }
+
+                insn <<= 1;
+            }
+
+            return str;
+        }
+
+        /// @brief Converts the instruction into a hexadecimal string of 4 digits, prepended with 'x'.
+        /// @return The hexadecimal string
+        string hexString() {
+            char hex[6];
+            sprintf((char *)&hex, "x%04X", instruction);
+            return string(hex);
+        }
+
+        /// @brief Converts the instruction into a readable assembly-like string.
+        /// @return The assembly string
+        string assemblyString() {
+            switch (name) {
+                case BR:
+                {
+                    // BRnz   [OFFSET +3]
+                    // BRp    [OFFSET -1]
+
+                    string insn = "BR";
+                    bool n = getBit(instruction, 11);
+                    bool z = getBit(instruction, 10);
+                    bool p = getBit(instruction, 9);
+
+                    int spaces = 3;
+                    if (n) { insn += "n"; spaces--; }
+                    if (z) { insn += "z"; spaces--; }
+                    if (p) { insn += "p"; spaces--; }
+
+                    for (int i = 0; i < spaces; i++)
+                        insn += " ";
+
+                    Int offset = sext(getBits(instruction, 8, 0), 9);
+
+                    insn += "  ";
+                    insn += "[OFFSET ";
+                    if (offset < 0) insn += "-" + to_string(-offset);
+                    else            insn += "+" + to_string(+offset);
+                    insn += "]";
+
+                    return insn;
+                }
+                break;
+
+                case ADD:
+                case AND:
+                {
+                    // ADD    R1 R2 #-1
+                    // AND    R0 R0 #0
+                    // ADD    R3 R3 R1
+
+                    bool imm = getBit(instruction, 5);
+
+                    UInt dest = getBits(instruction, 11, 9);
+                    UInt src1 = getBits(instruction, 8, 6);
+
+                    string insn = name == ADD ? "ADD    " : "AND    ";
+
+                    insn += "R" + to_string(dest);
+                    insn += " R" + to_string(src1);
+
+                    if (imm) {
+                        Int v = sext(getBits(instruction, 4, 0), 5);
+                        insn += " #" + to_string(v);
+                    } else {
+                        UInt src2 = getBits(instruction, 2, 0);
+                        insn += " R" + to_string(src2);
+                    }
+
+                    return insn;
+                }
+                break;
+
+                case LD:
+                case LDI:
+                case ST:
+                case STI:
+                case LEA:
+                {
+                    // LD     R0 [OFFSET +3]
+                    // LDI    R5 [OFFSET -9]
+                    // ST     R1 [OFFSET +7]
+                    // STI    R2 [OFFSET +19]
+                    // LEA    R4 [OFFSET -2]
+
+                    UInt dest = getBits(instruction, 11, 9);
+                    Int  addr = sext(getBits(instruction, 8, 0), 9);
+
+                    string insn = "";
+
+                    switch (name) {
+                        case LD:  insn += "LD     "; break;
+                        case LDI: insn += "LDI    "; break;
+                        case ST:  insn += "ST     "; break;
+                        case STI: insn += "STI    "; break;
+                        case LEA: insn += "LEA    "; break;
+                    }
+
+                    insn += "R" + to_string(dest);
+
+                    insn += " [OFFSET ";
+                    if (addr < 0) insn += "-" + to_string(-addr);
+                    else          insn += "+" + to_string(+addr);
+                    insn += "]";
+
+                    return insn;
+                }
+                break;
+
+                case STR:
+                case LDR:
+                {
+                    // STR    R2 R3 #+2
+                    // LDR    R4 R1 #+0
+
+                    UInt reg = getBits(instruction, 11, 9);
+                    UInt breg = getBits(instruction, 8, 6);
+                    Int  off = sext(getBits(instruction, 5, 0), 6);
+
+                    string insn = name == STR ? "STR    " : "LDR    ";
+
+                    insn += "R" + to_string(reg);
+                    insn += " R" + to_string(breg);
+
+                    insn += " #";
+                    if (off < 0) insn += "-" + to_string(-off);
+                    else         insn += "+" + to_string(+off);
+
+                    return insn;
+                }
+                break;
+
+                case NOT:
+                {
+                    // NOT    R2 R2
+
+                    UInt dest = getBits(instruction, 11, 9);
+                    UInt src1 = getBits(instruction, 8, 6);
+
+                    string insn = "NOT    ";
+
+                    insn += "R" + to_string(dest);
+                    insn += " R" + to_string(src1);
+
+                    return insn;
+                }
+                break;
+
+                case JSR:
+                {
+                    // JSRR   R1
+                    // JSR    [OFFSET +3]
+
+                    bool jsrr = !getBit(instruction, 11);
+                    string insn = jsrr ? "JSRR   " : "JSR    ";
+
+                    if (!jsrr) {
+                        Int offset = sext(getBits(instruction, 10, 0), 11);
+
+                        insn += "[OFFSET ";
+                        if (offset < 0) insn += "-" + to_string(-offset);
+                        else            insn += "+" + to_string(+offset);
+                        insn += "]";
+                    } else {
+                        UInt src = getBits(instruction, 8, 6);
+                        insn += "R" + to_string(src);
+                    }
+
+                    return insn;
+                }
+                break;
+
+                case TRAP:
+                {
+                    // TRAP   x25
+
+                    string insn = "TRAP   ";
+
+                    UInt src = getBits(instruction, 7, 0);
+
+                    ostringstream ss;
+                    ss << "x" << uppercase << hex << src;
+
+                    insn += ss.str();
+
+                    return insn;
+                }
+                break;
+
+                // These are pretty straightforward
+                case RET: return "RET"; break;
+                case RTI: return "RTI"; break;
+
+                default: return "[RESERVED]"; break;
+            }
+        }
+    };
+}
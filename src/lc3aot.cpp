@@ -0,0 +1,168 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <filesystem>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "aot.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-b] [-v] [-o <offset>] <file>" << endl \
+                               << "       " << (name) << " -h" << endl;
+
+int main(int argc, char **argv) {
+    class exit {
+        public:
+        char code;
+        exit(): code(0) {
+        }
+        exit(char c): code(c) {
+        }
+    };
+
+    class inputError {
+        public:
+        string problem;
+        inputError(string problem): problem(problem) {
+        }
+    };
+
+    char ec = 0;
+
+    try {
+        int mode = 1;
+        bool verbose = false;
+        bool help = false;
+
+        uint16_t origin = 0x3000;
+        bool originSet = false;
+
+        string input;
+
+        // Flags that take an argument
+        string *pending = nullptr;
+        string offsetArg;
+
+        for (int i = 1; i < argc; i++) {
+            string arg = string(argv[i]);
+
+            if (pending != nullptr) {
+                *pending = arg;
+                pending = nullptr;
+                continue;
+            }
+
+            if (arg == "-b") {        // Binary input
+                mode = 0;
+            } else if (arg == "-v") { // Report statistics
+                verbose = true;
+            } else if (arg == "-h") { // Help menu
+                help = true;
+            } else if (arg == "-o") { // Offset
+                pending = &offsetArg;
+                originSet = true;
+            } else if (arg[0] == '-') { // Invalid
+                throw inputError("unknown flag: " + arg);
+            } else {                  // Use file
+                if (!input.empty())
+                    throw inputError("input file already specified");
+
+                fs::path path(arg);
+
+                if (!fs::exists(path))
+                    throw inputError(arg + ": no such file");
+                if (fs::is_directory(path))
+                    throw inputError(arg + ": is a directory");
+                if (!fs::is_regular_file(path))
+                    throw inputError(arg + ": is not a file");
+
+                input = arg;
+            }
+        }
+
+        if (pending != nullptr) {
+            throw inputError(string(argv[argc - 1]) + ": expected an argument");
+        }
+
+        if (help) {
+            USAGE(std::cout, argv[0]);
+            std::cout << endl;
+            std::cout << "Translate an LC3 program to C++, and write it to the standard output. Compiled" << endl;
+            std::cout << "with the lc3tools source directory on the include path, it runs the program like" << endl;
+            std::cout << "lc3sim does, but most instructions run as native code:" << endl;
+            std::cout << endl;
+            std::cout << "  " << argv[0] << " program.obj > program.cpp" << endl;
+            std::cout << "  g++ -O2 -I lc3tools/src program.cpp -o program" << endl;
+            std::cout << endl;
+            std::cout << "Each block of code that is reachable from the origin becomes a function, and so" << endl;
+            std::cout << "do the routines of the built-in operating system. Anything else, like code that" << endl;
+            std::cout << "is jumped to through a register, RTI, and code that was changed while running," << endl;
+            std::cout << "runs in the interpreter of lc3sim." << endl;
+            std::cout << endl;
+            std::cout << "The input is read like lc3c reads it: a hexadecimal number on each line, or an" << endl;
+            std::cout << "object file if the name ends in '.obj'." << endl;
+            std::cout << endl;
+            std::cout << "  -b: Binary input mode. Each line must be a binary number." << endl;
+            std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -o: Provide the offset of the program in the LC3 memory in hexadecimal. Default" << endl;
+            std::cout << "      is 3000, or the origin in the header of an object file." << endl;
+            std::cout << "  -v: Print the amount of translated blocks." << endl;
+
+            throw exit(0);
+        }
+
+        if (originSet) {
+            char *p;
+            origin = strtoull(offsetArg.c_str(), &p, 16);
+            if (*p != 0 || offsetArg.empty())
+                throw inputError("-o: invalid offset, provide a hexadecimal number");
+        }
+
+        if (input.empty()) {
+            throw inputError("no input file");
+        }
+
+        // Load the program
+        lc3::Image image(origin);
+        if (fs::path(input).extension() == ".obj") {
+            ifstream in(input, ios::binary);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            if (!lc3::readObj(in, image))
+                throw inputError(input + ": truncated object file");
+            if (originSet)
+                image.origin = origin;
+        } else {
+            ifstream in(input);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            lc3::readLines(in, mode ? 16 : 2, false, [&](lc3::UInt n, bool) {
+                image.words.push_back(n);
+            });
+        }
+
+        lc3::Translator translator(image);
+        translator.write(std::cout, fs::path(input).filename().string());
+
+        if (verbose) {
+            std::cerr << translator.blocks() << " blocks translated" << endl;
+        }
+    } catch (inputError exc) {
+        std::cerr << argv[0] << ": " << exc.problem << endl;
+        USAGE(std::cerr, argv[0]);
+        std::cerr << "Type '" << argv[0] << " -h' for help" << endl;
+
+        ec = 1;
+    } catch (exit exc) {
+        ec = exc.code;
+    }
+
+    return ec;
+}
+
+#undef USAGE
@@ -0,0 +1,396 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <memory>
+#include <chrono>
+#include <filesystem>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "machine.hpp"
+#include "lanes.hpp"
+#include "scheduler.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-b] [-l] [-p] [-r] [-s] [-v] [-j <threads>] [-n <limit>] [-o <offset>] <file> <input>..." << endl \
+                               << "       " << (name) << " -h" << endl;
+
+int main(int argc, char **argv) {
+#ifdef LC3_LANES
+    const int LANES = lc3::DEFAULT_LANES;
+#else
+    const int LANES = 1;
+#endif
+
+    class exit {
+        public:
+        char code;
+        exit(): code(0) {
+        }
+        exit(char c): code(c) {
+        }
+    };
+
+    class inputError {
+        public:
+        string problem;
+        inputError(string problem): problem(problem) {
+        }
+    };
+
+    char ec = 0;
+
+    try {
+        int mode = 1;
+        bool verbose = false;
+        bool real = false;
+        bool single = false;
+        bool prefix = false;
+        bool loops = false;
+        bool help = false;
+
+        uint16_t origin = 0x3000;
+        bool originSet = false;
+        uint64_t limit = UINT64_MAX;
+
+        string program;
+        vector<string> inputs;
+
+        // Flags that take an argument
+        string *pending = nullptr;
+        string offsetArg, limitArg, threadsArg;
+
+        for (int i = 1; i < argc; i++) {
+            string arg = string(argv[i]);
+
+            if (pending != nullptr) {
+                *pending = arg;
+                pending = nullptr;
+                continue;
+            }
+
+            if (arg == "-b") {        // Binary input
+                mode = 0;
+            } else if (arg == "-s") { // One machine at a time
+                single = true;
+            } else if (arg == "-l") { // Find loops, which lanes don't
+                loops = true;
+                single = true;
+            } else if (arg == "-p") { // Share the run up to the first key
+                prefix = true;
+                single = true;
+            } else if (arg == "-r") { // Real trap routines
+                real = true;
+            } else if (arg == "-v") { // Report statistics
+                verbose = true;
+            } else if (arg == "-h") { // Help menu
+                help = true;
+            } else if (arg == "-o") { // Offset
+                pending = &offsetArg;
+                originSet = true;
+            } else if (arg == "-n") { // Instruction limit
+                pending = &limitArg;
+            } else if (arg == "-j") { // Threads
+                pending = &threadsArg;
+            } else if (arg[0] == '-') { // Invalid
+                throw inputError("unknown flag: " + arg);
+            } else {                  // Program, then inputs
+
+                fs::path path(arg);
+
+                if (!fs::exists(path))
+                    throw inputError(arg + ": no such file");
+                if (fs::is_directory(path))
+                    throw inputError(arg + ": is a directory");
+                if (!fs::is_regular_file(path))
+                    throw inputError(arg + ": is not a file");
+
+                if (program.empty()) program = arg;
+                else inputs.push_back(arg);
+            }
+        }
+
+        if (pending != nullptr) {
+            throw inputError(string(argv[argc - 1]) + ": expected an argument");
+        }
+
+        if (help) {
+            USAGE(std::cout, argv[0]);
+            std::cout << endl;
+            std::cout << "Run an LC3 program once for each input file, with the file as the keyboard, and" << endl;
+            std::cout << "print what it displays for each, after a '==> <input> <==' line. Like lc3sim, a" << endl;
+            std::cout << "built-in operating system provides the usual trap routines." << endl;
+            std::cout << endl;
+            std::cout << "Up to " << LANES << " runs execute together, in lockstep: each step executes an" << endl;
+            std::cout << "instruction in all runs that are at the same address, with SIMD instructions." << endl;
+            std::cout << "Runs that take different branches split up, and join again once they are at the" << endl;
+            std::cout << "same address. Every run ends like it would in lc3sim." << endl;
+            std::cout << endl;
+            std::cout << "The program is read like lc3c reads it: a hexadecimal number on each line, or an" << endl;
+            std::cout << "object file if the name ends in '.obj'." << endl;
+            std::cout << endl;
+            std::cout << "  -b: Binary input mode. Each line must be a binary number." << endl;
+            std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -j: Run the inputs on this many threads, one machine per input. The machines" << endl;
+            std::cout << "      take turns on the threads, a time slice each." << endl;
+            std::cout << "  -l: Stop a run when the program is in a state it was in before, without input" << endl;
+            std::cout << "      coming in between: it would go round in that loop forever. Runs one at a" << endl;
+            std::cout << "      time." << endl;
+            std::cout << "  -n: Stop each run after this many instructions." << endl;
+            std::cout << "  -o: Provide the offset of the program in the LC3 memory in hexadecimal. Default" << endl;
+            std::cout << "      is 3000, or the origin in the header of an object file." << endl;
+            std::cout << "  -p: Run the program once up to where it first asks for a key, and start every" << endl;
+            std::cout << "      input from there, one at a time. Only where a native trap routine asks for" << endl;
+            std::cout << "      it, otherwise every input starts from the beginning." << endl;
+            std::cout << "  -s: Run the inputs one at a time, like lc3sim, to compare." << endl;
+            std::cout << "  -r: Run the trap routines of the operating system instruction by instruction," << endl;
+            std::cout << "      like real LC3 code, polling the devices. By default they run natively, each" << endl;
+            std::cout << "      as a single instruction." << endl;
+            std::cout << "  -v: Print the amount of executed instructions and the speed when done." << endl;
+
+            throw exit(0);
+        }
+
+        if (originSet) {
+            char *p;
+            origin = strtoull(offsetArg.c_str(), &p, 16);
+            if (*p != 0 || offsetArg.empty())
+                throw inputError("-o: invalid offset, provide a hexadecimal number");
+        }
+
+        if (!limitArg.empty()) {
+            char *p;
+            limit = strtoull(limitArg.c_str(), &p, 10);
+            if (*p != 0)
+                throw inputError("-n: invalid limit, provide a decimal number");
+        }
+
+        int threads = 0;
+        if (!threadsArg.empty()) {
+            char *p;
+            threads = strtol(threadsArg.c_str(), &p, 10);
+            if (*p != 0 || threads < 1)
+                throw inputError("-j: invalid amount of threads, provide a positive decimal number");
+            if (prefix)
+                throw inputError("-j: not with -p");
+        }
+
+        if (program.empty()) {
+            throw inputError("no program file");
+        }
+        if (inputs.empty()) {
+            throw inputError("no input files");
+        }
+
+        string input = program;
+
+        // Load the program
+        lc3::Image image(origin);
+        if (fs::path(input).extension() == ".obj") {
+            ifstream in(input, ios::binary);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            if (!lc3::readObj(in, image))
+                throw inputError(input + ": truncated object file");
+            if (originSet)
+                image.origin = origin;
+        } else {
+            ifstream in(input);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            lc3::readLines(in, mode ? 16 : 2, false, [&](lc3::UInt n, bool) {
+                image.words.push_back(n);
+            });
+        }
+
+#ifndef LC3_LANES
+        // No vector types to run them together
+        single = true;
+#endif
+
+        // Every input in memory, so that the runs don't wait for the disk
+        vector<string> keys;
+        for (const string &name : inputs) {
+            ifstream in(name, ios::binary);
+            if (!in.good())
+                throw inputError(name + ": permission denied");
+            stringstream data;
+            data << in.rdbuf();
+            keys.push_back(data.str());
+        }
+
+        vector<string> displays(inputs.size());
+        vector<lc3::Stop> stops(inputs.size());
+        vector<uint64_t> counts(inputs.size());
+        uint64_t steps = 0;
+
+        auto start = chrono::steady_clock::now();
+
+        unique_ptr<lc3::Machine> machine;
+        unique_ptr<lc3::Snapshot> snapshot;
+        lc3::Console shared; // The console at the start, with what was displayed before it
+        uint64_t sharedCount = 0;
+
+        // Run one input on its own. Every run starts from a snapshot, so that only the pages the last
+        // run stored to are reset.
+        auto runSingle = [&](size_t i) {
+            if (!machine) {
+                machine.reset(new lc3::Machine());
+                machine->nativeTraps = !real;
+                machine->findLoops = loops;
+                machine->load(image);
+                snapshot.reset(new lc3::Snapshot());
+                machine->save(*snapshot);
+
+                // Up to the first key the runs are all the same, unless the program could tell that
+                // no key was there before it stopped to wait for one
+                if (prefix) {
+                    machine->console.ended = true;
+                    lc3::Stop stop = machine->run(limit);
+                    if (stop == lc3::STOP_INPUT && machine->retries() && machine->console.misses == 1) {
+                        shared = machine->console;
+                        sharedCount = machine->instructions;
+                        machine->save(*snapshot);
+                    }
+                }
+            }
+
+            istringstream in(keys[i]);
+            ostringstream out;
+
+            machine->restore(*snapshot);
+            machine->console = shared;
+            machine->console.ended = false;
+            machine->console.in = &in;
+            machine->console.out = &out;
+
+            stops[i] = machine->run(limit - sharedCount);
+            counts[i] = machine->instructions;
+            displays[i] = out.str();
+        };
+
+        if (threads > 0) {
+            lc3::Scheduler scheduler(threads);
+
+            // A machine is over a megabyte, only start a few more than run at a time
+            size_t window = threads * 8;
+            for (size_t i = 0; i < inputs.size(); i++) {
+                scheduler.wait(window - 1);
+                unique_ptr<lc3::Machine> machine(new lc3::Machine());
+                machine->nativeTraps = !real;
+                machine->findLoops = loops;
+                machine->load(image);
+                scheduler.add(move(machine), limit, keys[i], true);
+            }
+            scheduler.wait();
+
+            for (size_t i = 0; i < inputs.size(); i++) {
+                scheduler.done(i, stops[i], counts[i]);
+                displays[i] = scheduler.take(i);
+            }
+        } else if (single) {
+            for (size_t i = 0; i < inputs.size(); i++) runSingle(i);
+        } else {
+#ifdef LC3_LANES
+            // The lanes are a few megabytes
+            unique_ptr<lc3::Lanes<>> lanes(new lc3::Lanes<>());
+
+            for (size_t first = 0; first < inputs.size(); first += LANES) {
+                int count = inputs.size() - first < LANES ? inputs.size() - first : LANES;
+
+                vector<istringstream> in(count);
+                vector<ostringstream> out(count);
+
+                lanes->reset(count);
+                lanes->nativeTraps = !real;
+                lanes->load(image);
+                for (int l = 0; l < count; l++) {
+                    in[l].str(keys[first + l]);
+                    lanes->console[l].in = &in[l];
+                    lanes->console[l].out = &out[l];
+                }
+
+                lanes->run(limit);
+                steps += lanes->steps;
+
+                for (int l = 0; l < count; l++) {
+                    // Lanes have no interrupts, start those runs over on a machine
+                    if (lanes->interrupts[l]) {
+                        runSingle(first + l);
+                        continue;
+                    }
+                    stops[first + l] = lanes->stop[l];
+                    counts[first + l] = lanes->instructions[l];
+                    displays[first + l] = out[l].str();
+                }
+            }
+#endif
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        uint64_t total = 0;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            std::cout << "==> " << inputs[i] << " <==" << endl;
+            std::cout << displays[i];
+            if (!displays[i].empty() && displays[i].back() != '\n')
+                std::cout << endl;
+
+            switch (stops[i]) {
+                case lc3::STOP_HALT:
+                    break;
+
+                case lc3::STOP_LIMIT:
+                    std::cerr << argv[0] << ": " << inputs[i] << ": stopped after " << counts[i] << " instructions" << endl;
+                    ec = 2;
+                    break;
+
+                case lc3::STOP_INPUT:
+                    std::cerr << argv[0] << ": " << inputs[i] << ": the program waits for input, but the input has ended" << endl;
+                    ec = 2;
+                    break;
+
+                case lc3::STOP_LOOP:
+                    std::cerr << argv[0] << ": " << inputs[i] << ": the program never halts, it is in a loop after " << counts[i] << " instructions" << endl;
+                    ec = 2;
+                    break;
+
+                case lc3::STOP_BREAK: // No breakpoints or watchpoints are set
+                case lc3::STOP_WATCH:
+                    break;
+            }
+
+            total += counts[i];
+        }
+
+        if (verbose) {
+            std::cerr << total << " instructions in " << seconds << " s";
+            if (seconds > 0)
+                std::cerr << " (" << total / seconds / 1e6 << " MIPS)";
+            std::cerr << endl;
+
+            if (!single && steps > 0)
+                std::cerr << (double) total / steps << " runs per step on average" << endl;
+            if (prefix)
+                std::cerr << sharedCount << " instructions shared by all runs" << endl;
+        }
+    } catch (inputError exc) {
+        std::cerr << argv[0] << ": " << exc.problem << endl;
+        USAGE(std::cerr, argv[0]);
+        std::cerr << "Type '" << argv[0] << " -h' for help" << endl;
+
+        ec = 1;
+    } catch (exit exc) {
+        ec = exc.code;
+    }
+
+    return ec;
+}
+
+#undef USAGE
@@ -0,0 +1,366 @@
+#include <iostream>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "builder.hpp"
+#include "machine.hpp"
+#include "history.hpp"
+
+using namespace std;
+
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-r <runs>] [<workload>...]" << endl \
+                               << "       " << (name) << " -h" << endl;
+
+const lc3::UInt R0 = 0, R1 = 1, R2 = 2, R3 = 3, R4 = 4, R5 = 5, R6 = 6, R7 = 7;
+
+// A counting loop doing some arithmetic and a store and load, about 70 million instructions
+lc3::Image loopWorkload() {
+    lc3::CodeBuilder c(0x3000);
+    c.mem(LD, R3, "OUTER");
+    c.label("L1");
+    c.mem(LD, R2, "INNER");
+    c.label("L2");
+    c.add(R0, R0, 1);
+    c.addr(R1, R1, R0);
+    c.andi(R4, R1, 7);
+    c.based(STR, R4, R5, 0);
+    c.based(LDR, R4, R5, 0);
+    c.add(R2, R2, -1);
+    c.br(1, "L2");
+    c.add(R3, R3, -1);
+    c.br(1, "L1");
+    c.trap(0x25);
+    c.label("OUTER"); c.word(1000);
+    c.label("INNER"); c.word(10000);
+
+    lc3::Image image(c.origin());
+    image.words = c.finish();
+    return image;
+}
+
+// Bubble sort of 1024 pseudo-random words, refilled and sorted again 20 times, about 100 million
+// instructions
+lc3::Image sortWorkload() {
+    lc3::CodeBuilder c(0x3000);
+    c.label("REPEAT");
+    c.mem(LD, R1, "ARRAY");
+    c.mem(LD, R2, "COUNT");
+    c.mem(LD, R0, "SEED");
+    c.mem(LD, R5, "MASK");
+    c.label("FILL");
+    c.addr(R3, R0, R0);
+    c.addr(R3, R3, R3);
+    c.addr(R0, R3, R0);
+    c.add(R0, R0, 7);
+    c.andr(R4, R0, R5);
+    c.based(STR, R4, R1, 0);
+    c.add(R1, R1, 1);
+    c.add(R2, R2, -1);
+    c.br(1, "FILL");
+    c.mem(ST, R0, "SEED");
+
+    c.mem(LD, R2, "COUNT");
+    c.add(R2, R2, -1);
+    c.label("PASS");
+    c.mem(LD, R1, "ARRAY");
+    c.add(R3, R2, 0);
+    c.label("COMPARE");
+    c.based(LDR, R4, R1, 0);
+    c.based(LDR, R5, R1, 1);
+    c.notr(R7, R5);
+    c.add(R7, R7, 1);
+    c.addr(R7, R4, R7);
+    c.br(6, "NEXT");
+    c.based(STR, R5, R1, 0);
+    c.based(STR, R4, R1, 1);
+    c.label("NEXT");
+    c.add(R1, R1, 1);
+    c.add(R3, R3, -1);
+    c.br(1, "COMPARE");
+    c.add(R2, R2, -1);
+    c.br(1, "PASS");
+
+    c.mem(LD, R0, "REPS");
+    c.add(R0, R0, -1);
+    c.mem(ST, R0, "REPS");
+    c.br(1, "REPEAT");
+    c.trap(0x25);
+
+    c.label("ARRAY"); c.word(0x4000);
+    c.label("COUNT"); c.word(1024);
+    c.label("SEED");  c.word(1);
+    c.label("MASK");  c.word(0x3FFF);
+    c.label("REPS");  c.word(20);
+
+    lc3::Image image(c.origin());
+    image.words = c.finish();
+    return image;
+}
+
+// Recursive Fibonacci of 24 with a stack, 50 times, about 80 million instructions
+lc3::Image fibWorkload() {
+    lc3::CodeBuilder c(0x3000);
+    c.mem(LD, R6, "STACK");
+    c.mem(LD, R5, "REPS");
+    c.label("AGAIN");
+    c.andi(R0, R0, 0);
+    c.add(R0, R0, 12);
+    c.add(R0, R0, 12);
+    c.jsr("FIB");
+    c.add(R5, R5, -1);
+    c.br(1, "AGAIN");
+    c.trap(0x25);
+    c.label("STACK"); c.word(0xF000);
+    c.label("REPS");  c.word(50);
+
+    // R1 = fib(R0)
+    c.label("FIB");
+    c.add(R2, R0, -2);
+    c.br(3, "RECURSE");
+    c.add(R1, R0, 0);
+    c.ret();
+    c.label("RECURSE");
+    c.add(R6, R6, -2);
+    c.based(STR, R7, R6, 0);
+    c.based(STR, R0, R6, 1);
+    c.add(R0, R0, -1);
+    c.jsr("FIB");
+    c.based(LDR, R0, R6, 1);
+    c.based(STR, R1, R6, 1);
+    c.add(R0, R0, -2);
+    c.jsr("FIB");
+    c.based(LDR, R2, R6, 1);
+    c.addr(R1, R1, R2);
+    c.based(LDR, R7, R6, 0);
+    c.add(R6, R6, 2);
+    c.ret();
+
+    lc3::Image image(c.origin());
+    image.words = c.finish();
+    return image;
+}
+
+struct Workload {
+    const char *name;
+    lc3::Image (*build)();
+};
+
+const Workload WORKLOADS[] = {
+    { "loop", loopWorkload },
+    { "sort", sortWorkload },
+    { "fib",  fibWorkload  }
+};
+
+int main(int argc, char **argv) {
+    class exit {
+        public:
+        char code;
+        exit(): code(0) {
+        }
+        exit(char c): code(c) {
+        }
+    };
+
+    class inputError {
+        public:
+        string problem;
+        inputError(string problem): problem(problem) {
+        }
+    };
+
+    char ec = 0;
+
+    try {
+        bool help = false;
+        int runs = 3;
+
+        vector<const Workload *> selected;
+
+        // Flags that take an argument
+        string *pending = nullptr;
+        string runsArg;
+
+        for (int i = 1; i < argc; i++) {
+            string arg = string(argv[i]);
+
+            if (pending != nullptr) {
+                *pending = arg;
+                pending = nullptr;
+                continue;
+            }
+
+            if (arg == "-h") {        // Help menu
+                help = true;
+            } else if (arg == "-r") { // Runs
+                pending = &runsArg;
+            } else if (arg[0] == '-') { // Invalid
+                throw inputError("unknown flag: " + arg);
+            } else {                  // Workload
+                const Workload *found = nullptr;
+                for (const Workload &w : WORKLOADS) {
+                    if (arg == w.name) found = &w;
+                }
+                if (found == nullptr)
+                    throw inputError("unknown workload '" + arg + "'");
+                selected.push_back(found);
+            }
+        }
+
+        if (pending != nullptr) {
+            throw inputError(string(argv[argc - 1]) + ": expected an argument");
+        }
+
+        if (help) {
+            USAGE(std::cout, argv[0]);
+            std::cout << endl;
+            std::cout << "Run built-in, long-running LC3 programs with every engine of lc3sim, for the" << endl;
+            std::cout << "interpreters with and without fusing pairs of instructions (lc3sim -f), and" << endl;
+            std::cout << "print the speed of each in millions of instructions per second. The best of a" << endl;
+            std::cout << "few runs is taken. All must end in the same state, or the benchmark fails. The" << endl;
+            std::cout << "last column is the amount of dispatches per instruction with fusion." << endl;
+            std::cout << endl;
+            std::cout << "Each workload is also run once with the history of lc3db, and gone back in. It" << endl;
+            std::cout << "fails if a checkpoint restores another state than the workload went through." << endl;
+            std::cout << endl;
+            std::cout << "The workloads are:" << endl;
+            std::cout << "  loop: a counting loop with arithmetic, a store and a load." << endl;
+            std::cout << "  sort: bubble sort of 1024 words." << endl;
+            std::cout << "  fib:  recursive Fibonacci, with subroutine calls and a stack." << endl;
+            std::cout << "Default is all of them." << endl;
+            std::cout << endl;
+            std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -r: The amount of runs of each workload on each engine. Default is 3." << endl;
+
+            throw exit(0);
+        }
+
+        if (!runsArg.empty()) {
+            char *p;
+            runs = strtol(runsArg.c_str(), &p, 10);
+            if (*p != 0 || runs < 1)
+                throw inputError("-r: invalid amount of runs, provide a positive decimal number");
+        }
+
+        if (selected.empty()) {
+            for (const Workload &w : WORKLOADS) selected.push_back(&w);
+        }
+
+        // Every engine, and the interpreters also with fusion
+        struct Config {
+            string name;
+            lc3::Engine engine;
+            bool fuse;
+        };
+
+        vector<Config> configs;
+        for (int e = 0; e < lc3::ENGINES; e++) {
+            configs.push_back({ lc3::ENGINE_NAMES[e], (lc3::Engine) e, false });
+            if (e != lc3::ENGINE_JIT)
+                configs.push_back({ string(lc3::ENGINE_NAMES[e]) + "+fuse", (lc3::Engine) e, true });
+        }
+
+        char cell[32];
+
+        std::cout << "Workload | Instructions";
+        for (const Config &config : configs) {
+            sprintf(cell, " | %13s", config.name.c_str());
+            std::cout << cell;
+        }
+        std::cout << " | Dispatches" << endl;
+
+        // The machine is over a megabyte, keep it off the stack
+        unique_ptr<lc3::Machine> machine(new lc3::Machine());
+
+        for (const Workload *w : selected) {
+            lc3::Image image = w->build();
+
+            uint64_t count = 0;
+            lc3::UInt regs[8];
+            vector<double> mips;
+            uint64_t fused = 0;
+
+            for (size_t i = 0; i < configs.size(); i++) {
+                const Config &config = configs[i];
+                double best = 0;
+
+                for (int run = 0; run < runs; run++) {
+                    machine->reset();
+                    machine->load(image);
+                    machine->engine = config.engine;
+                    machine->fuse = config.fuse;
+
+                    auto start = chrono::steady_clock::now();
+                    machine->run(UINT64_MAX);
+                    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+                    if (i == 0 && run == 0) {
+                        count = machine->instructions;
+                        memcpy(regs, machine->reg, sizeof(regs));
+                    } else if (machine->instructions != count || memcmp(regs, machine->reg, sizeof(regs)) != 0) {
+                        std::cerr << argv[0] << ": " << config.name << " ends in a different state on " << w->name << endl;
+                        throw exit(1);
+                    }
+
+                    if (seconds > 0 && count / seconds / 1e6 > best)
+                        best = count / seconds / 1e6;
+
+                    if (config.fuse) {
+                        fused = 0;
+                        for (int f = 0; f < lc3::FUSIONS; f++) fused += machine->fusions[f];
+                    }
+                }
+
+                mips.push_back(best);
+            }
+
+            sprintf(cell, "%-8s | %12llu", w->name, (unsigned long long) count);
+            std::cout << cell;
+            for (double m : mips) {
+                sprintf(cell, " | %8.1f MIPS", m);
+                std::cout << cell;
+            }
+            // Per instruction, with fusion
+            sprintf(cell, " | %10.3f", count > 0 ? (double) (count - fused) / count : 0.0);
+            std::cout << cell << endl;
+
+            // Going back like lc3db must restore the states the workload went through. With a short
+            // interval, replaying puts new checkpoints between the ones of the first run, here in
+            // many places.
+            machine->reset();
+            machine->load(image);
+            machine->engine = lc3::DEFAULT_ENGINE;
+            machine->fuse = false;
+
+            lc3::History history(*machine);
+            history.run(UINT64_MAX);
+            for (uint64_t k = 63; k > 0; k--) {
+                history.interval = lc3::History::MIN_INTERVAL;
+                history.stepBack(machine->instructions - count * k / 64);
+            }
+            uint64_t wrong = history.check();
+            if (wrong != UINT64_MAX) {
+                std::cerr << argv[0] << ": going back on " << w->name << " restores a different state at instruction " << wrong << endl;
+                throw exit(1);
+            }
+        }
+    } catch (inputError exc) {
+        std::cerr << argv[0] << ": " << exc.problem << endl;
+        USAGE(std::cerr, argv[0]);
+        std::cerr << "Type '" << argv[0] << " -h' for help" << endl;
+
+        ec = 1;
+    } catch (exit exc) {
+        ec = exc.code;
+    }
+
+    return ec;
+}
+
+#undef USAGE
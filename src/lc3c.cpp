@@ -5,287 +5,21 @@
 #include <string>
 #include <sstream>
 #include <filesystem>
+#include <functional>
+#include <algorithm>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "cfg.hpp"
+#include "reach.hpp"
+#include "cost.hpp"
+#include "stats.hpp"
 
 using namespace std;
 namespace fs = std::filesystem;
 
-// Instruction constants
-#define BR   0x0
-#define ADD  0x1
-#define LD   0x2
-#define ST   0x3
-#define JSR  0x4
-#define AND  0x5
-#define LDR  0x6
-#define STR  0x7
-#define RTI  0x8
-#define NOT  0x9
-#define LDI  0xA
-#define STI  0xB
-#define RET  0xC
-#define LEA  0xE
-#define TRAP 0xF
-
-namespace lc3 {
-    // For easier programming because Samū is lazy
-    typedef uint16_t UInt;
-    typedef int16_t Int;
-
-    /// @brief Get the specified range of bits from an opcode. Both ends of the range are inclusive.
-    ///        MSB is 15, LSB is 0.
-    /// @param op    The opcode
-    /// @param from  The most significant bit that must be returned
-    /// @param to    The least significant bit that must be returned
-    /// @return      The bits, in a 0 padded integer
-    inline constexpr UInt getBits(UInt op, UInt from, UInt to) {
-        const UInt mask = ~(0xFFFF << ((from + 1) - to));
-        return (op >> to) & mask;
-    }
-
-    /// @brief Get the specified bit from an opcode. MSB is 15, LSB is 0.
-    /// @param op   The opcode
-    /// @param bit  The bit
-    /// @return     The bit
-    inline constexpr bool getBit(UInt op, UInt bit) {
-        return (op >> bit) & 1;
-    }
-
-    /// @brief Sign-extend a range of bits, given the bitlength.
-    /// @param op        The bits
-    /// @param bitlength The amount of bits that matter
-    /// @return          The sign-extended bits
-    inline constexpr Int sext(UInt op, UInt bitlength) {
-        if (op >> (bitlength - 1)) { // Sign
-            return ((0xFFFF << bitlength) | op);
-        } else {
-            return op;
-        }
-    }
-
-    struct Instruction {
-        const UInt name;
-        const UInt instruction;
-
-        Instruction(UInt instruction): name(getBits(instruction, 16, 12)), instruction(instruction) {
-        }
-
-        /// @brief Converts the instruction into a binary string of 16 bits
-        /// @return The binary string
-        string binaryString() {
-            string str = "";
-
-            UInt insn = instruction;
-            for (int i = 0; i < 16; i++) {
-                if (insn & 0x8000) {
-                    str += "1";
-                } else {
-                    str += "0";
-                }
-
-                insn <<= 1;
-            }
-
-            return str;
-        }
-
-        /// @brief Converts the instruction into a hexadecimal string of 4 digits, prepended with 'x'.
-        /// @return The hexadecimal string
-        string hexString() {
-            char hex[6];
-            sprintf((char *)&hex, "x%04X", instruction);
-            return string(hex);
-        }
-
-        /// @brief Converts the instruction into a readable assembly-like string.
-        /// @return The assembly string
-        string assemblyString() {
-            switch (name) {
-                case BR:
-                {
-                    // BRnz   [OFFSET +3]
-                    // BRp    [OFFSET -1]
-
-                    string insn = "BR";
-                    bool n = getBit(instruction, 11);
-                    bool z = getBit(instruction, 10);
-                    bool p = getBit(instruction, 9);
-
-                    int spaces = 3;
-                    if (n) { insn += "n"; spaces--; }
-                    if (z) { insn += "z"; spaces--; }
-                    if (p) { insn += "p"; spaces--; }
-
-                    for (int i = 0; i < spaces; i++)
-                        insn += " ";
-
-                    Int offset = sext(getBits(instruction, 8, 0), 9);
-
-                    insn += "  ";
-                    insn += "[OFFSET ";
-                    if (offset < 0) insn += "-" + to_string(-offset);
-                    else            insn += "+" + to_string(+offset);
-                    insn += "]";
-
-                    return insn;
-                }
-                break;
-
-                case ADD:
-                case AND:
-                {
-                    // ADD    R1 R2 #-1
-                    // AND    R0 R0 #0
-                    // ADD    R3 R3 R1
-
-                    bool imm = getBit(instruction, 5);
-
-                    UInt dest = getBits(instruction, 11, 9);
-                    UInt src1 = getBits(instruction, 8, 6);
-
-                    string insn = name == ADD ? "ADD    " : "AND    ";
-
-                    insn += "R" + to_string(dest);
-                    insn += " R" + to_string(src1);
-
-                    if (imm) {
-                        Int v = sext(getBits(instruction, 4, 0), 5);
-                        insn += " #" + to_string(v);
-                    } else {
-                        UInt src2 = getBits(instruction, 2, 0);
-                        insn += " R" + to_string(src2);
-                    }
-
-                    return insn;
-                }
-                break;
-
-                case LD:
-                case LDI:
-                case ST:
-                case STI:
-                case LEA:
-                {
-                    // LD     R0 [OFFSET +3]
-                    // LDI    R5 [OFFSET -9]
-                    // ST     R1 [OFFSET +7]
-                    // STI    R2 [OFFSET +19]
-                    // LEA    R4 [OFFSET -2]
-
-                    UInt dest = getBits(instruction, 11, 9);
-                    Int  addr = sext(getBits(instruction, 8, 0), 9);
-
-                    string insn = "";
-
-                    switch (name) {
-                        case LD:  insn += "LD     "; break;
-                        case LDI: insn += "LDI    "; break;
-                        case ST:  insn += "ST     "; break;
-                        case STI: insn += "STI    "; break;
-                        case LEA: insn += "LEA    "; break;
-                    }
-
-                    insn += "R" + to_string(dest);
-
-                    insn += " [OFFSET ";
-                    if (addr < 0) insn += "-" + to_string(-addr);
-                    else          insn += "+" + to_string(+addr);
-                    insn += "]";
-
-                    return insn;
-                }
-                break;
-
-                case STR:
-                case LDR:
-                {
-                    // STR    R2 R3 #+2
-                    // LDR    R4 R1 #+0
-
-                    UInt reg = getBits(instruction, 11, 9);
-                    UInt breg = getBits(instruction, 8, 6);
-                    Int  off = sext(getBits(instruction, 5, 0), 6);
-
-                    string insn = name == STR ? "STR    " : "LDR    ";
-
-                    insn += "R" + to_string(reg);
-                    insn += " R" + to_string(breg);
-
-                    insn += " #";
-                    if (off < 0) insn += "-" + to_string(-off);
-                    else         insn += "+" + to_string(+off);
-
-                    return insn;
-                }
-                break;
-
-                case NOT:
-                {
-                    // NOT    R2 R2
-
-                    UInt dest = getBits(instruction, 11, 9);
-                    UInt src1 = getBits(instruction, 8, 6);
-
-                    string insn = "NOT    ";
-
-                    insn += "R" + to_string(dest);
-                    insn += " R" + to_string(src1);
-
-                    return insn;
-                }
-                break;
-
-                case JSR:
-                {
-                    // JSRR   R1
-                    // JSR    [OFFSET +3]
-
-                    bool jsrr = getBit(instruction, 11);
-                    string insn = jsrr ? "JSRR   " : "JSR    ";
-
-                    if (!jsrr) {
-                        Int offset = sext(getBits(instruction, 10, 0), 11);
-
-                        insn += "[OFFSET ";
-                        if (offset < 0) insn += "-" + to_string(-offset);
-                        else            insn += "+" + to_string(+offset);
-                        insn += "]";
-                    } else {
-                        UInt src = getBits(instruction, 8, 6);
-                        insn += " R" + to_string(src);
-                    }
-
-                    return insn;
-                }
-                break;
-
-                case TRAP:
-                {
-                    // TRAP   x25
-
-                    string insn = "TRAP   ";
-
-                    UInt src = getBits(instruction, 7, 0);
-
-                    ostringstream ss;
-                    ss << "x" << uppercase << hex << src;
-
-                    insn += ss.str();
-
-                    return insn;
-                }
-                break;
-
-                // These are pretty straightforward
-                case RET: return "RET"; break;
-                case RTI: return "RTI"; break;
-
-                default: return "[RESERVED]"; break;
-            }
-        }
-    };
-}
-
-#define USAGE(out, name) (out) << "Usage: " << (name) << " [-b] [-a] [-o <offset>] <file>" << endl \
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-b] [-a] [-l] [-r] [-c [-t <costs>]] [--stats] [-o <offset>] <file>" << endl \
+                               << "       " << (name) << " -s [-b] [--stats] [-o <offset>] <file>..." << endl \
                                << "       " << (name) << " -h" << endl;
 
 int main(int argc, char **argv) {
@@ -307,12 +41,20 @@ int main(int argc, char **argv) {
 
     istream *in = nullptr;
     ifstream *rmvIn = nullptr;
+    vector<string> inputs;
 
     char ec = 0;
 
     try {
         int mode = 1;
         int output = 0;
+        bool loops = false;
+        bool reach = false;
+        bool summary = false;
+        bool cost = false;
+        bool stats = false;
+
+        lc3::TrapCosts traps;
 
         uint16_t insnn = 0x3000;
 
@@ -337,7 +79,32 @@ int main(int argc, char **argv) {
         enciFlags enci;
 
         bool o = false;
+        bool t = false;
         for (int i = 1; i < argc; i++) {
+            if (t) {
+                t = false;
+
+                // Comma separated list of <vector>=<cycles>[/<accesses>]
+                stringstream list(argv[i]);
+                for (string item; getline(list, item, ',');) {
+                    char *p;
+                    unsigned long vec = strtoul(item.c_str(), &p, 16);
+                    if (*p != '=' || vec > 0xFF)
+                        throw inputError("-t: invalid trap cost '" + item + "', expected <vector>=<cycles>[/<accesses>]");
+
+                    unsigned long cycles = strtoul(p + 1, &p, 10);
+                    unsigned long memory = traps.routines[vec].memory;
+                    if (*p == '/')
+                        memory = strtoul(p + 1, &p, 10);
+                    if (*p != 0)
+                        throw inputError("-t: invalid trap cost '" + item + "', expected <vector>=<cycles>[/<accesses>]");
+
+                    traps.routines[vec] = { (unsigned) cycles, (unsigned) memory };
+                }
+
+                continue;
+            }
+
             if (o) {
                 o = false;
                 char *p;
@@ -369,6 +136,54 @@ int main(int argc, char **argv) {
                 enci.set(2);
 
                 output = 1;
+            } else if (arg == "-l") { // Loop analysis
+                if (enci.check(4))
+                    throw inputError("-h was specified, use no other flags");
+                if (enci.check(32))
+                    throw inputError("-l already specified");
+                enci.set(32);
+
+                loops = true;
+            } else if (arg == "-r") { // Reachability analysis
+                if (enci.check(4))
+                    throw inputError("-h was specified, use no other flags");
+                if (enci.check(64))
+                    throw inputError("-r already specified");
+                enci.set(64);
+
+                reach = true;
+            } else if (arg == "-s") { // Reachability summary of many files
+                if (enci.check(4))
+                    throw inputError("-h was specified, use no other flags");
+                if (enci.check(128))
+                    throw inputError("-s already specified");
+                enci.set(128);
+
+                summary = true;
+            } else if (arg == "-c") { // Cost estimate
+                if (enci.check(4))
+                    throw inputError("-h was specified, use no other flags");
+                if (enci.check(256))
+                    throw inputError("-c already specified");
+                enci.set(256);
+
+                cost = true;
+            } else if (arg == "-t") { // Trap costs
+                if (enci.check(4))
+                    throw inputError("-h was specified, use no other flags");
+                if (enci.check(512))
+                    throw inputError("-t already specified");
+                enci.set(512);
+
+                t = true;
+            } else if (arg == "--stats") { // Instruction mix
+                if (enci.check(4))
+                    throw inputError("-h was specified, use no other flags");
+                if (enci.check(1024))
+                    throw inputError("--stats already specified");
+                enci.set(1024);
+
+                stats = true;
             } else if (arg == "-h") { // Help menu
                 if (enci.check(0xFFFF & ~4))
                     throw inputError("-h was specified, use no other flags");
@@ -386,26 +201,16 @@ int main(int argc, char **argv) {
             } else if (arg == "-") {    // Use stdin
                 if (enci.check(4))
                     throw inputError("-h was specified, use no other flags");
-                if (enci.check(16))
-                    throw inputError("input file already specified");
                 enci.set(16);
 
-                in = &cin;
+                inputs.push_back(arg);
             } else if (arg[0] == '-') { // Invalid
                 throw inputError("unknown flag: " + arg);
             } else {                    // Use file
                 if (enci.check(4))
                     throw inputError("-h was specified, use no other flags");
-                if (enci.check(16))
-                    throw inputError("input file already specified");
                 enci.set(16);
 
-                if (rmvIn != nullptr) {
-                    rmvIn->close();
-                    delete rmvIn;
-                    rmvIn = nullptr;
-                }
-
                 fs::path path(arg);
 
                 if (!fs::exists(path))
@@ -415,16 +220,19 @@ int main(int argc, char **argv) {
                 if (!fs::is_regular_file(path))
                     throw inputError(arg + ": is not a file");
 
-                rmvIn = new ifstream(arg);
-                if (!rmvIn->good())
-                    throw inputError(arg + ": permission denied");
-                in = rmvIn;
+                inputs.push_back(arg);
             }
         }
 
         if (o) {
             throw inputError("-o: expected offset");
         }
+        if (t) {
+            throw inputError("-t: expected trap costs");
+        }
+        if (enci.check(512) && !cost) {
+            throw inputError("-t: only used with -c");
+        }
 
         if (enci.check(4)) {
             USAGE(std::cout, argv[0]);
@@ -441,56 +249,362 @@ int main(int argc, char **argv) {
             std::cout << "be ignored." << endl;
             std::cout << endl;
             std::cout << "  -b: Binary input mode. Each line must be a binary number." << endl;
+            std::cout << "  -c: Estimate the best and worst case cost of the program and each subroutine," << endl;
+            std::cout << "      in clock cycles and data memory accesses, without running it. Loops count" << endl;
+            std::cout << "      their derived iteration count (see -l), or are unbounded in the worst case." << endl;
+            std::cout << "      The whole input is read before anything is printed." << endl;
             std::cout << "  -a: Only output the assembly, and not the binary and hexadecimal" << endl;
             std::cout << "      machine code." << endl;
             std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -l: Find loops and annotate each instruction with its loop depth. A summary of" << endl;
+            std::cout << "      all loops, their nesting and, where it can be derived from a counter" << endl;
+            std::cout << "      register, their iteration count is printed after the code. The whole" << endl;
+            std::cout << "      input is read before anything is printed." << endl;
             std::cout << "  -o: Provide the offset of the program in the LC3 memory in hexadecimal. Default" << endl;
-            std::cout << "      is 3000." << endl;
+            std::cout << "      is 3000, or the origin in the header of an object file." << endl;
+            std::cout << "  -r: Follow all statically known control flow from the offset and mark the words" << endl;
+            std::cout << "      that are never reached. A list of unreachable ranges is printed after the" << endl;
+            std::cout << "      code. The whole input is read before anything is printed." << endl;
+            std::cout << "  -t: With -c, set the cost of trap service routines as a comma separated list of" << endl;
+            std::cout << "      <vector>=<cycles>[/<accesses>], for example '22=400/32,25=0'. The vector is" << endl;
+            std::cout << "      hexadecimal." << endl;
+            std::cout << "  -s: Summary mode. Accepts any amount of input files and only prints how many" << endl;
+            std::cout << "      words of each file are reachable, followed by the totals." << endl;
+            std::cout << "  --stats: Print the instruction mix after the code: how often each opcode" << endl;
+            std::cout << "      occurs, split by BR condition, immediate or register operands, JSR or JSRR" << endl;
+            std::cout << "      and trap vector, and how often each ADD/AND immediate occurs. With -s, it" << endl;
+            std::cout << "      is printed once for all files together." << endl;
+            std::cout << endl;
+            std::cout << "Files ending in '.obj' are read as LC3 object files: big-endian binary words, the" << endl;
+            std::cout << "first of which is the origin of the program." << endl;
 
             throw exit(0);
         }
 
         // No input
-        if (in == nullptr) {
+        if (inputs.empty()) {
             throw inputError("no input file");
         }
+        if (inputs.size() > 1 && !summary) {
+            throw inputError("input file already specified");
+        }
 
+        auto isObj = [](const string &path) {
+            return fs::path(path).extension() == ".obj";
+        };
 
-        // Using sprintf to format the instruction number in here
-        char insnNum[8];
+        auto open = [&](const string &path) {
+            if (rmvIn != nullptr) {
+                rmvIn->close();
+                delete rmvIn;
+                rmvIn = nullptr;
+            }
 
-        // For each input line
-        for (string line; getline(*in, line);) {
-            if (line.length() == 0) { // Empty line
-                if (in == &cin) {
-                    throw exit(0);
-                } else {
-                    continue;
-                }
+            if (path == "-") {
+                in = &cin;
+                return;
             }
 
-            char *p;
-            unsigned long long n = strtoull(line.c_str(), &p, mode ? 16 : 2);
-            if (*p != 0) {
-                std::cerr << "Invalid opcode: " << p << endl;
+            rmvIn = new ifstream(path, isObj(path) ? ios::binary : ios::in);
+            if (!rmvIn->good())
+                throw inputError(path + ": permission denied");
+            in = rmvIn;
+        };
+
+        // Read a whole input into an image. Object files carry their own origin, unless -o is given.
+        auto load = [&](const string &path, lc3::Image &image) {
+            open(path);
+            image = lc3::Image(insnn);
+
+            if (isObj(path)) {
+                if (!lc3::readObj(*in, image))
+                    std::cerr << path << ": truncated object file" << endl;
+                if (enci.check(8))
+                    image.origin = insnn;
             } else {
-                lc3::Instruction insn = { (lc3::UInt)n };
+                lc3::readLines(*in, mode ? 16 : 2, in == &cin, [&](lc3::UInt n, bool) {
+                    image.words.push_back(n);
+                });
+            }
+        };
+
+        lc3::InstructionMix mix;
+
+        auto printStats = [&]() {
+            lc3::MixSummary m = mix.summary();
+            static const char *const names[16] = {
+                "BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+                "RTI", "NOT", "LDI", "STI", "RET", "[RESERVED]", "LEA", "TRAP"
+            };
+
+            char line[64];
+            auto percent = [&](uint64_t c) {
+                return m.total == 0 ? 0.0 : 100.0 * c / m.total;
+            };
+
+            std::cout << endl;
+            std::cout << "Instruction mix: " << m.total << " words" << endl;
+
+            for (int op = 0; op < 16; op++) {
+                sprintf((char *)&line, "  %-10s | %10llu | %5.1f%%", names[op], (unsigned long long) m.opcodes[op], percent(m.opcodes[op]));
+                std::cout << line;
+
+                string detail = "";
+                auto part = [&](const string &name, uint64_t c) {
+                    if (c == 0) return;
+                    if (!detail.empty()) detail += ", ";
+                    detail += name + " " + to_string(c);
+                };
+
+                switch (op) {
+                    case BR:
+                        for (int nzp = 7; nzp >= 0; nzp--) {
+                            string cond = nzp == 0 ? "never" : "";
+                            if (nzp & 4) cond += "n";
+                            if (nzp & 2) cond += "z";
+                            if (nzp & 1) cond += "p";
+                            part(cond, m.br[nzp]);
+                        }
+                        break;
+
+                    case ADD:
+                        part("immediate", m.addImm);
+                        part("register", m.addReg);
+                        break;
 
-                switch (output) {
-                    default:
-                    case 0:
-                        sprintf((char *)&insnNum, "x%04X", insnn);
-                        std::cout << insnNum << " | " << insn.hexString() << " | " << insn.binaryString() << " | " << insn.assemblyString() << endl;
+                    case AND:
+                        part("immediate", m.andImm);
+                        part("register", m.andReg);
                         break;
 
-                    case 1:
-                        std::cout << insn.assemblyString() << endl;
+                    case JSR:
+                        part("JSR", m.jsr);
+                        part("JSRR", m.jsrr);
                         break;
+
+                    case RET:
+                        part("RET", m.ret);
+                        part("JMP", m.jmp);
+                        break;
+
+                    case TRAP:
+                        for (int v = 0; v < 256; v++) {
+                            sprintf((char *)&line, "x%02X", v);
+                            part(line, m.traps[v]);
+                        }
+                        break;
+                }
+
+                if (!detail.empty())
+                    std::cout << " | " << detail;
+                std::cout << endl;
+            }
+
+            string imms = "";
+            for (int i = 0; i < 32; i++) {
+                if (m.imm5[i] == 0) continue;
+                if (!imms.empty()) imms += ", ";
+                imms += "#" + to_string(i - 16) + " " + to_string(m.imm5[i]);
+            }
+            std::cout << "  Immediates | " << (imms.empty() ? "none" : imms) << endl;
+        };
+
+        if (summary) {
+            size_t files = 0, words = 0, reached = 0;
+            char origin[8];
+
+            for (const string &path : inputs) {
+                lc3::Image image;
+                load(path, image);
+
+                lc3::Reachability r(image);
+
+                files++;
+                words += image.size();
+                reached += r.count;
+
+                if (stats)
+                    mix.add(image.words.data(), image.size());
+
+                sprintf((char *)&origin, "x%04X", image.origin);
+                std::cout << path << " | " << origin << " | " << image.size() << " words | "
+                          << r.count << " reachable | " << image.size() - r.count << " unreachable" << endl;
+            }
+
+            std::cout << "Total | " << files << " files | " << words << " words | "
+                      << reached << " reachable | " << words - reached << " unreachable" << endl;
+
+            if (stats)
+                printStats();
+
+            throw exit(0);
+        }
+
+        open(inputs[0]);
+
+        // Using sprintf to format the instruction number in here
+        char insnNum[8];
+
+        auto print = [&](lc3::UInt addr, lc3::Instruction insn, const string &note) {
+            string assembly = insn.assemblyString();
+            if (!note.empty()) {
+                assembly.resize(max(assembly.length(), (size_t) 24), ' ');
+                assembly += "; " + note;
+            }
+
+            switch (output) {
+                default:
+                case 0:
+                    sprintf((char *)&insnNum, "x%04X", addr);
+                    std::cout << insnNum << " | " << insn.hexString() << " | " << insn.binaryString() << " | " << assembly << endl;
+                    break;
+
+                case 1:
+                    std::cout << assembly << endl;
+                    break;
+            }
+        };
+
+        // Analyses need the whole program, so it is read before printing
+        bool buffered = loops || reach || cost || isObj(inputs[0]);
+        lc3::Image image(insnn);
+
+        if (buffered) {
+            load(inputs[0], image);
+        } else {
+            lc3::readLines(*in, mode ? 16 : 2, in == &cin, [&](lc3::UInt n, bool valid) {
+                if (valid) {
+                    print(insnn, { n }, "");
+                    if (stats)
+                        mix.add(n);
+                }
+                insnn++;
+            });
+
+            if (stats)
+                printStats();
+
+            throw exit(0);
+        }
+
+        lc3::CFG cfg(image);
+        lc3::Dominators dom(cfg);
+        lc3::LoopNest nest(cfg, dom);
+        lc3::Reachability r(image);
+
+        if (stats)
+            mix.add(image.words.data(), image.size());
+
+        for (size_t i = 0; i < image.size(); i++) {
+            string note = "";
+
+            if (loops) {
+                int b = cfg.blockOf[i];
+                int depth = nest.depth(b);
+                if (depth > 0) {
+                    note = "loop depth " + to_string(depth);
+                    if ((int) i == cfg.first[b] && nest.loops[nest.innermost[b]].header == b)
+                        note += ", header";
+                }
+            }
+
+            if (reach && !r.test(image.address(i))) {
+                if (!note.empty()) note += ", ";
+                note += "unreachable";
+            }
+
+            print(image.address(i), { image.words[i] }, note);
+        }
+
+        if (loops) {
+            std::cout << endl;
+            std::cout << "Loops: " << nest.loops.size() << endl;
+
+            // Print outer loops before the loops they contain, ordered by address
+            vector<int> order(nest.loops.size());
+            for (size_t l = 0; l < order.size(); l++) order[l] = l;
+            sort(order.begin(), order.end(), [&](int a, int b) {
+                return nest.loops[a].header < nest.loops[b].header;
+            });
+
+            function<void(int)> report = [&](int parent) {
+                for (int l : order) {
+                    const lc3::Loop &loop = nest.loops[l];
+                    if (loop.parent != parent) continue;
+
+                    size_t words = 0;
+                    for (int b : loop.blocks)
+                        words += cfg.last[b] - cfg.first[b] + 1;
+
+                    std::cout << string(loop.depth * 2, ' ');
+                    sprintf((char *)&insnNum, "x%04X", image.address(cfg.first[loop.header]));
+                    std::cout << insnNum << " | depth " << loop.depth << " | " << words << " words | back edge";
+                    for (int t : loop.latches) {
+                        sprintf((char *)&insnNum, "x%04X", image.address(cfg.last[t]));
+                        std::cout << " " << insnNum;
+                    }
+
+                    const lc3::TripCount &trip = loop.trip;
+                    if (trip.counted) {
+                        std::cout << " | R" << trip.reg << " #" << trip.step << " BR";
+                        if (trip.nzp & 4) std::cout << "n";
+                        if (trip.nzp & 2) std::cout << "z";
+                        if (trip.nzp & 1) std::cout << "p";
+
+                        if (!trip.known)
+                            std::cout << ", initial value unknown";
+                        else if (trip.iterations < 0)
+                            std::cout << " from #" << trip.init << ", iterations unknown";
+                        else
+                            std::cout << " from #" << trip.init << ": " << trip.iterations << " iterations";
+                    }
+                    std::cout << endl;
+
+                    report(l);
                 }
+            };
+            report(-1);
+        }
+
+        if (cost) {
+            lc3::CostEstimate est(cfg, dom, nest, traps);
+
+            auto show = [](const lc3::Estimate &e) {
+                if (e.cycles == lc3::Estimate::UNBOUNDED)
+                    return string("unbounded");
+                return to_string(e.cycles) + " cycles, " + to_string(e.memory) + " accesses";
+            };
+
+            std::cout << endl;
+            std::cout << "Cost:" << endl;
+            for (size_t e = 0; e < cfg.entries.size(); e++) {
+                int b = cfg.entries[e];
+
+                sprintf((char *)&insnNum, "x%04X", image.address(cfg.first[b]));
+                std::cout << "  " << insnNum << " | " << (b == 0 ? "program   " : "subroutine")
+                          << " | best " << show(est.best[e]) << " | worst " << show(est.worst[e]) << endl;
             }
+        }
 
-            insnn++;
+        if (reach) {
+            std::cout << endl;
+            std::cout << "Unreachable: " << image.size() - r.count << " of " << image.size() << " words" << endl;
+
+            for (auto range : r.unreachable(image)) {
+                size_t words = range.second - range.first;
+
+                sprintf((char *)&insnNum, "x%04X", image.address(range.first));
+                std::cout << "  " << insnNum;
+                if (words > 1) {
+                    sprintf((char *)&insnNum, "x%04X", image.address(range.second - 1));
+                    std::cout << "-" << insnNum;
+                }
+                std::cout << " | " << words << (words == 1 ? " word" : " words") << endl;
+            }
         }
+
+        if (stats)
+            printStats();
     } catch (inputError exc) {
         std::cerr << argv[0] << ": " << exc.problem << endl;
         USAGE(std::cerr, argv[0]);
@@ -0,0 +1,546 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <memory>
+#include <cstring>
+#include <filesystem>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "machine.hpp"
+#include "expression.hpp"
+#include "history.hpp"
+
+// Sockets, for serving GDB
+#if defined(__unix__) || defined(__APPLE__)
+#define LC3_GDB
+#include <cerrno>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "gdb.hpp"
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-b] [-r] [-e <engine>] [-g <port>] [-i <file>] [-o <offset>] <file>" << endl \
+                               << "       " << (name) << " -h" << endl;
+
+// A breakpoint or watchpoint
+struct Point {
+    bool watch;
+    lc3::UInt addr;
+    string condition;          // As it was typed, or empty to always stop
+    lc3::Expression compiled;
+    bool deleted = false;
+    uint64_t hits = 0;         // Times it stopped the program
+};
+
+static string hex(uint32_t value) {
+    char s[8];
+    snprintf(s, sizeof(s), "x%04X", value);
+    return s;
+}
+
+int main(int argc, char **argv) {
+    class exit {
+        public:
+        char code;
+        exit(): code(0) {
+        }
+        exit(char c): code(c) {
+        }
+    };
+
+    class inputError {
+        public:
+        string problem;
+        inputError(string problem): problem(problem) {
+        }
+    };
+
+    // A command that can't be carried out, the debugger goes on with the next one
+    class commandError {
+        public:
+        string problem;
+        commandError(string problem): problem(problem) {
+        }
+    };
+
+    char ec = 0;
+
+    try {
+        int mode = 1;
+        bool real = false;
+        bool help = false;
+
+        uint16_t origin = 0x3000;
+        bool originSet = false;
+
+        string input;
+
+        // Flags that take an argument
+        string *pending = nullptr;
+        string offsetArg, engineArg, keysArg, gdbArg;
+
+        for (int i = 1; i < argc; i++) {
+            string arg = string(argv[i]);
+
+            if (pending != nullptr) {
+                *pending = arg;
+                pending = nullptr;
+                continue;
+            }
+
+            if (arg == "-b") {        // Binary input
+                mode = 0;
+            } else if (arg == "-r") { // Real trap routines
+                real = true;
+            } else if (arg == "-h") { // Help menu
+                help = true;
+            } else if (arg == "-o") { // Offset
+                pending = &offsetArg;
+                originSet = true;
+            } else if (arg == "-e") { // Engine
+                pending = &engineArg;
+            } else if (arg == "-i") { // Keyboard
+                pending = &keysArg;
+            } else if (arg == "-g") { // GDB server
+                pending = &gdbArg;
+            } else if (arg[0] == '-') { // Invalid, stdin has the commands so '-' is too
+                throw inputError("unknown flag: " + arg);
+            } else {                  // Use file
+                if (!input.empty())
+                    throw inputError("input file already specified");
+
+                fs::path path(arg);
+
+                if (!fs::exists(path))
+                    throw inputError(arg + ": no such file");
+                if (fs::is_directory(path))
+                    throw inputError(arg + ": is a directory");
+                if (!fs::is_regular_file(path))
+                    throw inputError(arg + ": is not a file");
+
+                input = arg;
+            }
+        }
+
+        if (pending != nullptr) {
+            throw inputError(string(argv[argc - 1]) + ": expected an argument");
+        }
+
+        if (help) {
+            USAGE(std::cout, argv[0]);
+            std::cout << endl;
+            std::cout << "Debug an LC3 program. The program is loaded like lc3sim loads it, and waits at its" << endl;
+            std::cout << "origin for commands from the standard input. The standard output is the display," << endl;
+            std::cout << "and the standard input is also the keyboard, unless -i gives one." << endl;
+            std::cout << endl;
+            std::cout << "  -b: Binary input mode. Each line must be a binary number." << endl;
+            std::cout << "  -e: How to execute instructions, see lc3sim. Default is " << lc3::ENGINE_NAMES[lc3::DEFAULT_ENGINE] << "." << endl;
+            std::cout << "  -g: Serve the GDB remote protocol instead of reading commands, on this TCP port" << endl;
+            std::cout << "      of localhost, or on a Unix socket if it is a path. Connect with" << endl;
+            std::cout << "      'target remote :<port>'. Memory is two bytes a word to GDB, at twice the" << endl;
+            std::cout << "      address, and so is the PC. 'monitor list' prints instructions like lc3c." << endl;
+            std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -i: Use this file as the keyboard." << endl;
+            std::cout << "  -o: Provide the offset of the program in the LC3 memory in hexadecimal. Default" << endl;
+            std::cout << "      is 3000, or the origin in the header of an object file." << endl;
+            std::cout << "  -r: Run the trap routines of the operating system instruction by instruction, so" << endl;
+            std::cout << "      they can be stepped through." << endl;
+            std::cout << endl;
+            std::cout << "Type 'help' at the prompt for the commands." << endl;
+
+            throw exit(0);
+        }
+
+        if (originSet) {
+            char *p;
+            origin = strtoull(offsetArg.c_str(), &p, 16);
+            if (*p != 0 || offsetArg.empty())
+                throw inputError("-o: invalid offset, provide a hexadecimal number");
+        }
+
+        lc3::Engine engine = lc3::DEFAULT_ENGINE;
+        if (!engineArg.empty() && !lc3::engineNamed(engineArg, engine)) {
+            throw inputError("-e: unknown engine '" + engineArg + "'");
+        }
+
+        if (input.empty()) {
+            throw inputError("no input file");
+        }
+
+        // Load the program
+        lc3::Image image(origin);
+        if (fs::path(input).extension() == ".obj") {
+            ifstream in(input, ios::binary);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            if (!lc3::readObj(in, image))
+                throw inputError(input + ": truncated object file");
+            if (originSet)
+                image.origin = origin;
+        } else {
+            ifstream in(input);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            lc3::readLines(in, mode ? 16 : 2, false, [&](lc3::UInt n, bool) {
+                image.words.push_back(n);
+            });
+        }
+
+#ifndef LC3_GDB
+        if (!gdbArg.empty())
+            throw inputError("-g: not supported on this system");
+#endif
+
+        ifstream keys;
+        if (!keysArg.empty()) {
+            keys.open(keysArg, ios::binary);
+            if (!keys.good())
+                throw inputError("-i: " + keysArg + ": cannot be read");
+        }
+
+        // The machine is over a megabyte, keep it off the stack
+        unique_ptr<lc3::Machine> machine(new lc3::Machine());
+        machine->load(image);
+        machine->engine = engine;
+        machine->nativeTraps = !real;
+        machine->console.in = keysArg.empty() ? (istream *) &cin : &keys;
+        machine->console.out = &cout;
+
+#ifdef LC3_GDB
+        if (!gdbArg.empty()) {
+            // A port if it is a number, otherwise the path of a Unix socket
+            char *p;
+            unsigned long port = strtoul(gdbArg.c_str(), &p, 10);
+            bool tcp = *p == 0;
+            if (tcp && (port == 0 || port > 0xFFFF))
+                throw inputError("-g: invalid port, provide a number from 1 to 65535, or a path");
+
+            int server = socket(tcp ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
+            int bound;
+            if (tcp) {
+                int on = 1;
+                setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+                struct sockaddr_in addr = {};
+                addr.sin_family = AF_INET;
+                addr.sin_port = htons(port);
+                addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                bound = ::bind(server, (struct sockaddr *) &addr, sizeof(addr));
+            } else {
+                struct sockaddr_un addr = {};
+                addr.sun_family = AF_UNIX;
+                if (gdbArg.size() >= sizeof(addr.sun_path))
+                    throw inputError("-g: " + gdbArg + ": path too long");
+                strcpy(addr.sun_path, gdbArg.c_str());
+                bound = ::bind(server, (struct sockaddr *) &addr, sizeof(addr));
+            }
+            if (server < 0 || bound < 0 || listen(server, 1) < 0)
+                throw inputError("-g: " + gdbArg + ": " + strerror(errno));
+
+            std::cerr << argv[0] << ": waiting for GDB on " << (tcp ? "port " : "") << gdbArg << endl;
+            int client = accept(server, nullptr, nullptr);
+            close(server);
+            if (!tcp) unlink(gdbArg.c_str());
+            if (client < 0)
+                throw inputError(string("-g: ") + strerror(errno));
+
+            lc3::GdbStub(*machine, client).serve();
+            close(client);
+            machine->console.flush();
+            throw exit(0);
+        }
+#endif
+
+        // Every run goes through the history, to go back in
+        lc3::History history(*machine);
+
+        // Breakpoints and watchpoints by number, minus one. Deleted ones keep their number.
+        vector<Point> points;
+        vector<int> breakAt(0x10000, -1);
+        vector<int> watchAt(0x10000, -1);
+        int hit = -1; // The point that stopped the program last
+
+        // The machine asks these only at its breakpoints and watchpoints, so a compiled
+        // condition is all a hit costs
+        auto stopAt = [&](int number) {
+            Point &p = points[number];
+            if (!p.condition.empty() && !p.compiled.evaluate(*machine)) return false;
+            hit = number;
+            return true;
+        };
+        machine->breakCondition = [&](lc3::UInt addr) {
+            return stopAt(breakAt[addr]);
+        };
+        machine->watchCondition = [&](lc3::UInt addr) {
+            return stopAt(watchAt[addr]);
+        };
+
+        auto evaluate = [&](const string &text) -> lc3::UInt {
+            try {
+                return lc3::compileExpression(text).evaluate(*machine);
+            } catch (lc3::ExpressionError exc) {
+                throw commandError(exc.problem);
+            }
+        };
+
+        auto count = [&](const string &text, uint64_t fallback) -> uint64_t {
+            if (text.empty()) return fallback;
+            char *p;
+            uint64_t n = strtoull(text.c_str(), &p, 10);
+            if (*p != 0 || n == 0)
+                throw commandError("invalid count '" + text + "', provide a positive decimal number");
+            return n;
+        };
+
+        // Print the instruction at an address, like lc3c lists it, marking the PC and breakpoints
+        auto list = [&](lc3::UInt addr) {
+            lc3::Instruction insn(machine->mem[addr]);
+            const char *mark = addr == machine->pc ? "=> " : machine->breakpoint(addr) ? " * " : "   ";
+            std::cout << mark << hex(addr) << " | " << insn.hexString() << " | " << insn.assemblyString() << endl;
+        };
+
+        auto report = [&](lc3::Stop stop) {
+            machine->console.flush();
+            switch (stop) {
+                case lc3::STOP_HALT:
+                    std::cout << "The program halted after " << machine->instructions << " instructions" << endl;
+                    break;
+
+                case lc3::STOP_INPUT:
+                    std::cout << "The program waits for input, but the input has ended" << endl;
+                    break;
+
+                case lc3::STOP_BREAK:
+                    points[hit].hits++;
+                    std::cout << "Breakpoint " << hit + 1 << ", " << hex(machine->pc) << endl;
+                    break;
+
+                case lc3::STOP_WATCH:
+                {
+                    lc3::UInt addr = points[hit].addr;
+                    points[hit].hits++;
+                    std::cout << "Watchpoint " << hit + 1 << ", " << hex(addr) << " = " << hex(machine->mem[addr]) << endl;
+                    break;
+                }
+
+                case lc3::STOP_LIMIT:
+                case lc3::STOP_LOOP:
+                    break;
+            }
+            list(machine->pc);
+        };
+
+        // Set a breakpoint or watchpoint from 'break <address> [if <condition>]'
+        auto setPoint = [&](bool watch, const string &args) {
+            string where = args, condition;
+            size_t at = args.find(" if ");
+            if (at != string::npos) {
+                where = args.substr(0, at);
+                condition = args.substr(at + 4);
+            }
+            if (where.empty())
+                throw commandError(string("expected an address: ") + (watch ? "watch" : "break") + " <address> [if <condition>]");
+
+            lc3::UInt addr = evaluate(where);
+            if (watch && addr >= lc3::IO_START)
+                throw commandError("device registers can't be watched");
+
+            Point p;
+            p.watch = watch;
+            p.addr = addr;
+            p.condition = condition;
+            if (!condition.empty()) {
+                try {
+                    p.compiled = lc3::compileExpression(condition);
+                } catch (lc3::ExpressionError exc) {
+                    throw commandError(exc.problem);
+                }
+            }
+
+            // One of each kind per address, setting it again changes the condition
+            vector<int> &byAddress = watch ? watchAt : breakAt;
+            int number = byAddress[addr];
+            if (number < 0) {
+                number = points.size();
+                points.push_back(p);
+                byAddress[addr] = number;
+            } else {
+                points[number] = p;
+            }
+
+            if (watch) machine->setWatchpoint(addr, true);
+            else machine->setBreakpoint(addr, true);
+            std::cout << (watch ? "Watchpoint " : "Breakpoint ") << number + 1 << " at " << hex(addr) << endl;
+        };
+
+        auto printHelp = [&]() {
+            std::cout << "Addresses, counts and conditions are expressions, like 'R3 == x4000 && mem[R6] > 0'." << endl;
+            std::cout << "They use R0 to R7, PC, PSR, mem[<address>], numbers like x4000, #-1 or 12, and" << endl;
+            std::cout << "characters like 'A', with the operators of C." << endl;
+            std::cout << endl;
+            std::cout << "  break <address> [if <condition>]: Stop before executing the instruction at the" << endl;
+            std::cout << "      address, when the condition holds." << endl;
+            std::cout << "  watch <address> [if <condition>]: Stop after a store instruction writes to the" << endl;
+            std::cout << "      address, when the condition holds." << endl;
+            std::cout << "  delete <number>: Delete a breakpoint or watchpoint." << endl;
+            std::cout << "  info: List the breakpoints and watchpoints." << endl;
+            std::cout << "  continue: Run until a breakpoint, a watchpoint or the end of the program." << endl;
+            std::cout << "  step [<count>]: Execute one instruction, or that many." << endl;
+            std::cout << "  reverse-continue: Go back to where the program last stopped at a breakpoint or" << endl;
+            std::cout << "      watchpoint, or would have." << endl;
+            std::cout << "  reverse-step [<count>]: Go back one instruction, or that many." << endl;
+            std::cout << "  regs: Print the registers." << endl;
+            std::cout << "  print <expression>: Print the value of an expression." << endl;
+            std::cout << "  x <address> [<count>]: Print words of memory, 8 by default." << endl;
+            std::cout << "  list [<address>] [<count>]: Print instructions, 10 from the PC by default, or" << endl;
+            std::cout << "      the ones after the last listed." << endl;
+            std::cout << "  restart: Load the program again, keeping the breakpoints and watchpoints." << endl;
+            std::cout << "  quit: Stop debugging." << endl;
+            std::cout << "Commands can be shortened to their first letter, the reverse ones to 'rc' and 'rs'." << endl;
+            std::cout << "An empty line repeats the last command." << endl;
+        };
+
+        uint32_t listNext = 0x10000; // Where 'list' goes on, or past memory to start at the PC
+        string line, last;
+
+        std::cout << "(lc3db) " << std::flush;
+        while (getline(cin, line)) {
+            if (line.find_first_not_of(" \t\r") == string::npos) line = last;
+            last = line;
+
+            istringstream tokens(line);
+            string command, args;
+            tokens >> command;
+            getline(tokens, args);
+            size_t first = args.find_first_not_of(" \t");
+            args = first == string::npos ? "" : args.substr(first);
+            while (!args.empty() && (args.back() == ' ' || args.back() == '\r')) args.pop_back();
+
+            // The arguments of commands that take several, which are separated by spaces
+            istringstream argTokens(args);
+            string arg1, arg2, extra;
+            argTokens >> arg1 >> arg2 >> extra;
+
+            try {
+                if (command.empty()) {
+                    // Nothing to repeat
+                } else if (command == "break" || command == "b") {
+                    setPoint(false, args);
+                } else if (command == "watch" || command == "w") {
+                    setPoint(true, args);
+                } else if (command == "delete" || command == "d") {
+                    uint64_t number = count(arg1, 0);
+                    if (number == 0 || number > points.size() || points[number - 1].deleted)
+                        throw commandError("no breakpoint or watchpoint " + arg1);
+                    Point &p = points[number - 1];
+                    p.deleted = true;
+                    if (p.watch) {
+                        machine->setWatchpoint(p.addr, false);
+                        watchAt[p.addr] = -1;
+                    } else {
+                        machine->setBreakpoint(p.addr, false);
+                        breakAt[p.addr] = -1;
+                    }
+                } else if (command == "info" || command == "i") {
+                    bool any = false;
+                    for (size_t n = 0; n < points.size(); n++) {
+                        const Point &p = points[n];
+                        if (p.deleted) continue;
+                        any = true;
+                        std::cout << n + 1 << "  " << (p.watch ? "watch" : "break") << "  " << hex(p.addr);
+                        if (!p.condition.empty()) std::cout << "  if " << p.condition;
+                        std::cout << "  (" << p.hits << (p.hits == 1 ? " hit)" : " hits)") << endl;
+                    }
+                    if (!any) std::cout << "No breakpoints or watchpoints" << endl;
+                } else if (command == "continue" || command == "c") {
+                    // Stopped at a breakpoint, it should not stop the program again right away
+                    machine->passBreak = true;
+                    listNext = 0x10000;
+                    report(history.run(UINT64_MAX));
+                } else if (command == "step" || command == "s") {
+                    uint64_t n = count(args, 1);
+                    lc3::Stop stop = lc3::STOP_LIMIT;
+                    for (uint64_t i = 0; i < n && stop == lc3::STOP_LIMIT; i++) stop = history.step();
+                    listNext = 0x10000;
+                    report(stop);
+                } else if (command == "reverse-continue" || command == "rc") {
+                    lc3::Stop stop = history.continueBack();
+                    if (stop == lc3::STOP_LIMIT) std::cout << "Back at the start of the program" << endl;
+                    listNext = 0x10000;
+                    report(stop);
+                } else if (command == "reverse-step" || command == "rs") {
+                    if (!history.stepBack(count(args, 1))) std::cout << "Back at the start of the program" << endl;
+                    listNext = 0x10000;
+                    report(lc3::STOP_LIMIT);
+                } else if (command == "regs" || command == "r") {
+                    for (int r = 0; r < 8; r++)
+                        std::cout << "R" << r << " = " << hex(machine->reg[r]) << (r % 4 == 3 ? "\n" : "  ");
+                    lc3::UInt psr = machine->psr;
+                    std::cout << "PC = " << hex(machine->pc) << "  PSR = " << hex(psr) << " ("
+                              << (psr & 0x8000 ? "user" : "supervisor") << ", priority " << lc3::getBits(psr, 10, 8) << ", "
+                              << (psr & 4 ? "n" : "") << (psr & 2 ? "z" : "") << (psr & 1 ? "p" : "") << ")" << endl;
+                    std::cout << machine->instructions << " instructions executed" << endl;
+                } else if (command == "print" || command == "p") {
+                    if (args.empty()) throw commandError("expected an expression");
+                    lc3::UInt v = evaluate(args);
+                    std::cout << hex(v) << " (#" << (lc3::Int) v << ")" << endl;
+                } else if (command == "x") {
+                    if (arg1.empty() || !extra.empty())
+                        throw commandError("expected: x <address> [<count>]");
+                    lc3::UInt addr = evaluate(arg1);
+                    uint64_t n = count(arg2, 8);
+                    for (uint64_t i = 0; i < n; i++) {
+                        if (i % 8 == 0) std::cout << (i ? "\n" : "") << hex((lc3::UInt) (addr + i)) << ":";
+                        std::cout << " " << hex(machine->mem[(lc3::UInt) (addr + i)]);
+                    }
+                    std::cout << endl;
+                } else if (command == "list" || command == "l") {
+                    if (!extra.empty())
+                        throw commandError("expected: list [<address>] [<count>]");
+                    uint32_t addr = arg1.empty() ? (listNext < 0x10000 ? listNext : machine->pc) : evaluate(arg1);
+                    uint64_t n = count(arg2, 10);
+                    for (uint64_t i = 0; i < n; i++) list(addr + i);
+                    listNext = (lc3::UInt) (addr + n);
+                } else if (command == "restart") {
+                    machine->reset();
+                    machine->load(image);
+                    history.clear();
+                    listNext = 0x10000;
+                    list(machine->pc);
+                } else if (command == "help" || command == "h") {
+                    printHelp();
+                } else if (command == "quit" || command == "q") {
+                    break;
+                } else {
+                    throw commandError("unknown command '" + command + "', type 'help' for the commands");
+                }
+            } catch (commandError exc) {
+                std::cout << exc.problem << endl;
+            }
+
+            std::cout << "(lc3db) " << std::flush;
+        }
+    } catch (inputError exc) {
+        std::cerr << argv[0] << ": " << exc.problem << endl;
+        USAGE(std::cerr, argv[0]);
+        std::cerr << "Type '" << argv[0] << " -h' for help" << endl;
+
+        ec = 1;
+    } catch (exit exc) {
+        ec = exc.code;
+    }
+
+    return ec;
+}
+
+#undef USAGE
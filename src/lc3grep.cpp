@@ -0,0 +1,254 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <filesystem>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define LC3_MMAP
+#endif
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "pattern.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-b] [-c] [-o <offset>] <pattern> <file>..." << endl \
+                               << "       " << (name) << " -h" << endl;
+
+int main(int argc, char **argv) {
+    class exit {
+        public:
+        char code;
+        exit(): code(0) {
+        }
+        exit(char c): code(c) {
+        }
+    };
+
+    class inputError {
+        public:
+        string problem;
+        inputError(string problem): problem(problem) {
+        }
+    };
+
+    char ec = 0;
+
+    try {
+        int mode = 1;
+        bool count = false;
+        bool help = false;
+
+        uint16_t origin = 0x3000;
+        bool originSet = false;
+
+        string source;
+        bool hasSource = false;
+        vector<string> inputs;
+
+        bool o = false;
+        for (int i = 1; i < argc; i++) {
+            if (o) {
+                o = false;
+                char *p;
+                unsigned long long n = strtoull(argv[i], &p, 16);
+
+                if (*p != 0) {
+                    throw inputError("-o: invalid offset, provide a hexadecimal number");
+                }
+
+                origin = n;
+                originSet = true;
+
+                continue;
+            }
+
+            string arg = string(argv[i]);
+            if (arg == "-b") {        // Binary input
+                mode = 0;
+            } else if (arg == "-c") { // Count only
+                count = true;
+            } else if (arg == "-h") { // Help menu
+                help = true;
+            } else if (arg == "-o") { // Offset
+                o = true;
+            } else if (arg != "-" && arg[0] == '-') { // Invalid
+                throw inputError("unknown flag: " + arg);
+            } else if (!hasSource) {  // Pattern
+                source = arg;
+                hasSource = true;
+            } else {                  // Input file
+                if (arg != "-") {
+                    fs::path path(arg);
+
+                    if (!fs::exists(path))
+                        throw inputError(arg + ": no such file");
+                    if (fs::is_directory(path))
+                        throw inputError(arg + ": is a directory");
+                    if (!fs::is_regular_file(path))
+                        throw inputError(arg + ": is not a file");
+                }
+
+                inputs.push_back(arg);
+            }
+        }
+
+        if (o) {
+            throw inputError("-o: expected offset");
+        }
+
+        if (help) {
+            USAGE(std::cout, argv[0]);
+            std::cout << endl;
+            std::cout << "Search LC3 machine code for instructions or sequences of instructions, and print" << endl;
+            std::cout << "every match in the same table format as lc3c." << endl;
+            std::cout << endl;
+            std::cout << "The pattern is written in the assembly syntax lc3c prints, with instructions" << endl;
+            std::cout << "separated by ';'. Any operand can be '*' to match anything, missing operands" << endl;
+            std::cout << "match anything, and registers can be a variable like 'Rx' that must be the" << endl;
+            std::cout << "same register everywhere it occurs. 'BR*' is a branch with any condition, and" << endl;
+            std::cout << "a lone '*' is any word. For example:" << endl;
+            std::cout << "    'TRAP x25'" << endl;
+            std::cout << "    'LDR R* R6'" << endl;
+            std::cout << "    'AND Rx Rx #0; ADD Rx Rx #*'" << endl;
+            std::cout << "    'ADD Rx Rx #-1; BRp [OFFSET *]'" << endl;
+            std::cout << endl;
+            std::cout << "Files ending in '.obj' are LC3 object files and are memory mapped. Other files" << endl;
+            std::cout << "have a hexadecimal number on each line, like the input of lc3c. Use '-' for" << endl;
+            std::cout << "the standard input." << endl;
+            std::cout << endl;
+            std::cout << "  -b: Binary input mode. Each line must be a binary number." << endl;
+            std::cout << "  -c: Only print the amount of matches of each file." << endl;
+            std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -o: Provide the offset of the program in the LC3 memory in hexadecimal. Default" << endl;
+            std::cout << "      is 3000, or the origin in the header of an object file." << endl;
+
+            throw exit(0);
+        }
+
+        if (!hasSource) {
+            throw inputError("no pattern");
+        }
+        if (inputs.empty()) {
+            throw inputError("no input file");
+        }
+
+        lc3::Pattern pat;
+        try {
+            pat = lc3::compilePattern(source);
+        } catch (lc3::PatternError exc) {
+            throw inputError(exc.problem);
+        }
+
+        // Using sprintf to format the instruction number in here
+        char insnNum[8];
+        bool any = false;
+        size_t printed = 0;
+
+        for (const string &path : inputs) {
+            string prefix = inputs.size() > 1 ? path + " | " : "";
+            size_t matches = 0;
+
+            auto report = [&](const lc3::UInt *words, size_t n, bool bigEndian, lc3::UInt start) {
+                lc3::searchPattern(words, n, bigEndian, pat, [&](size_t i) {
+                    matches++;
+                    if (count) return;
+
+                    if (pat.size() > 1 && printed++ > 0)
+                        std::cout << "--" << endl;
+
+                    for (size_t j = 0; j < pat.size(); j++) {
+                        lc3::UInt w = words[i + j];
+                        if (bigEndian) w = (lc3::UInt) ((w << 8) | (w >> 8));
+
+                        lc3::Instruction insn = { w };
+                        sprintf((char *)&insnNum, "x%04X", (lc3::UInt) (start + i + j));
+                        std::cout << prefix << insnNum << " | " << insn.hexString() << " | " << insn.binaryString() << " | " << insn.assemblyString() << endl;
+                    }
+                });
+            };
+
+            if (fs::path(path).extension() == ".obj") {
+#ifdef LC3_MMAP
+                int fd = open(path.c_str(), O_RDONLY);
+                if (fd < 0)
+                    throw inputError(path + ": permission denied");
+
+                struct stat st;
+                fstat(fd, &st);
+                size_t bytes = st.st_size;
+
+                if (bytes >= 2) {
+                    void *map = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (map == MAP_FAILED) {
+                        close(fd);
+                        throw inputError(path + ": cannot map file");
+                    }
+                    madvise(map, bytes, MADV_SEQUENTIAL);
+
+                    const lc3::UInt *words = (const lc3::UInt *) map;
+                    lc3::UInt start = originSet ? origin : (lc3::UInt) ((((const unsigned char *) map)[0] << 8) | ((const unsigned char *) map)[1]);
+
+                    report(words + 1, bytes / 2 - 1, true, start);
+                    munmap(map, bytes);
+                }
+                close(fd);
+#else
+                ifstream in(path, ios::binary);
+                if (!in.good())
+                    throw inputError(path + ": permission denied");
+
+                lc3::Image image;
+                lc3::readObj(in, image);
+                if (originSet) image.origin = origin;
+                report(image.words.data(), image.size(), false, image.origin);
+#endif
+            } else {
+                lc3::Image image(origin);
+                auto word = [&](lc3::UInt n, bool) {
+                    image.words.push_back(n);
+                };
+
+                if (path == "-") {
+                    lc3::readLines(cin, mode ? 16 : 2, true, word);
+                } else {
+                    ifstream in(path);
+                    if (!in.good())
+                        throw inputError(path + ": permission denied");
+                    lc3::readLines(in, mode ? 16 : 2, false, word);
+                }
+
+                report(image.words.data(), image.size(), false, image.origin);
+            }
+
+            if (count)
+                std::cout << prefix << matches << endl;
+            if (matches > 0)
+                any = true;
+        }
+
+        // Like grep, exit with 1 when nothing matched
+        ec = any ? 0 : 1;
+    } catch (inputError exc) {
+        std::cerr << argv[0] << ": " << exc.problem << endl;
+        USAGE(std::cerr, argv[0]);
+        std::cerr << "Type '" << argv[0] << " -h' for help" << endl;
+
+        ec = 2;
+    } catch (exit exc) {
+        ec = exc.code;
+    }
+
+    return ec;
+}
+
+#undef USAGE
@@ -0,0 +1,395 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <filesystem>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "machine.hpp"
+#include "trace.hpp"
+
+// Forking, for the fork server
+#if defined(__unix__) || defined(__APPLE__)
+#define LC3_FORK
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-b] [-f] [-l] [-r] [-S] [-v] [-e <engine>] [-n <limit>] [-o <offset>] [-t <seconds>] [-T <file> [-k <count>]] <file>" << endl \
+                               << "       " << (name) << " -h" << endl;
+
+int main(int argc, char **argv) {
+    class exit {
+        public:
+        char code;
+        exit(): code(0) {
+        }
+        exit(char c): code(c) {
+        }
+    };
+
+    class inputError {
+        public:
+        string problem;
+        inputError(string problem): problem(problem) {
+        }
+    };
+
+    char ec = 0;
+
+    try {
+        int mode = 1;
+        bool verbose = false;
+        bool real = false;
+        bool fuse = false;
+        bool loops = false;
+        bool help = false;
+        bool server = false;
+
+        uint16_t origin = 0x3000;
+        bool originSet = false;
+        uint64_t limit = UINT64_MAX;
+
+        string input;
+
+        // Flags that take an argument
+        string *pending = nullptr;
+        string offsetArg, limitArg, engineArg, timeArg, traceArg, keepArg;
+
+        for (int i = 1; i < argc; i++) {
+            string arg = string(argv[i]);
+
+            if (pending != nullptr) {
+                *pending = arg;
+                pending = nullptr;
+                continue;
+            }
+
+            if (arg == "-b") {        // Binary input
+                mode = 0;
+            } else if (arg == "-f") { // Fuse instructions
+                fuse = true;
+            } else if (arg == "-l") { // Find loops
+                loops = true;
+            } else if (arg == "-r") { // Real trap routines
+                real = true;
+            } else if (arg == "-S") { // Fork server
+                server = true;
+            } else if (arg == "-v") { // Report statistics
+                verbose = true;
+            } else if (arg == "-h") { // Help menu
+                help = true;
+            } else if (arg == "-o") { // Offset
+                pending = &offsetArg;
+                originSet = true;
+            } else if (arg == "-e") { // Engine
+                pending = &engineArg;
+            } else if (arg == "-n") { // Instruction limit
+                pending = &limitArg;
+            } else if (arg == "-t") { // Processor time limit
+                pending = &timeArg;
+            } else if (arg == "-T") { // Trace
+                pending = &traceArg;
+            } else if (arg == "-k") { // Keep the end of the trace
+                pending = &keepArg;
+            } else if (arg[0] == '-') { // Invalid, stdin is the keyboard so '-' is too
+                throw inputError("unknown flag: " + arg);
+            } else {                  // Use file
+                if (!input.empty())
+                    throw inputError("input file already specified");
+
+                fs::path path(arg);
+
+                if (!fs::exists(path))
+                    throw inputError(arg + ": no such file");
+                if (fs::is_directory(path))
+                    throw inputError(arg + ": is a directory");
+                if (!fs::is_regular_file(path))
+                    throw inputError(arg + ": is not a file");
+
+                input = arg;
+            }
+        }
+
+        if (pending != nullptr) {
+            throw inputError(string(argv[argc - 1]) + ": expected an argument");
+        }
+
+        if (help) {
+            USAGE(std::cout, argv[0]);
+            std::cout << endl;
+            std::cout << "Run an LC3 program. The standard input is the keyboard and the standard output" << endl;
+            std::cout << "is the display. A built-in operating system provides the usual trap routines" << endl;
+            std::cout << "(GETC, OUT, PUTS, IN, PUTSP and HALT). The program runs in user mode, starting" << endl;
+            std::cout << "at its origin, until it halts." << endl;
+            std::cout << endl;
+            std::cout << "Bit 14 of KBSR enables the keyboard interrupt (vector x80, priority 4). A timer" << endl;
+            std::cout << "that is not part of the standard LC3 runs every TMI (xFE0A) instructions when" << endl;
+            std::cout << "that is not 0, setting bit 15 of TMR (xFE08), and interrupts (vector x81," << endl;
+            std::cout << "priority 5) when bit 14 of TMR is set." << endl;
+            std::cout << endl;
+            std::cout << "The input is read like lc3c reads it: a hexadecimal number on each line, or an" << endl;
+            std::cout << "object file if the name ends in '.obj'." << endl;
+            std::cout << endl;
+            std::cout << "  -b: Binary input mode. Each line must be a binary number." << endl;
+            std::cout << "  -e: How to execute instructions:" << endl;
+            std::cout << "        switch:   a portable loop around a switch." << endl;
+            std::cout << "        threaded: every instruction jumps straight to the code of the next one." << endl;
+            std::cout << "        jit:      compile the program to x86-64 code while it runs. Falls back" << endl;
+            std::cout << "                  to the default where that is not supported." << endl;
+            std::cout << "      Default is " << lc3::ENGINE_NAMES[lc3::DEFAULT_ENGINE] << ". Use lc3bench to compare them." << endl;
+            std::cout << "  -f: Execute common pairs of instructions as one, like 'NOT Rx Ry; ADD Rx Rx #1'." << endl;
+            std::cout << "      This is invisible to the program. With -v, print how often each pair ran." << endl;
+            std::cout << "      Only for the switch and threaded engines." << endl;
+            std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -k: With -T, only write the last this many instructions." << endl;
+            std::cout << "  -l: Stop when the program is in a state it was in before, without input coming" << endl;
+            std::cout << "      in between: it would go round in that loop forever." << endl;
+            std::cout << "  -n: Stop after this many instructions." << endl;
+            std::cout << "  -o: Provide the offset of the program in the LC3 memory in hexadecimal. Default" << endl;
+            std::cout << "      is 3000, or the origin in the header of an object file." << endl;
+            std::cout << "  -r: Run the trap routines of the operating system instruction by instruction," << endl;
+            std::cout << "      like real LC3 code, polling the devices. By default they run natively, each" << endl;
+            std::cout << "      as a single instruction." << endl;
+            std::cout << "  -S: Fork server. Load the program once, then read requests from the standard" << endl;
+            std::cout << "      input, one per line: an input file and an output file, separated by a tab." << endl;
+            std::cout << "      Each runs in a child process forked from the loaded machine, with the input" << endl;
+            std::cout << "      file as the keyboard and the output file as the display. When it is done," << endl;
+            std::cout << "      'exit <code>' or 'signal <number>' is written to the standard output." << endl;
+            std::cout << "  -t: With -S, limit the processor time of each run to this many seconds." << endl;
+            std::cout << "  -T: Write a trace of every executed instruction to this file, with the registers" << endl;
+            std::cout << "      and memory it wrote or read, in a compact binary format. Print it with" << endl;
+            std::cout << "      lc3trace. The program runs with the switch engine then. With -k it takes about" << endl;
+            std::cout << "      twice as long, writing all of it takes as long as encoding and writing it does." << endl;
+            std::cout << "      Traps still run natively, GETC and IN with the key they read into R0 traced." << endl;
+            std::cout << "  -v: Print the amount of executed instructions and the speed when done." << endl;
+
+            throw exit(0);
+        }
+
+        if (originSet) {
+            char *p;
+            origin = strtoull(offsetArg.c_str(), &p, 16);
+            if (*p != 0 || offsetArg.empty())
+                throw inputError("-o: invalid offset, provide a hexadecimal number");
+        }
+
+        lc3::Engine engine = lc3::DEFAULT_ENGINE;
+        if (!engineArg.empty() && !lc3::engineNamed(engineArg, engine)) {
+            throw inputError("-e: unknown engine '" + engineArg + "'");
+        }
+
+        if (!limitArg.empty()) {
+            char *p;
+            limit = strtoull(limitArg.c_str(), &p, 10);
+            if (*p != 0)
+                throw inputError("-n: invalid limit, provide a decimal number");
+        }
+
+        uint64_t cpuLimit = 0;
+        if (!timeArg.empty()) {
+            char *p;
+            cpuLimit = strtoull(timeArg.c_str(), &p, 10);
+            if (*p != 0 || cpuLimit == 0)
+                throw inputError("-t: invalid time, provide a positive decimal number");
+            if (!server)
+                throw inputError("-t: only with -S");
+        }
+
+        uint64_t keep = 0;
+        if (!keepArg.empty()) {
+            char *p;
+            keep = strtoull(keepArg.c_str(), &p, 10);
+            if (*p != 0 || keep == 0)
+                throw inputError("-k: invalid count, provide a positive decimal number");
+            if (traceArg.empty())
+                throw inputError("-k: only with -T");
+        }
+
+        if (!traceArg.empty() && server)
+            throw inputError("-T: not with -S");
+
+#ifndef LC3_FORK
+        if (server)
+            throw inputError("-S: not supported on this system");
+#endif
+
+        if (input.empty()) {
+            throw inputError("no input file");
+        }
+
+        // Load the program
+        lc3::Image image(origin);
+        if (fs::path(input).extension() == ".obj") {
+            ifstream in(input, ios::binary);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            if (!lc3::readObj(in, image))
+                throw inputError(input + ": truncated object file");
+            if (originSet)
+                image.origin = origin;
+        } else {
+            ifstream in(input);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            lc3::readLines(in, mode ? 16 : 2, false, [&](lc3::UInt n, bool) {
+                image.words.push_back(n);
+            });
+        }
+
+        // The machine is over a megabyte, keep it off the stack
+        unique_ptr<lc3::Machine> machine(new lc3::Machine());
+        machine->load(image);
+        machine->engine = engine;
+        machine->fuse = fuse;
+        machine->nativeTraps = !real;
+        machine->findLoops = loops;
+
+        ofstream traceFile;
+        unique_ptr<lc3::Tracer> tracer;
+        if (!traceArg.empty()) {
+            traceFile.open(traceArg, ios::binary | ios::trunc);
+            if (!traceFile.good())
+                throw inputError(traceArg + ": cannot be written");
+            tracer.reset(keep > 0 ? new lc3::Tracer(traceFile, keep) : new lc3::Tracer(traceFile));
+            machine->tracer = tracer.get();
+        }
+
+        // Run the machine and report how it stopped
+        // @return The exit code
+        auto simulate = [&]() -> char {
+            char code = 0;
+
+            auto start = chrono::steady_clock::now();
+            lc3::Stop stop = machine->run(limit);
+            if (tracer) tracer->finish();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            switch (stop) {
+                case lc3::STOP_HALT:
+                    break;
+
+                case lc3::STOP_LIMIT:
+                    std::cerr << argv[0] << ": stopped after " << machine->instructions << " instructions" << endl;
+                    code = 2;
+                    break;
+
+                case lc3::STOP_INPUT:
+                    std::cerr << argv[0] << ": the program waits for input, but the input has ended" << endl;
+                    code = 2;
+                    break;
+
+                case lc3::STOP_LOOP:
+                    std::cerr << argv[0] << ": the program never halts, it is in a loop after " << machine->instructions << " instructions" << endl;
+                    code = 2;
+                    break;
+
+                case lc3::STOP_BREAK: // No breakpoints or watchpoints are set
+                case lc3::STOP_WATCH:
+                    break;
+            }
+
+            if (verbose) {
+                std::cerr << machine->instructions << " instructions in " << seconds << " s";
+                if (seconds > 0)
+                    std::cerr << " (" << machine->instructions / seconds / 1e6 << " MIPS)";
+                std::cerr << endl;
+
+                if (fuse) {
+                    uint64_t fused = 0;
+                    for (int f = 0; f < lc3::FUSIONS; f++) {
+                        std::cerr << "  " << lc3::FUSION_PATTERNS[f] << ": " << machine->fusions[f] << " times" << endl;
+                        fused += machine->fusions[f];
+                    }
+                    if (machine->instructions > 0) {
+                        double dispatches = (double) (machine->instructions - fused) / machine->instructions;
+                        std::cerr << dispatches << " dispatches per instruction" << endl;
+                    }
+                }
+            }
+
+            return code;
+        };
+
+        if (!server) {
+            machine->console.in = &cin;
+            machine->console.out = &cout;
+            ec = simulate();
+        }
+
+#ifdef LC3_FORK
+        // Every child starts from the loaded machine, copied on write by the system, so that
+        // starting the process and loading the program is only paid once
+        string request;
+        while (server && getline(cin, request)) {
+            size_t tab = request.find('\t');
+            if (tab == string::npos) {
+                std::cerr << argv[0] << ": -S: expected an input and an output file, separated by a tab" << endl;
+                std::cout << "exit 1" << endl;
+                continue;
+            }
+            string keys = request.substr(0, tab);
+            string display = request.substr(tab + 1);
+
+            std::cout.flush();
+            std::cerr.flush();
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                // Not through the standard streams: cin has buffered requests that the child must
+                // not read as keys
+                ifstream in(keys, ios::binary);
+                ofstream out(display, ios::binary | ios::trunc);
+                char code = 1;
+                if (!in.good()) {
+                    std::cerr << argv[0] << ": " << keys << ": cannot be read" << endl;
+                } else if (!out.good()) {
+                    std::cerr << argv[0] << ": " << display << ": cannot be written" << endl;
+                } else {
+                    if (cpuLimit > 0) {
+                        struct rlimit cpu = { (rlim_t) cpuLimit, (rlim_t) cpuLimit + 1 };
+                        setrlimit(RLIMIT_CPU, &cpu);
+                    }
+                    machine->console.in = &in;
+                    machine->console.out = &out;
+                    code = simulate();
+                    machine->console.flush();
+                    out.flush();
+                }
+                std::cerr.flush();
+                _exit(code);
+            }
+
+            int status = 0;
+            if (pid < 0 || waitpid(pid, &status, 0) < 0) {
+                std::cerr << argv[0] << ": -S: cannot start a run" << endl;
+                std::cout << "exit 1" << endl;
+            } else if (WIFSIGNALED(status)) {
+                std::cout << "signal " << WTERMSIG(status) << endl;
+            } else {
+                std::cout << "exit " << WEXITSTATUS(status) << endl;
+            }
+        }
+#endif
+    } catch (inputError exc) {
+        std::cerr << argv[0] << ": " << exc.problem << endl;
+        USAGE(std::cerr, argv[0]);
+        std::cerr << "Type '" << argv[0] << " -h' for help" << endl;
+
+        ec = 1;
+    } catch (exit exc) {
+        ec = exc.code;
+    }
+
+    return ec;
+}
+
+#undef USAGE
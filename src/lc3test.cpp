@@ -0,0 +1,538 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "machine.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-b] [-l] [-r] [-f <format>] [-j <threads>] [-n <limit>] [-o <offset>] <file> <directory>" << endl \
+                               << "       " << (name) << " -h" << endl;
+
+// A test case: the files it consists of, and how it went
+struct Test {
+    string name;
+    fs::path input;  // The keyboard, or empty for none
+    fs::path output; // What must be displayed, or empty to not check
+    fs::path check;  // Registers and memory to check, or empty for none
+
+    bool passed = false;
+    string failure;
+    uint64_t instructions = 0;
+    double seconds = 0;
+};
+
+// Read a whole file, or return false if it can't be read
+static bool readFile(const fs::path &path, string &data) {
+    ifstream in(path, ios::binary);
+    if (!in.good()) return false;
+    stringstream s;
+    s << in.rdbuf();
+    data = s.str();
+    return true;
+}
+
+// Parse a number like lc3c writes them: xABCD in hexadecimal, #12 or 12 in decimal
+static bool parseNumber(const string &text, uint32_t &value) {
+    if (text.empty()) return false;
+
+    int base = 10;
+    size_t at = 0;
+    if (text[0] == 'x' || text[0] == 'X') {
+        base = 16;
+        at = 1;
+    } else if (text[0] == '#') {
+        at = 1;
+    }
+
+    bool negative = base == 10 && at < text.size() && text[at] == '-';
+    if (negative) at++;
+    if (at == text.size()) return false;
+
+    char *p;
+    unsigned long long n = strtoull(text.c_str() + at, &p, base);
+    if (*p != 0 || n > 0xFFFF) return false;
+    value = negative ? (uint32_t) (0x10000 - n) & 0xFFFF : (uint32_t) n;
+    return true;
+}
+
+static string hex(uint32_t value) {
+    char s[8];
+    snprintf(s, sizeof(s), "x%04X", value);
+    return s;
+}
+
+// Check the registers and memory against the lines of a check file, like 'R0 = x0041' or
+// 'x3100 = #-1'. Semicolons start comments.
+// @return An empty string if everything is as expected, otherwise what is not
+static string checkState(const lc3::Machine &machine, const string &checks, const string &file) {
+    istringstream lines(checks);
+    string line;
+    for (int number = 1; getline(lines, line); number++) {
+        line = line.substr(0, line.find(';'));
+
+        istringstream tokens(line);
+        string location, equals, expected, rest;
+        if (!(tokens >> location)) continue;
+
+        uint32_t want;
+        if (!(tokens >> equals >> expected) || equals != "=" || (tokens >> rest) || !parseNumber(expected, want))
+            return file + ":" + to_string(number) + ": expected '<location> = <value>'";
+
+        string name = location;
+        for (char &c : name) c = toupper(c);
+
+        uint32_t got, addr;
+        if (name.size() == 2 && name[0] == 'R' && name[1] >= '0' && name[1] <= '7') {
+            got = machine.reg[name[1] - '0'];
+        } else if (name == "PC") {
+            got = machine.pc;
+        } else if (name == "PSR") {
+            got = machine.psr;
+        } else if (parseNumber(location, addr)) {
+            got = machine.mem[addr];
+            name = hex(addr);
+        } else {
+            return file + ":" + to_string(number) + ": unknown location '" + location + "'";
+        }
+
+        if (got != want)
+            return name + " is " + hex(got) + ", expected " + hex(want);
+    }
+    return "";
+}
+
+// Compare what was displayed with what was expected
+// @return An empty string if they are the same, otherwise where they differ
+static string checkDisplay(const string &got, const string &want) {
+    if (got == want) return "";
+
+    size_t at = 0;
+    while (at < got.size() && at < want.size() && got[at] == want[at]) at++;
+
+    auto excerpt = [&](const string &s) {
+        string e;
+        for (size_t i = at; i < s.size() && i < at + 16; i++) {
+            char c = s[i];
+            if (c == '\n') e += "\\n";
+            else if (c < 32 || c > 126) e += "\\x" + hex((unsigned char) c).substr(3);
+            else e += c;
+        }
+        return at >= s.size() ? string("the end") : "'" + e + "'";
+    };
+
+    return "the display differs at character " + to_string(at) + ": " + excerpt(got) + " instead of " + excerpt(want);
+}
+
+static string escapeJson(const string &s) {
+    string e;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            e += '\\';
+            e += c;
+        } else if ((unsigned char) c < 32) {
+            char u[8];
+            snprintf(u, sizeof(u), "\\u%04x", c);
+            e += u;
+        } else {
+            e += c;
+        }
+    }
+    return e;
+}
+
+static string escapeXml(const string &s) {
+    string e;
+    for (char c : s) {
+        switch (c) {
+            case '<': e += "&lt;"; break;
+            case '>': e += "&gt;"; break;
+            case '&': e += "&amp;"; break;
+            case '"': e += "&quot;"; break;
+            default: e += c; break;
+        }
+    }
+    return e;
+}
+
+int main(int argc, char **argv) {
+    class exit {
+        public:
+        char code;
+        exit(): code(0) {
+        }
+        exit(char c): code(c) {
+        }
+    };
+
+    class inputError {
+        public:
+        string problem;
+        inputError(string problem): problem(problem) {
+        }
+    };
+
+    char ec = 0;
+
+    try {
+        int mode = 1;
+        bool real = false;
+        bool loops = false;
+        bool help = false;
+
+        uint16_t origin = 0x3000;
+        bool originSet = false;
+        uint64_t limit = UINT64_MAX;
+
+        string program;
+        string directory;
+
+        // Flags that take an argument
+        string *pending = nullptr;
+        string offsetArg, limitArg, threadsArg, formatArg;
+
+        for (int i = 1; i < argc; i++) {
+            string arg = string(argv[i]);
+
+            if (pending != nullptr) {
+                *pending = arg;
+                pending = nullptr;
+                continue;
+            }
+
+            if (arg == "-b") {        // Binary input
+                mode = 0;
+            } else if (arg == "-l") { // Find loops
+                loops = true;
+            } else if (arg == "-r") { // Real trap routines
+                real = true;
+            } else if (arg == "-h") { // Help menu
+                help = true;
+            } else if (arg == "-o") { // Offset
+                pending = &offsetArg;
+                originSet = true;
+            } else if (arg == "-n") { // Instruction limit
+                pending = &limitArg;
+            } else if (arg == "-j") { // Threads
+                pending = &threadsArg;
+            } else if (arg == "-f") { // Format of the results
+                pending = &formatArg;
+            } else if (arg[0] == '-') { // Invalid
+                throw inputError("unknown flag: " + arg);
+            } else if (program.empty()) { // Program
+                fs::path path(arg);
+
+                if (!fs::exists(path))
+                    throw inputError(arg + ": no such file");
+                if (fs::is_directory(path))
+                    throw inputError(arg + ": is a directory");
+                if (!fs::is_regular_file(path))
+                    throw inputError(arg + ": is not a file");
+
+                program = arg;
+            } else {                  // Tests
+                if (!directory.empty())
+                    throw inputError("test directory already specified");
+
+                fs::path path(arg);
+
+                if (!fs::exists(path))
+                    throw inputError(arg + ": no such directory");
+                if (!fs::is_directory(path))
+                    throw inputError(arg + ": is not a directory");
+
+                directory = arg;
+            }
+        }
+
+        if (pending != nullptr) {
+            throw inputError(string(argv[argc - 1]) + ": expected an argument");
+        }
+
+        if (help) {
+            USAGE(std::cout, argv[0]);
+            std::cout << endl;
+            std::cout << "Run an LC3 program on every test case in a directory, on all processor cores, and" << endl;
+            std::cout << "report which ones pass. A test case consists of files with the same name and" << endl;
+            std::cout << "these extensions, each of which may be left out:" << endl;
+            std::cout << "  .in:    The keyboard. Without it, there are no keys." << endl;
+            std::cout << "  .out:   What the program must display. Without it, anything goes." << endl;
+            std::cout << "  .check: Registers and memory to check after the program halts, a line like" << endl;
+            std::cout << "          'R0 = x0041', 'PC = x3010' or 'x3100 = #-1' for each." << endl;
+            std::cout << "A test passes if the program halts and everything is as expected. Like lc3sim, a" << endl;
+            std::cout << "built-in operating system provides the usual trap routines." << endl;
+            std::cout << endl;
+            std::cout << "Every thread has a queue of test cases, and takes work from the others when its" << endl;
+            std::cout << "own queue is empty, so that long test cases do not hold up the short ones." << endl;
+            std::cout << endl;
+            std::cout << "The program is read like lc3c reads it: a hexadecimal number on each line, or an" << endl;
+            std::cout << "object file if the name ends in '.obj'." << endl;
+            std::cout << endl;
+            std::cout << "  -b: Binary input mode. Each line must be a binary number." << endl;
+            std::cout << "  -f: How to report the results:" << endl;
+            std::cout << "        text:  a line for each test case that failed, and a summary." << endl;
+            std::cout << "        junit: JUnit XML." << endl;
+            std::cout << "        json:  a JSON object." << endl;
+            std::cout << "      Default is text." << endl;
+            std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -j: Run on this many threads. Default is one for each processor core." << endl;
+            std::cout << "  -l: Fail a test case as soon as the program is in a state it was in before," << endl;
+            std::cout << "      without input coming in between: it would go round in that loop forever." << endl;
+            std::cout << "  -n: Stop each test case after this many instructions, and fail it." << endl;
+            std::cout << "  -o: Provide the offset of the program in the LC3 memory in hexadecimal. Default" << endl;
+            std::cout << "      is 3000, or the origin in the header of an object file." << endl;
+            std::cout << "  -r: Run the trap routines of the operating system instruction by instruction," << endl;
+            std::cout << "      like real LC3 code, polling the devices. By default they run natively, each" << endl;
+            std::cout << "      as a single instruction." << endl;
+
+            throw exit(0);
+        }
+
+        if (originSet) {
+            char *p;
+            origin = strtoull(offsetArg.c_str(), &p, 16);
+            if (*p != 0 || offsetArg.empty())
+                throw inputError("-o: invalid offset, provide a hexadecimal number");
+        }
+
+        if (!limitArg.empty()) {
+            char *p;
+            limit = strtoull(limitArg.c_str(), &p, 10);
+            if (*p != 0)
+                throw inputError("-n: invalid limit, provide a decimal number");
+        }
+
+        int threads = thread::hardware_concurrency();
+        if (threads < 1) threads = 1;
+        if (!threadsArg.empty()) {
+            char *p;
+            threads = strtol(threadsArg.c_str(), &p, 10);
+            if (*p != 0 || threads < 1)
+                throw inputError("-j: invalid amount of threads, provide a positive decimal number");
+        }
+
+        string format = formatArg.empty() ? "text" : formatArg;
+        if (format != "text" && format != "junit" && format != "json") {
+            throw inputError("-f: unknown format '" + format + "'");
+        }
+
+        if (program.empty()) {
+            throw inputError("no program file");
+        }
+        if (directory.empty()) {
+            throw inputError("no test directory");
+        }
+
+        string input = program;
+
+        // Load the program
+        lc3::Image image(origin);
+        if (fs::path(input).extension() == ".obj") {
+            ifstream in(input, ios::binary);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            if (!lc3::readObj(in, image))
+                throw inputError(input + ": truncated object file");
+            if (originSet)
+                image.origin = origin;
+        } else {
+            ifstream in(input);
+            if (!in.good())
+                throw inputError(input + ": permission denied");
+            lc3::readLines(in, mode ? 16 : 2, false, [&](lc3::UInt n, bool) {
+                image.words.push_back(n);
+            });
+        }
+
+        // Find the test cases, in order of name
+        set<string> names;
+        for (const fs::directory_entry &entry : fs::directory_iterator(directory)) {
+            string ext = entry.path().extension().string();
+            if (entry.is_regular_file() && (ext == ".in" || ext == ".out" || ext == ".check"))
+                names.insert(entry.path().stem().string());
+        }
+
+        vector<Test> tests;
+        for (const string &name : names) {
+            Test t;
+            t.name = name;
+            fs::path base = fs::path(directory) / name;
+            for (auto [ext, path] : { make_pair(".in", &t.input), make_pair(".out", &t.output), make_pair(".check", &t.check) }) {
+                fs::path p = base;
+                p += ext;
+                if (fs::is_regular_file(p)) *path = p;
+            }
+            tests.push_back(t);
+        }
+
+        // A queue of test cases for every thread. A thread takes its own from the back, and when
+        // it has none left, steals from the front of the others: the test cases that their owner
+        // would run last.
+        struct Queue {
+            mutex m;
+            deque<size_t> tests;
+        };
+        vector<Queue> queues(threads);
+        for (size_t i = 0; i < tests.size(); i++)
+            queues[i % threads].tests.push_back(i);
+
+        auto next = [&](int self, size_t &test) {
+            {
+                Queue &own = queues[self];
+                lock_guard<mutex> lock(own.m);
+                if (!own.tests.empty()) {
+                    test = own.tests.back();
+                    own.tests.pop_back();
+                    return true;
+                }
+            }
+            // Nothing is added once the threads run, so there is no work left once every queue was
+            // found empty
+            for (int k = 1; k < threads; k++) {
+                Queue &other = queues[(self + k) % threads];
+                lock_guard<mutex> lock(other.m);
+                if (!other.tests.empty()) {
+                    test = other.tests.front();
+                    other.tests.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        };
+
+        auto work = [&](int self) {
+            // Every test case starts from a snapshot of the loaded program, see Machine::restore
+            unique_ptr<lc3::Machine> machine(new lc3::Machine());
+            unique_ptr<lc3::Snapshot> loaded(new lc3::Snapshot());
+            machine->nativeTraps = !real;
+            machine->findLoops = loops;
+            machine->load(image);
+            machine->save(*loaded);
+
+            size_t i;
+            while (next(self, i)) {
+                Test &t = tests[i];
+
+                string keys, want, checks;
+                if (!t.input.empty() && !readFile(t.input, keys)) {
+                    t.failure = t.input.string() + ": cannot be read";
+                    continue;
+                }
+                if (!t.output.empty() && !readFile(t.output, want)) {
+                    t.failure = t.output.string() + ": cannot be read";
+                    continue;
+                }
+                if (!t.check.empty() && !readFile(t.check, checks)) {
+                    t.failure = t.check.string() + ": cannot be read";
+                    continue;
+                }
+
+                istringstream in(keys);
+                machine->restore(*loaded);
+                machine->console = lc3::Console();
+                machine->console.in = &in;
+
+                auto start = chrono::steady_clock::now();
+                lc3::Stop stop = machine->run(limit);
+                t.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                t.instructions = machine->instructions;
+
+                if (stop == lc3::STOP_LIMIT) {
+                    t.failure = "stopped after " + to_string(machine->instructions) + " instructions";
+                } else if (stop == lc3::STOP_INPUT) {
+                    t.failure = "the program waits for input, but the input has ended";
+                } else if (stop == lc3::STOP_LOOP) {
+                    t.failure = "the program never halts, it is in a loop after " + to_string(machine->instructions) + " instructions";
+                } else if (!t.output.empty()) {
+                    t.failure = checkDisplay(machine->console.output, want);
+                }
+                if (t.failure.empty() && !t.check.empty()) {
+                    t.failure = checkState(*machine, checks, t.check.string());
+                }
+                t.passed = t.failure.empty();
+            }
+        };
+
+        auto start = chrono::steady_clock::now();
+
+        vector<thread> workers;
+        for (int w = 1; w < threads; w++) workers.emplace_back(work, w);
+        work(0);
+        for (thread &w : workers) w.join();
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        size_t failures = 0;
+        for (const Test &t : tests) {
+            if (!t.passed) failures++;
+        }
+
+        if (format == "junit") {
+            string suite = fs::path(program).stem().string();
+            std::cout << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>" << endl;
+            std::cout << "<testsuite name=\"" << escapeXml(suite) << "\" tests=\"" << tests.size()
+                      << "\" failures=\"" << failures << "\" time=\"" << seconds << "\">" << endl;
+            for (const Test &t : tests) {
+                std::cout << "  <testcase name=\"" << escapeXml(t.name) << "\" classname=\"" << escapeXml(suite)
+                          << "\" time=\"" << t.seconds << "\"";
+                if (t.passed) {
+                    std::cout << "/>" << endl;
+                } else {
+                    std::cout << ">" << endl;
+                    std::cout << "    <failure message=\"" << escapeXml(t.failure) << "\"/>" << endl;
+                    std::cout << "  </testcase>" << endl;
+                }
+            }
+            std::cout << "</testsuite>" << endl;
+        } else if (format == "json") {
+            std::cout << "{" << endl;
+            std::cout << "  \"program\": \"" << escapeJson(program) << "\"," << endl;
+            std::cout << "  \"tests\": " << tests.size() << "," << endl;
+            std::cout << "  \"failures\": " << failures << "," << endl;
+            std::cout << "  \"time\": " << seconds << "," << endl;
+            std::cout << "  \"results\": [" << endl;
+            for (size_t i = 0; i < tests.size(); i++) {
+                const Test &t = tests[i];
+                std::cout << "    {\"name\": \"" << escapeJson(t.name) << "\", \"passed\": " << (t.passed ? "true" : "false")
+                          << ", \"instructions\": " << t.instructions << ", \"time\": " << t.seconds;
+                if (!t.passed) std::cout << ", \"failure\": \"" << escapeJson(t.failure) << "\"";
+                std::cout << "}" << (i + 1 < tests.size() ? "," : "") << endl;
+            }
+            std::cout << "  ]" << endl;
+            std::cout << "}" << endl;
+        } else {
+            for (const Test &t : tests) {
+                if (!t.passed) std::cout << "FAIL " << t.name << ": " << t.failure << endl;
+            }
+            std::cout << tests.size() - failures << " of " << tests.size() << " test cases passed in " << seconds << " s" << endl;
+        }
+
+        if (failures > 0) ec = 2;
+    } catch (inputError exc) {
+        std::cerr << argv[0] << ": " << exc.problem << endl;
+        USAGE(std::cerr, argv[0]);
+        std::cerr << "Type '" << argv[0] << " -h' for help" << endl;
+
+        ec = 1;
+    } catch (exit exc) {
+        ec = exc.code;
+    }
+
+    return ec;
+}
+
+#undef USAGE
@@ -0,0 +1,140 @@
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <filesystem>
+
+#include "lc3.hpp"
+#include "trace.hpp"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#define USAGE(out, name) (out) << "Usage: " << (name) << " [-v] <file>" << endl \
+                               << "       " << (name) << " -h" << endl;
+
+int main(int argc, char **argv) {
+    class exit {
+        public:
+        char code;
+        exit(): code(0) {
+        }
+        exit(char c): code(c) {
+        }
+    };
+
+    class inputError {
+        public:
+        string problem;
+        inputError(string problem): problem(problem) {
+        }
+    };
+
+    char ec = 0;
+
+    try {
+        bool verbose = false;
+        bool help = false;
+
+        string input;
+
+        for (int i = 1; i < argc; i++) {
+            string arg = string(argv[i]);
+
+            if (arg == "-v") {        // Report statistics
+                verbose = true;
+            } else if (arg == "-h") { // Help menu
+                help = true;
+            } else if (arg[0] == '-') { // Invalid
+                throw inputError("unknown flag: " + arg);
+            } else {                  // Use file
+                if (!input.empty())
+                    throw inputError("input file already specified");
+
+                fs::path path(arg);
+
+                if (!fs::exists(path))
+                    throw inputError(arg + ": no such file");
+                if (fs::is_directory(path))
+                    throw inputError(arg + ": is a directory");
+                if (!fs::is_regular_file(path))
+                    throw inputError(arg + ": is not a file");
+
+                input = arg;
+            }
+        }
+
+        if (help) {
+            USAGE(std::cout, argv[0]);
+            std::cout << endl;
+            std::cout << "Print a trace that lc3sim -T wrote, an executed instruction on each line: its" << endl;
+            std::cout << "address, the instruction like lc3c prints it, and the register and memory it" << endl;
+            std::cout << "wrote or read:" << endl;
+            std::cout << endl;
+            std::cout << "  x3004 | x6340 | LDR    R1 R5 #0         | R1 = mem[x4000] = x0005" << endl;
+            std::cout << endl;
+            std::cout << "  -h: Print this menu." << endl;
+            std::cout << "  -v: Print the amount of instructions when done." << endl;
+
+            throw exit(0);
+        }
+
+        if (input.empty()) {
+            throw inputError("no input file");
+        }
+
+        ifstream in(input, ios::binary);
+        if (!in.good())
+            throw inputError(input + ": permission denied");
+
+        uint64_t count = 0;
+        try {
+            lc3::TraceReader reader(in);
+            lc3::TraceRecord r;
+            char effect[48];
+            while (reader.next(r)) {
+                lc3::Instruction insn(r.word);
+                if (r.loads && lc3::getBits(r.word, 15, 12) == TRAP) {
+                    snprintf(effect, sizeof(effect), "R%d = x%04X, R0 = mem[x%04X] = x%04X", r.reg, r.value, r.addr, r.data);
+                } else if (r.loads) {
+                    snprintf(effect, sizeof(effect), "R%d = mem[x%04X] = x%04X", r.reg, r.addr, r.data);
+                } else if (r.stores) {
+                    snprintf(effect, sizeof(effect), "mem[x%04X] = R%d = x%04X", r.addr, r.reg, r.data);
+                } else if (r.writes) {
+                    snprintf(effect, sizeof(effect), "R%d = x%04X", r.reg, r.value);
+                } else {
+                    effect[0] = 0;
+                }
+
+                char line[96];
+                string assembly = insn.assemblyString();
+                if (effect[0])
+                    snprintf(line, sizeof(line), "x%04X | %s | %-22s | %s", r.pc, insn.hexString().c_str(), assembly.c_str(), effect);
+                else
+                    snprintf(line, sizeof(line), "x%04X | %s | %s", r.pc, insn.hexString().c_str(), assembly.c_str());
+                std::cout << line << '\n';
+                count++;
+            }
+        } catch (lc3::TraceError exc) {
+            std::cout.flush();
+            throw inputError(input + ": " + exc.problem);
+        }
+
+        if (verbose) {
+            std::cerr << count << " instructions" << endl;
+        }
+    } catch (inputError exc) {
+        std::cerr << argv[0] << ": " << exc.problem << endl;
+        USAGE(std::cerr, argv[0]);
+        std::cerr << "Type '" << argv[0] << " -h' for help" << endl;
+
+        ec = 1;
+    } catch (exit exc) {
+        ec = exc.code;
+    }
+
+    return ec;
+}
+
+#undef USAGE
@@ -0,0 +1,1473 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "os.hpp"
+#include "events.hpp"
+#include "trace.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Labels as values, for the threaded interpreter
+#if defined(__GNUC__)
+#define LC3_THREADED
+#endif
+
+// Generating machine code, for the JIT compiler
+#if defined(__GNUC__) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define LC3_JIT
+#endif
+
+namespace lc3 {
+    /// @brief Why a machine stopped running
+    enum Stop {
+        STOP_HALT,  // The clock was stopped through MCR
+        STOP_LIMIT, // The instruction limit was reached
+        STOP_INPUT, // The program polls the keyboard, but the input has ended
+        STOP_LOOP,  // The machine is in a state it was in before, so it never halts, see findLoops
+        STOP_BREAK, // The PC is at a breakpoint, which was not executed yet
+        STOP_WATCH  // A store instruction wrote to a watchpoint
+    };
+
+    /// @brief How a machine executes its micro-ops
+    enum Engine {
+        ENGINE_SWITCH,   // A loop around a switch on the kind, works with any compiler
+        ENGINE_THREADED, // Every micro-op jumps straight to the handler of the next one
+        ENGINE_JIT,      // Basic blocks are compiled to x86-64 code, see jit.hpp
+        ENGINES
+    };
+
+    // Which of the interpreters is faster depends on the machine, see lc3bench
+    const Engine DEFAULT_ENGINE = ENGINE_SWITCH;
+
+    const char *const ENGINE_NAMES[ENGINES] = { "switch", "threaded", "jit" };
+
+    /// @brief Find an engine by its name, as in ENGINE_NAMES.
+    /// @return Whether there is an engine with that name
+    inline bool engineNamed(const string &name, Engine &engine) {
+        for (int e = 0; e < ENGINES; e++) {
+            if (name == ENGINE_NAMES[e]) {
+                engine = (Engine) e;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// @brief The kinds of predecoded instructions
+    enum MicroKind : uint8_t {
+        UOP_DECODE,   // Not decoded yet, or invalidated by a store
+        UOP_UNCACHED, // Decoded on every execution (device register space)
+        UOP_NOP,      // BR without any condition
+        UOP_BR,
+        UOP_JUMP,     // BRnzp
+        UOP_ADD_REG,
+        UOP_ADD_IMM,
+        UOP_AND_REG,
+        UOP_AND_IMM,
+        UOP_NOT,
+        UOP_LD,
+        UOP_LDI,
+        UOP_LDR,
+        UOP_LEA,
+        UOP_ST,
+        UOP_STI,
+        UOP_STR,
+        UOP_JMP,
+        UOP_JSR,
+        UOP_JSRR,
+        UOP_TRAP,
+        UOP_RTI,
+        UOP_RESERVED,
+        UOP_BREAK,    // An instruction at a breakpoint, decoded in the other fields, with its kind in d
+        UOP_CONST,    // Fused pairs, see fuseMicroOps. These are always last.
+        UOP_ADD_BR,
+        UOP_NEG,
+        UOP_KINDS
+    };
+
+    /// @brief A predecoded instruction. All fields are extracted and sign-extended, and PC-relative
+    ///        operands are resolved to absolute addresses, so executing it needs no bit twiddling.
+    struct MicroOp {
+        const void *handler; // Code of the kind in the threaded interpreter, if there is one
+        uint8_t kind;
+        uint8_t a;    // DR or SR, or the nzp mask of BR
+        uint8_t b;    // SR1 or BaseR
+        uint8_t c;    // SR2
+        uint8_t d;    // Only used by fused pairs
+        UInt imm;     // Immediate, offset, absolute address or trap vector
+    };
+
+    /// @brief Decode an instruction into a micro-op.
+    /// @param addr  The address of the instruction
+    /// @param insn  The instruction
+    /// @return      The micro-op
+    inline MicroOp decodeMicroOp(UInt addr, UInt insn) {
+        UInt next = addr + 1;
+        MicroOp u = { nullptr, UOP_RESERVED, 0, 0, 0, 0, 0 };
+
+        u.a = getBits(insn, 11, 9);
+        u.b = getBits(insn, 8, 6);
+        u.c = getBits(insn, 2, 0);
+
+        switch (getBits(insn, 15, 12)) {
+            case BR:
+                u.kind = u.a == 0 ? UOP_NOP : u.a == 7 ? UOP_JUMP : UOP_BR;
+                u.imm = next + sext(getBits(insn, 8, 0), 9);
+                break;
+
+            case ADD:
+            case AND:
+            {
+                bool isAdd = getBits(insn, 15, 12) == ADD;
+                if (getBit(insn, 5)) {
+                    u.kind = isAdd ? UOP_ADD_IMM : UOP_AND_IMM;
+                    u.imm = sext(getBits(insn, 4, 0), 5);
+                } else {
+                    u.kind = isAdd ? UOP_ADD_REG : UOP_AND_REG;
+                }
+                break;
+            }
+
+            case NOT: u.kind = UOP_NOT; break;
+
+            case LD:  u.kind = UOP_LD;  u.imm = next + sext(getBits(insn, 8, 0), 9); break;
+            case LDI: u.kind = UOP_LDI; u.imm = next + sext(getBits(insn, 8, 0), 9); break;
+            case LEA: u.kind = UOP_LEA; u.imm = next + sext(getBits(insn, 8, 0), 9); break;
+            case ST:  u.kind = UOP_ST;  u.imm = next + sext(getBits(insn, 8, 0), 9); break;
+            case STI: u.kind = UOP_STI; u.imm = next + sext(getBits(insn, 8, 0), 9); break;
+
+            case LDR: u.kind = UOP_LDR; u.imm = sext(getBits(insn, 5, 0), 6); break;
+            case STR: u.kind = UOP_STR; u.imm = sext(getBits(insn, 5, 0), 6); break;
+
+            case RET: u.kind = UOP_JMP; break;
+
+            case JSR:
+                if (getBit(insn, 11)) {
+                    u.kind = UOP_JSR;
+                    u.imm = next + sext(getBits(insn, 10, 0), 11);
+                } else {
+                    u.kind = UOP_JSRR;
+                }
+                break;
+
+            case TRAP: u.kind = UOP_TRAP; u.imm = getBits(insn, 7, 0); break;
+            case RTI:  u.kind = UOP_RTI; break;
+        }
+
+        return u;
+    }
+
+    /// @brief Common pairs of instructions that are executed as one micro-op, with one dispatch
+    enum Fusion {
+        FUSE_CONST,  // Load a constant
+        FUSE_ADD_BR, // Count and branch, as at the end of a counted loop
+        FUSE_NEG,    // Negate
+        FUSIONS
+    };
+
+    // The pairs as lc3grep patterns
+    const char *const FUSION_PATTERNS[FUSIONS] = {
+        "AND Rx R* #0; ADD Rx Rx #*",
+        "ADD R* R* #*; BR*",
+        "NOT Rx R*; ADD Rx Rx #1"
+    };
+
+    /// @brief Fuse a micro-op with the micro-op of the next instruction, if the pair is one of the
+    ///        Fusion pairs. The fused micro-op leaves exactly the same state as the two instructions,
+    ///        condition codes included. Only the first can be fused, the second keeps its own micro-op
+    ///        for when it is jumped to.
+    /// @param u     The micro-op, changed into the fused pair
+    /// @param next  The micro-op of the next instruction
+    /// @return      Whether the micro-ops were fused
+    inline bool fuseMicroOps(MicroOp &u, const MicroOp &next) {
+        bool same = next.a == u.a && next.b == u.a;
+
+        if (u.kind == UOP_AND_IMM && u.imm == 0 && next.kind == UOP_ADD_IMM && same) {
+            u.kind = UOP_CONST;
+            u.imm = next.imm;
+            return true;
+        }
+
+        if (u.kind == UOP_ADD_IMM && (next.kind == UOP_BR || next.kind == UOP_JUMP)) {
+            u.kind = UOP_ADD_BR;
+            u.c = (uint8_t) u.imm; // Fits, it is only 5 bits
+            u.d = next.a;
+            u.imm = next.imm;
+            return true;
+        }
+
+        if (u.kind == UOP_NOT && next.kind == UOP_ADD_IMM && next.imm == 1 && same) {
+            u.kind = UOP_NEG;
+            return true;
+        }
+
+        return false;
+    }
+
+    /// @brief The condition code bits (nzp) for a value
+    inline constexpr UInt conditionOf(UInt value) {
+        return value == 0 ? 2 : (value & 0x8000) ? 4 : 1;
+    }
+
+    /// @brief The keyboard and display of a machine
+    struct Console {
+        istream *in;   // Read when the buffered input runs out, may be null
+        ostream *out;  // May be null to only collect output
+
+        string input;  // Buffered input
+        size_t taken;  // Characters of 'input' already read by the program
+        string output; // Output not yet written to 'out'
+
+        bool ended;    // Whether 'in' has ended
+        size_t misses; // Times a key was looked for and not there
+
+        Console(): in(nullptr), out(nullptr), taken(0), ended(false), misses(0) {
+        }
+
+        /// @brief Check whether a character is ready, reading one from 'in' if needed. This blocks
+        ///        when 'in' is interactive.
+        bool available() {
+            if (taken < input.size()) return true;
+            if (in == nullptr || ended) {
+                misses++;
+                return false;
+            }
+
+            // About to wait for the user, show them what they are responding to
+            flush();
+
+            int c = in->get();
+            if (c == EOF) {
+                ended = true;
+                misses++;
+                return false;
+            }
+            input.push_back(c);
+            return true;
+        }
+
+        /// @brief Take the next character, or 0 if there is none
+        UInt take() {
+            if (!available()) return 0;
+            return (unsigned char) input[taken++];
+        }
+
+        void put(char c) {
+            output.push_back(c);
+            if (output.size() >= 4096) flush();
+        }
+
+        void flush() {
+            if (out != nullptr && !output.empty()) {
+                out->write(output.data(), output.size());
+                out->flush();
+                output.clear();
+            }
+        }
+    };
+
+    /// @brief Find the end of a zero terminated string of words, 8 words at a time where SSE2 is
+    ///        available.
+    /// @param s    The string
+    /// @param max  How many words to look at
+    /// @return     The amount of words before the terminator, or 'max' if there is none
+    inline size_t wordStringLength(const UInt *s, size_t max) {
+        size_t i = 0;
+#ifdef __SSE2__
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= max; i += 8) {
+            __m128i words = _mm_loadu_si128((const __m128i *) (s + i));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(words, zero));
+            if (mask != 0) return i + __builtin_ctz(mask) / 2;
+        }
+#endif
+        for (; i < max; i++) {
+            if (s[i] == 0) return i;
+        }
+        return max;
+    }
+
+    /// @brief Run a routine of the built-in operating system in host code instead. Registers and
+    ///        condition codes end like they do after the real routine, but the routine stores
+    ///        nothing in memory and runs as a single instruction. Setting R7 and the PC is left to
+    ///        the caller, like TRAP does.
+    /// @param vector   The trap vector, see isServiced()
+    /// @param reg      The registers
+    /// @param psr      The PSR, for the condition codes
+    /// @param mcr      The machine control register, which HALT stops the clock in
+    /// @param console  The keyboard and display
+    /// @param flat     All memory as one array, to scan strings in, or nullptr to only use 'read'
+    /// @param read     Reads a word like a load instruction, including device side effects
+    /// @return         False if the routine needs a key that is not there. Then only IN has done
+    ///                 something: it showed its prompt.
+    template <class Read>
+    bool serviceTrap(UInt vector, UInt *reg, UInt &psr, UInt &mcr, Console &console, const UInt *flat, Read read) {
+        auto setcc = [&](UInt v) {
+            psr = (psr & 0xFFF8) | conditionOf(v);
+        };
+
+        // Call 'f' on every word of the string at 'addr', until it returns false
+        auto scan = [&](UInt addr, auto f) {
+            for (;;) {
+                if (flat != nullptr && addr < IO_START) {
+                    size_t max = IO_START - addr;
+                    size_t len = wordStringLength(flat + addr, max);
+                    for (size_t i = 0; i < len; i++) {
+                        if (!f(flat[addr + i])) return;
+                    }
+                    if (len < max) return;
+                    addr += len;
+                } else {
+                    UInt w = read(addr++);
+                    if (w == 0 || !f(w)) return;
+                }
+            }
+        };
+
+        switch (vector) {
+            case 0x20: // GETC
+                if (!console.available()) return false;
+                reg[0] = console.take();
+                setcc(reg[0]);
+                break;
+
+            case 0x21: // OUT
+                console.put(reg[0] & 0xFF);
+                setcc(reg[1]);
+                break;
+
+            case 0x22: // PUTS
+                scan(reg[0], [&](UInt w) {
+                    console.put(w & 0xFF);
+                    return true;
+                });
+                setcc(reg[2]);
+                break;
+
+            case 0x23: // IN
+                // Without a keyboard no key will come, don't show the prompt on every try
+                if (console.in == nullptr && !console.available()) return false;
+                for (const char *c = OS_IN_PROMPT; *c; c++) console.put(*c);
+                if (!console.available()) return false;
+                reg[0] = console.take();
+                console.put(reg[0] & 0xFF);
+                console.put('\n');
+                setcc(reg[2]);
+                break;
+
+            case 0x24: // PUTSP, which stops at a zero high byte too
+                scan(reg[0], [&](UInt w) {
+                    console.put(w & 0xFF);
+                    if ((w >> 8) == 0) return false;
+                    console.put(w >> 8);
+                    return true;
+                });
+                setcc(reg[5]);
+                break;
+
+            case 0x25: // HALT
+                for (const char *c = OS_HALT_MESSAGE; *c; c++) console.put(*c);
+                mcr &= 0x7FFF;
+                reg[7] = mcr;
+                setcc(reg[1]);
+                break;
+        }
+        return true;
+    }
+
+    class Jit;
+    class History;
+
+    /// @brief The state of a machine to go back to, see Machine::save. The console is not part of it.
+    struct Snapshot {
+        UInt mem[0x10000];
+        UInt reg[8];
+        UInt pc;
+        UInt psr;
+        UInt savedSSP;
+        UInt savedUSP;
+        uint64_t instructions;
+        uint64_t fusions[FUSIONS];
+        EventQueue events;
+        uint64_t tick;
+    };
+
+    /// @brief An LC3 machine. Instructions are predecoded into a micro-op array parallel to memory, so
+    ///        that the main loop only looks at decoded fields. Every store invalidates the micro-op at
+    ///        its address, which keeps self-modifying code correct.
+    ///
+    ///        The keyboard interrupts at KEYBOARD_PRIORITY while it has a key and bit 14 of KBSR is
+    ///        set. There is also a timer, which is not in the standard LC3: writing an interval to TMI
+    ///        sets bit 15 of TMR every that many instructions, until TMR is read, and it interrupts at
+    ///        TIMER_PRIORITY while bit 14 of TMR is set too. Interrupts are taken between instructions
+    ///        when their priority is above that of the program: right after a device register is
+    ///        accessed or an RTI, and at the first control instruction once the timer is due.
+    class Machine {
+        public:
+        UInt mem[0x10000];
+        UInt reg[8];
+        UInt pc;
+        UInt psr;
+        UInt savedSSP;
+        UInt savedUSP;
+
+        uint64_t instructions;       // Instructions executed so far
+        uint64_t fusions[FUSIONS];   // Fused pairs executed so far, by Fusion
+
+        Console console;
+        Engine engine;
+        bool fuse;                   // Whether to fuse pairs of instructions when decoding
+        bool nativeTraps;            // Whether to run the routines of the built-in OS natively, set
+                                     // it before running: the JIT keeps what it compiled
+        EventQueue events;           // When the devices need attention, see handleEvents()
+        bool findLoops;              // Whether run() looks for states the machine was in before
+
+        // Whether to stop at a breakpoint, or after a store to a watchpoint, given its address. When
+        // empty, it always stops. The state is up to date when they are called.
+        function<bool(UInt)> breakCondition;
+        function<bool(UInt)> watchCondition;
+        bool passBreak;              // Whether the next run executes the instruction at the PC, even
+                                     // if it is at a breakpoint, to go on after stopping there
+        Tracer *tracer;              // Records every instruction when set. Runs use the switch
+                                     // interpreter then, without fusing pairs or skipping polling.
+
+        Machine(): engine(DEFAULT_ENGINE), fuse(false), nativeTraps(true), findLoops(false), passBreak(false), tracer(nullptr) {
+#ifdef LC3_THREADED
+            execute<true>(0, true);
+#endif
+            memset(breakpoints, 0, sizeof(breakpoints));
+            memset(watchpoints, 0, sizeof(watchpoints));
+            memset(watched, 0, sizeof(watched));
+            reset();
+            retrying = false;
+        }
+
+        Machine(const Machine &) = delete;
+        ~Machine();
+
+        /// @brief Clear memory and registers, and load the built-in operating system. The machine
+        ///        starts in user mode with the clock running.
+        void reset() {
+            memset(mem, 0, sizeof(mem));
+            memset(reg, 0, sizeof(reg));
+            memset(uops, 0, sizeof(uops));
+            memset(cached, 0, sizeof(cached));
+            memset(dirty, 1, sizeof(dirty));
+            for (size_t i = 0; i < 0x10000; i++)
+                uops[i].handler = handlers[UOP_DECODE];
+            for (size_t page = 0; page < 0x100; page++)
+                if (watched[page]) memset(cached + (page << 8), 1, 0x100);
+
+            psr = 0x8002;
+            savedSSP = OS_STACK;
+            savedUSP = 0;
+            instructions = 0;
+            memset(fusions, 0, sizeof(fusions));
+            events.clear();
+            tick = UINT64_MAX;
+
+#ifdef LC3_JIT
+            flushJit();
+#endif
+
+            load(buildOS());
+            mem[MCR] = 0x8000;
+            pc = 0x3000;
+        }
+
+        /// @brief Copy an image into memory and point the PC at its origin.
+        void load(const Image &image) {
+            for (size_t i = 0; i < image.size(); i++) {
+                UInt addr = image.address(i);
+                mem[addr] = image.words[i];
+                dirty[addr >> 8] = 1;
+                invalidate(addr);
+            }
+            pc = image.origin;
+        }
+
+        /// @brief Whether the clock has been stopped
+        bool halted() const {
+            return !(mem[MCR] & 0x8000);
+        }
+
+        /// @brief Read memory like a load instruction would, including device side effects
+        UInt read(UInt addr) {
+            return addr < IO_START ? mem[addr] : ioRead(addr);
+        }
+
+        /// @brief Write memory like a store instruction would, including device side effects
+        void write(UInt addr, UInt value) {
+            if (addr >= IO_START) {
+                ioWrite(addr, value);
+            } else {
+                mem[addr] = value;
+                dirty[addr >> 8] = 1;
+                invalidate(addr);
+            }
+        }
+
+        /// @brief Save the state of the machine, and start tracking which pages of 256 words are
+        ///        stored to, so that restore() only has to copy those back. Load a program with
+        ///        reset() and load() first to start every run from the same state.
+        void save(Snapshot &s) {
+            copy(s);
+            memset(dirty, 0, sizeof(dirty));
+        }
+
+        /// @brief Go back to the state last saved with save(). Only the pages stored to since then
+        ///        are copied back, and code that was decoded or compiled elsewhere is kept, so this is
+        ///        a lot cheaper than reset() when a run only touches a few pages. The console is left
+        ///        alone, like with reset().
+        void restore(const Snapshot &s) {
+            for (size_t page = 0; page < 0x100; page++) {
+                // Device registers change without stores, so their pages are always restored
+                if (!dirty[page] && page < IO_START >> 8) continue;
+                dirty[page] = 0;
+                for (size_t addr = page << 8; addr < (page + 1) << 8; addr++) {
+                    if (mem[addr] == s.mem[addr]) continue;
+                    mem[addr] = s.mem[addr];
+                    invalidate(addr);
+                }
+            }
+
+            memcpy(reg, s.reg, sizeof(reg));
+            pc = s.pc;
+            psr = s.psr;
+            savedSSP = s.savedSSP;
+            savedUSP = s.savedUSP;
+            instructions = s.instructions;
+            memcpy(fusions, s.fusions, sizeof(fusions));
+            events = s.events;
+            tick = s.tick;
+        }
+
+        /// @brief Run until the machine halts, waits for input that will not come, or has executed a
+        ///        maximum amount of instructions. Like all limits, that is only checked at control
+        ///        instructions, so it costs nothing in straight-line code.
+        ///
+        ///        With findLoops, it also stops once the machine is in a state it was in before
+        ///        while it can't get keys it doesn't know of: it would go round forever. It runs in
+        ///        slices of LOOP_SLICE instructions then, and only looks at the state in between,
+        ///        comparing registers before memory. That finds a loop within a few slices after
+        ///        it starts, as long as it does not use the timer.
+        /// @param limit  The maximum amount of instructions
+        /// @return       Why the machine stopped
+        Stop run(uint64_t limit) {
+            prepare();
+            if (findLoops) return runFindingLoops(limit);
+            return dispatch(limit);
+        }
+
+        /// @brief Execute exactly one instruction, with the switch interpreter, and take an interrupt
+        ///        if one is due after it where a run would take it: after a control instruction or an
+        ///        access of a device register. So the machine is in the same state after a number of
+        ///        steps as a run passes through, which going back in a History relies on. The
+        ///        instruction is executed even if it is at a breakpoint, and a pair that would be
+        ///        fused is executed as two instructions. A store to a watchpoint still stops.
+        /// @return Why the machine stopped, STOP_LIMIT when it just executed the instruction
+        Stop step() {
+            prepare();
+            if (tracer != nullptr) return execute<false, true, true>(1);
+            return execute<false, true>(1);
+        }
+
+        // Instructions between looks at the state, with findLoops
+        static const uint64_t LOOP_SLICE = 1 << 12;
+
+        /// @brief Whether the last run stopped at a native trap routine that waits for a key. It did
+        ///        not execute, so running on once the console has input is the same as if the input
+        ///        had been there all along. Not so when the program polls the keyboard itself, or
+        ///        keyboard interrupts are enabled.
+        bool retries() const {
+            return retrying && !(mem[KBSR] & 0x4000);
+        }
+
+        /// @brief Set or clear a breakpoint. A run stops at a breakpoint before executing the
+        ///        instruction there, if breakCondition allows. Breakpoints are looked up when an
+        ///        instruction is decoded or compiled, so instructions without one run as fast as
+        ///        ever, and a breakpoint only costs a call to its condition.
+        void setBreakpoint(UInt addr, bool on) {
+            if (breakpoint(addr) == on) return;
+            breakpoints[addr >> 6] ^= (uint64_t) 1 << (addr & 63);
+
+            // Decode it again, and the instruction before it, which may be fused with it
+            cached[addr] = 1;
+            invalidate(addr);
+        }
+
+        bool breakpoint(UInt addr) const {
+            return breakpoints[addr >> 6] >> (addr & 63) & 1;
+        }
+
+        /// @brief Set or clear a watchpoint. A run stops after a store instruction writes to a
+        ///        watchpoint, if watchCondition allows, whether the value changed or not. Other writes,
+        ///        like the stack pushes of an interrupt, are not watched, and neither are device
+        ///        registers. Stores only look for watchpoints on pages of 256 words that have one.
+        void setWatchpoint(UInt addr, bool on) {
+            if (watchpoint(addr) == on) return;
+            watchpoints[addr >> 6] ^= (uint64_t) 1 << (addr & 63);
+
+            // Stores to words marked in 'cached' take the slow path, where they look for watchpoints
+            UInt page = addr >> 8;
+            watched[page] += on ? 1 : -1;
+            if (on && watched[page] == 1) memset(cached + (page << 8), 1, 0x100);
+        }
+
+        bool watchpoint(UInt addr) const {
+            return watchpoints[addr >> 6] >> (addr & 63) & 1;
+        }
+
+        /// @brief Handle the device events that are due by now, and take an interrupt if a device
+        ///        requests one at a higher priority than the program runs at. The engines call this
+        ///        between instructions, once the instruction count reaches events.due().
+        void handleEvents() {
+            while (events.due() <= instructions) {
+                Event e = events.next();
+                if (e.kind == EVENT_TIMER) {
+                    if (e.at != tick) continue; // The interval changed since
+
+                    // The next one is due an interval after this one, even if this one was late
+                    mem[TMR] |= 0x8000;
+                    tick = e.at + mem[TMI];
+                    events.schedule(tick, EVENT_TIMER);
+                }
+            }
+
+            UInt level = getBits(psr, 10, 8);
+            if ((mem[TMR] & 0xC000) == 0xC000 && TIMER_PRIORITY > level) {
+                interrupt(TIMER_VECTOR, TIMER_PRIORITY);
+            } else if ((mem[KBSR] & 0x4000) && KEYBOARD_PRIORITY > level && console.available()) {
+                interrupt(KEYBOARD_VECTOR, KEYBOARD_PRIORITY);
+            }
+        }
+
+        private:
+        friend class Jit;
+        friend class History;
+
+        // For findLoops, a state the machine was in, and the keys it had taken then
+        unique_ptr<Snapshot> seen;
+        size_t seenTaken;
+
+        uint64_t breakpoints[0x10000 / 64]; // A bit for every address
+        uint64_t watchpoints[0x10000 / 64];
+        uint16_t watched[0x100];            // Watchpoints on each page of 256 words
+
+        // The breakpoint a run executes instead of stopping at, see passBreak, or NO_PASSING
+        static const uint32_t NO_PASSING = 0x10000;
+        uint32_t passing = NO_PASSING;
+
+        void prepare() {
+            retrying = false;
+            passing = passBreak ? pc : NO_PASSING;
+            passBreak = false;
+
+            // Keys may have been added to the console since the last run
+            if ((mem[KBSR] & 0x4000) && console.taken < console.input.size())
+                events.schedule(instructions, EVENT_INTERRUPT);
+        }
+
+        // Whether a store to an address stops the run, once the state is up to date
+        bool watchHit(UInt addr) {
+            return watchpoint(addr) && (!watchCondition || watchCondition(addr));
+        }
+
+        Stop dispatch(uint64_t limit) {
+            if (tracer != nullptr) return execute<false, false, true>(limit);
+#ifdef LC3_JIT
+            if (engine == ENGINE_JIT) return runJit(limit);
+#endif
+#ifdef LC3_THREADED
+            if (engine == ENGINE_THREADED) return execute<true>(limit);
+#endif
+            return execute<false>(limit);
+        }
+
+        void copy(Snapshot &s) const {
+            memcpy(s.mem, mem, sizeof(mem));
+            memcpy(s.reg, reg, sizeof(reg));
+            s.pc = pc;
+            s.psr = psr;
+            s.savedSSP = savedSSP;
+            s.savedUSP = savedUSP;
+            s.instructions = instructions;
+            memcpy(s.fusions, fusions, sizeof(fusions));
+            s.events = events;
+            s.tick = tick;
+        }
+
+        // Whether the state is all that decides what the machine does from here: no device has
+        // something due, and no key can come in that the machine does not know of, either because
+        // the input has ended or because the program only gets keys by asking for them
+        bool settled() const {
+            if (events.due() != UINT64_MAX) return false;
+            if (console.ended) return true;
+            return console.in != nullptr && !(mem[KBSR] & 0x4000);
+        }
+
+        // Whether the state is the one in 'seen'. The registers differ most of the time, so memory
+        // is rarely compared.
+        bool seenBefore() const {
+            const Snapshot &s = *seen;
+            return pc == s.pc && psr == s.psr && memcmp(reg, s.reg, sizeof(reg)) == 0
+                && savedSSP == s.savedSSP && savedUSP == s.savedUSP && console.taken == seenTaken
+                && memcmp(mem, s.mem, sizeof(mem)) == 0;
+        }
+
+        // Run in slices, and look for a state that comes back with Brent's algorithm. The state
+        // after a slice only depends on the state before it, so once the program goes round in a
+        // cycle of states, the states after the slices go round in a cycle too.
+        Stop runFindingLoops(uint64_t limit) {
+            uint64_t end = instructions + limit < instructions ? UINT64_MAX : instructions + limit;
+            if (!seen) seen.reset(new Snapshot());
+
+            bool saved = false;
+            uint64_t power = 1, length = 0;
+            for (;;) {
+                uint64_t left = end - instructions;
+                Stop stop = dispatch(left < LOOP_SLICE ? left : LOOP_SLICE);
+                if (stop != STOP_LIMIT || instructions >= end) return stop;
+
+                if (!settled()) {
+                    saved = false;
+                    continue;
+                }
+                if (saved && seenBefore()) return STOP_LOOP;
+
+                // Compare with a state further back every time as many slices have passed since
+                if (!saved || ++length == power) {
+                    copy(*seen);
+                    seenTaken = console.taken;
+                    power = saved ? power * 2 : 1;
+                    length = 0;
+                    saved = true;
+                }
+            }
+        }
+
+        MicroOp uops[0x10000];
+        bool waiting; // Set when the keyboard is polled after the input has ended
+        bool retrying; // Set when a native trap routine stopped the run waiting for a key, see retries()
+        uint64_t tick; // When the timer is due, timer events at other times are stale
+
+        // Whether anything was decoded or compiled from the word at each address, so that stores only
+        // invalidate when needed. May be set where nothing is cached anymore.
+        uint8_t cached[0x10000];
+
+        // Whether each page of 256 words was stored to since the last save()
+        uint8_t dirty[0x100];
+
+        Jit *jit = nullptr; // Created when the JIT engine is first used
+
+        Stop runJit(uint64_t limit);
+        void invalidateJit(UInt addr);
+        void flushJit();
+
+        // Handler addresses of the threaded interpreter, by micro-op kind. Published by the threaded
+        // interpreter itself, since labels are local to their function.
+        static constexpr const void *NO_HANDLERS[UOP_KINDS] = {};
+        const void *const *handlers = NO_HANDLERS;
+
+        void invalidate(UInt addr) {
+            if (!cached[addr]) return;
+            cached[addr] = watched[addr >> 8] != 0;
+
+#ifdef LC3_JIT
+            if (jit != nullptr) invalidateJit(addr);
+#endif
+
+            uops[addr].kind = UOP_DECODE;
+            uops[addr].handler = handlers[UOP_DECODE];
+
+            // The instruction before may be fused with this one
+            UInt prev = addr - 1;
+            if (uops[prev].kind >= UOP_CONST) {
+                uops[prev].kind = UOP_DECODE;
+                uops[prev].handler = handlers[UOP_DECODE];
+            }
+        }
+
+        void decode(UInt addr) {
+            if (addr >= IO_START) {
+                uops[addr].kind = UOP_UNCACHED;
+            } else {
+                uops[addr] = decodeMicroOp(addr, mem[addr]);
+                cached[addr] = 1;
+                if (breakpoint(addr)) {
+                    uops[addr].d = uops[addr].kind;
+                    uops[addr].kind = UOP_BREAK;
+                } else if (fuse && (UInt) (addr + 1) < IO_START && !breakpoint(addr + 1)) {
+                    if (fuseMicroOps(uops[addr], decodeMicroOp(addr + 1, mem[addr + 1])))
+                        cached[addr + 1] = 1;
+                }
+            }
+            uops[addr].handler = handlers[uops[addr].kind];
+        }
+
+        /// @brief The interpreter. With Threaded, every handler ends in an indirect jump to the handler
+        ///        of the next micro-op, instead of going back to a single switch. That gives the branch
+        ///        predictor one jump per handler to learn from, which pays off since the handlers are
+        ///        tiny. Both versions share the handler code.
+        /// @param limit    The maximum amount of instructions
+        /// @param publish  Only publish the handler addresses, don't run
+        /// @tparam Stepping  Execute one instruction, see step()
+        /// @tparam Tracing   Give every instruction to the tracer. Fused pairs are executed as two
+        ///                   instructions, and polling loops are not skipped.
+        template <bool Threaded, bool Stepping = false, bool Tracing = false>
+        Stop execute(uint64_t limit, bool publish = false) {
+#ifdef LC3_THREADED
+            // Only in the threaded version, taking label addresses makes the switch a lot slower
+            if constexpr (Threaded) {
+                static const void *const labels[UOP_KINDS] = {
+                    &&do_DECODE, &&do_UNCACHED, &&do_NOP, &&do_BR, &&do_JUMP,
+                    &&do_ADD_REG, &&do_ADD_IMM, &&do_AND_REG, &&do_AND_IMM, &&do_NOT,
+                    &&do_LD, &&do_LDI, &&do_LDR, &&do_LEA, &&do_ST, &&do_STI, &&do_STR,
+                    &&do_JMP, &&do_JSR, &&do_JSRR, &&do_TRAP, &&do_RTI, &&do_RESERVED,
+                    &&do_BREAK, &&do_CONST, &&do_ADD_BR, &&do_NEG
+                };
+
+                if (publish) {
+                    handlers = labels;
+                    return STOP_LIMIT;
+                }
+            }
+#endif
+
+            if (halted()) return STOP_HALT;
+
+            // Control instructions check 'end', the limit or the first event, whichever comes first
+            uint64_t stopAt = instructions + limit < instructions ? UINT64_MAX : instructions + limit;
+            uint64_t end = min(stopAt, events.due());
+            uint64_t n = instructions;
+            UInt pc = this->pc;
+            UInt *r = reg;
+
+            Stop stop = STOP_LIMIT;
+            waiting = false;
+
+            // The condition codes are only computed when something reads them. Instructions just
+            // keep the value they set them from, and a PSR with condition codes that no value has
+            // (none set, or several) is kept as x10000 | nzp.
+            uint32_t last = 0x10000 | (psr & 7);
+
+            MicroOp tmp;
+            const MicroOp *u;
+
+            // With Tracing, where the record of the instruction goes, and the count when it was
+            // started. The instruction executed once the count has gone up.
+            Tracer::Slot *record = Tracing ? tracer->slot() : nullptr;
+            uint64_t recordAt = n;
+
+            #define CC() (last >> 16 ? last & 7 : conditionOf(last))
+
+            // Write back the state that lives in locals, around calls that use it
+            #define SYNC()   (this->pc = pc, instructions = n, psr = (psr & 0xFFF8) | CC())
+            #define RELOAD() (pc = this->pc, n = instructions, last = 0x10000 | (psr & 7))
+
+            #define EVENTS_CHANGED() (end = min(stopAt, events.due()))
+
+            // With Tracing, fill in the record, and add it once the instruction has executed
+            #define TRACE_VALUE(v) (Tracing ? (void) (record->value = (v)) : (void) 0)
+            #define TRACE_ADDR(a)  (Tracing ? (void) (record->addr = (a)) : (void) 0)
+            #define RETIRE() \
+                if constexpr (Tracing) { \
+                    if (n != recordAt) record = tracer->advance(); \
+                    recordAt = n; \
+                }
+
+            // The end of an instruction that may have touched a device, which may have to interrupt
+            #define DEVICE_CHECK() \
+                if (waiting || halted()) { \
+                    stop = waiting ? STOP_INPUT : STOP_HALT; \
+                    goto out; \
+                } \
+                if (n >= events.due()) { \
+                    SYNC(); \
+                    handleEvents(); \
+                    RELOAD(); \
+                    EVENTS_CHANGED(); \
+                    if (Stepping) goto out; \
+                    continue; \
+                } \
+                EVENTS_CHANGED();
+
+            #define SETCC(v) (TRACE_VALUE(v), last = (v))
+            #define LOAD(addr) (TRACE_ADDR(addr), (addr) < IO_START ? mem[addr] : (SYNC(), ioRead(addr)))
+
+            #define STORE(addr, v) \
+                TRACE_ADDR(addr); \
+                TRACE_VALUE(v); \
+                if ((addr) >= IO_START) { \
+                    SYNC(); \
+                    ioWrite(addr, v); \
+                    DEVICE_CHECK(); \
+                } else { \
+                    mem[addr] = v; \
+                    dirty[(addr) >> 8] = 1; \
+                    if (cached[addr]) { \
+                        invalidate(addr); \
+                        if (watched[(addr) >> 8] && (SYNC(), watchHit(addr))) { \
+                            stop = STOP_WATCH; \
+                            goto out; \
+                        } \
+                    } \
+                }
+
+#ifdef LC3_THREADED
+            #define HANDLER(kind) case UOP_##kind: do_##kind: __attribute__((unused));
+            #define NEXT() \
+                if constexpr (Stepping) goto next; \
+                else if constexpr (Threaded) { \
+                    u = &uops[pc]; \
+                    goto *u->handler; \
+                } else break
+#else
+            #define HANDLER(kind) case UOP_##kind:
+            #define NEXT() if constexpr (Stepping) goto next; else break
+#endif
+
+            resume:
+            for (;;) {
+                if constexpr (Stepping) {
+                    // Not the micro-op, which may be a fused pair or a breakpoint
+                    tmp = decodeMicroOp(pc, mem[pc]);
+                    u = &tmp;
+                } else {
+                    u = &uops[pc];
+                }
+
+                if constexpr (Tracing) {
+                    RETIRE();
+                    record->pc = pc;
+                    record->word = mem[pc];
+
+                    // One instruction at a time
+                    if (u->kind >= UOP_CONST) {
+                        tmp = decodeMicroOp(pc, mem[pc]);
+                        tmp.handler = handlers[tmp.kind];
+                        u = &tmp;
+                    }
+                }
+
+                dispatch:
+#ifdef LC3_THREADED
+                if constexpr (Threaded) goto *u->handler;
+#endif
+                switch (u->kind) {
+                    HANDLER(DECODE)
+                        decode(pc);
+                        continue;
+
+                    HANDLER(UNCACHED)
+                        // Also the only way to wrap around memory without a control instruction, so
+                        // the limit is checked here
+                        if (n >= end) goto out;
+                        tmp = decodeMicroOp(pc, mem[pc]);
+                        tmp.handler = handlers[tmp.kind];
+                        u = &tmp;
+                        goto dispatch;
+
+                    HANDLER(NOP)
+                        pc++;
+                        n++;
+                        NEXT();
+
+                    HANDLER(BR)
+                        pc = (CC() & u->a) ? u->imm : (UInt) (pc + 1);
+                        n++;
+                        if (n >= end) goto out;
+                        NEXT();
+
+                    HANDLER(JUMP)
+                        pc = u->imm;
+                        n++;
+                        if (n >= end) goto out;
+                        NEXT();
+
+                    HANDLER(ADD_REG)
+                        r[u->a] = r[u->b] + r[u->c];
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        NEXT();
+
+                    HANDLER(ADD_IMM)
+                        r[u->a] = r[u->b] + u->imm;
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        NEXT();
+
+                    HANDLER(AND_REG)
+                        r[u->a] = r[u->b] & r[u->c];
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        NEXT();
+
+                    HANDLER(AND_IMM)
+                        r[u->a] = r[u->b] & u->imm;
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        NEXT();
+
+                    HANDLER(NOT)
+                        r[u->a] = ~r[u->b];
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        NEXT();
+
+                    HANDLER(LEA)
+                        r[u->a] = u->imm;
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        NEXT();
+
+                    HANDLER(LD)
+                    {
+                        UInt addr = u->imm;
+                        r[u->a] = LOAD(addr);
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        if (addr >= IO_START) {
+                            DEVICE_CHECK();
+                            if constexpr (!Tracing) n += skipPolling(pc - 1, n, end);
+                        }
+                        NEXT();
+                    }
+
+                    HANDLER(LDR)
+                    {
+                        UInt addr = r[u->b] + u->imm;
+                        r[u->a] = LOAD(addr);
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        if (addr >= IO_START) {
+                            DEVICE_CHECK();
+                            if constexpr (!Tracing) n += skipPolling(pc - 1, n, end);
+                        }
+                        NEXT();
+                    }
+
+                    HANDLER(LDI)
+                    {
+                        UInt ptr = LOAD(u->imm);
+                        r[u->a] = LOAD(ptr);
+                        SETCC(r[u->a]);
+                        pc++;
+                        n++;
+                        if (ptr >= IO_START || u->imm >= IO_START) {
+                            DEVICE_CHECK();
+                            if constexpr (!Tracing) n += skipPolling(pc - 1, n, end);
+                        }
+                        NEXT();
+                    }
+
+                    HANDLER(ST)
+                    {
+                        UInt addr = u->imm;
+                        UInt v = r[u->a];
+                        pc++;
+                        n++;
+                        STORE(addr, v);
+                        NEXT();
+                    }
+
+                    HANDLER(STR)
+                    {
+                        UInt addr = r[u->b] + u->imm;
+                        UInt v = r[u->a];
+                        pc++;
+                        n++;
+                        STORE(addr, v);
+                        NEXT();
+                    }
+
+                    HANDLER(STI)
+                    {
+                        UInt addr = LOAD(u->imm);
+                        UInt v = r[u->a];
+                        pc++;
+                        n++;
+                        STORE(addr, v);
+                        NEXT();
+                    }
+
+                    HANDLER(JMP)
+                        pc = r[u->b];
+                        n++;
+                        if (n >= end) goto out;
+                        NEXT();
+
+                    HANDLER(JSR)
+                        r[7] = pc + 1;
+                        TRACE_VALUE(r[7]);
+                        pc = u->imm;
+                        n++;
+                        if (n >= end) goto out;
+                        NEXT();
+
+                    HANDLER(JSRR)
+                    {
+                        UInt target = r[u->b];
+                        r[7] = pc + 1;
+                        TRACE_VALUE(r[7]);
+                        pc = target;
+                        n++;
+                        if (n >= end) goto out;
+                        NEXT();
+                    }
+
+                    HANDLER(TRAP)
+                        if (nativeTraps && isServiced(u->imm)) {
+                            SYNC();
+                            bool done = service(u->imm);
+                            RELOAD();
+                            if (!done) {
+                                if (waiting) {
+                                    stop = STOP_INPUT;
+                                    retrying = true;
+                                    goto out;
+                                }
+                                // Retried until a key comes, which is not before the run ends or an event
+                                n = n + 1 > end ? n + 1 : end;
+                                if constexpr (Tracing) recordAt = n; // It did not execute
+                                goto out;
+                            }
+                            n++;
+                            // The key a routine read is traced as a load, the only way to see it
+                            if (u->imm == 0x20 || u->imm == 0x23) {
+                                TRACE_ADDR(KBDR);
+                                TRACE_VALUE(r[0]);
+                            } else {
+                                TRACE_ADDR(u->imm);
+                                TRACE_VALUE(r[7]);
+                            }
+                            if (halted()) {
+                                stop = STOP_HALT;
+                                goto out;
+                            }
+                            EVENTS_CHANGED();
+                            if (n >= end) goto out;
+                            NEXT();
+                        }
+                        r[7] = pc + 1;
+                        TRACE_ADDR(u->imm);
+                        TRACE_VALUE(r[7]);
+                        pc = mem[u->imm];
+                        n++;
+                        if (n >= end) goto out;
+                        NEXT();
+
+                    HANDLER(RTI)
+                        pc++;
+                        n++;
+                        SYNC();
+                        if (psr & 0x8000) {
+                            exception(0x00);
+                        } else {
+                            this->pc = read(r[6]);
+                            psr = read(r[6] + 1);
+                            r[6] += 2;
+                            if (psr & 0x8000) {
+                                savedSSP = r[6];
+                                r[6] = savedUSP;
+                            }
+
+                            // The priority may have dropped below that of a waiting interrupt
+                            if ((mem[KBSR] | mem[TMR]) & 0x4000) events.schedule(n, EVENT_INTERRUPT);
+                        }
+                        RELOAD();
+                        EVENTS_CHANGED();
+                        if (n >= end) goto out;
+                        NEXT();
+
+                    HANDLER(CONST)
+                        r[u->a] = u->imm;
+                        SETCC(r[u->a]);
+                        pc += 2;
+                        n += 2;
+                        fusions[FUSE_CONST]++;
+                        NEXT();
+
+                    HANDLER(ADD_BR)
+                        r[u->a] = r[u->b] + (UInt) (int8_t) u->c;
+                        SETCC(r[u->a]);
+                        pc = (CC() & u->d) ? u->imm : (UInt) (pc + 2);
+                        n += 2;
+                        fusions[FUSE_ADD_BR]++;
+                        if (n >= end) goto out;
+                        NEXT();
+
+                    HANDLER(NEG)
+                        r[u->a] = -r[u->b];
+                        SETCC(r[u->a]);
+                        pc += 2;
+                        n += 2;
+                        fusions[FUSE_NEG]++;
+                        NEXT();
+
+                    HANDLER(BREAK)
+                        if (pc != passing) {
+                            SYNC();
+                            if (!breakCondition || breakCondition(pc)) {
+                                stop = STOP_BREAK;
+                                goto out;
+                            }
+                        }
+                        passing = NO_PASSING;
+                        tmp = *u;
+                        tmp.kind = u->d;
+                        tmp.handler = handlers[tmp.kind];
+                        u = &tmp;
+                        goto dispatch;
+
+                    default:
+                    HANDLER(RESERVED)
+                        pc++;
+                        n++;
+                        SYNC();
+                        exception(0x01);
+                        RELOAD();
+                        if (n >= end) goto out;
+                        NEXT();
+                }
+            }
+
+            // A step ends here after an instruction a run goes on from, without looking at the events
+            next: __attribute__((unused));
+            if constexpr (Stepping) {
+                RETIRE();
+                SYNC();
+                console.flush();
+                return stop;
+            }
+
+            out:
+            RETIRE();
+            SYNC();
+            if (stop == STOP_LIMIT && n >= events.due()) {
+                handleEvents();
+                RELOAD();
+                EVENTS_CHANGED();
+                if (n < stopAt) goto resume;
+            }
+            console.flush();
+            return stop;
+
+            #undef CC
+            #undef SYNC
+            #undef RELOAD
+            #undef EVENTS_CHANGED
+            #undef TRACE_VALUE
+            #undef TRACE_ADDR
+            #undef RETIRE
+            #undef DEVICE_CHECK
+            #undef SETCC
+            #undef LOAD
+            #undef STORE
+            #undef HANDLER
+            #undef NEXT
+        }
+
+        /// @brief Run a trap routine natively at the PC, see serviceTrap(). When it needs a key that
+        ///        is not there, it stays at the TRAP, which is executed again.
+        /// @return Whether it ran
+        bool service(UInt vector) {
+            UInt mcr = mem[MCR];
+            bool done = serviceTrap(vector, reg, psr, mcr, console, mem, [&](UInt addr) {
+                return read(addr);
+            });
+            if (!done) {
+                if (console.ended) waiting = true;
+                return false;
+            }
+
+            pc++;
+            if (vector != 0x25) reg[7] = pc;
+            write(MCR, mcr);
+
+            // Like an access of the keyboard registers
+            if (mem[KBSR] & 0x4000) events.schedule(instructions, EVENT_INTERRUPT);
+            return true;
+        }
+
+        /// @brief Fast-forward a loop that does nothing but poll a device status register that is not
+        ///        ready: the load that read it, a few instructions that only compute from what was
+        ///        loaded, and a branch back to the load. Every iteration leaves the same state, so
+        ///        they can be counted without running them. The console only gets input from outside
+        ///        a run, so a device that is not ready stays that way until the run ends, or until
+        ///        an event interrupts the loop.
+        /// @param at   The address of the load, which was just executed
+        /// @param n    The instructions executed so far, including the load
+        /// @param end  Where the run stops, or the first event is due
+        /// @return     The amount of instructions skipped, whole iterations that end before 'end'
+        uint64_t skipPolling(UInt at, uint64_t n, uint64_t end) const {
+            MicroOp load = decodeMicroOp(at, mem[at]);
+            UInt addr;
+            switch (load.kind) {
+                case UOP_LD:  addr = load.imm; break;
+                case UOP_LDI: addr = mem[load.imm]; break;
+                case UOP_LDR: addr = reg[load.b] + load.imm; break;
+                default: return 0;
+            }
+            if ((addr != KBSR && addr != DSR) || (reg[load.a] & 0x8000)) return 0;
+            if (load.kind == UOP_LDI && load.imm >= IO_START) return 0;
+            if (load.kind == UOP_LDR && load.a == load.b) return 0;
+
+            // Run the rest of the iteration on a copy of the registers, only allowing instructions
+            // that compute from registers set in this iteration
+            UInt r[8];
+            memcpy(r, reg, sizeof(r));
+            unsigned fresh = 1 << load.a;
+            UInt cc = conditionOf(r[load.a]);
+
+            for (UInt len = 1; len <= 4; len++) {
+                UInt pc = at + len;
+                if (pc >= IO_START) return 0;
+
+                MicroOp u = decodeMicroOp(pc, mem[pc]);
+                switch (u.kind) {
+                    case UOP_ADD_IMM: case UOP_AND_IMM: case UOP_NOT:
+                        if (!(fresh & 1 << u.b)) return 0;
+                        r[u.a] = u.kind == UOP_ADD_IMM ? r[u.b] + u.imm
+                            : u.kind == UOP_AND_IMM ? r[u.b] & u.imm : ~r[u.b];
+                        break;
+
+                    case UOP_ADD_REG: case UOP_AND_REG:
+                        if (!(fresh & 1 << u.b) || !(fresh & 1 << u.c)) return 0;
+                        r[u.a] = u.kind == UOP_ADD_REG ? r[u.b] + r[u.c] : r[u.b] & r[u.c];
+                        break;
+
+                    case UOP_BR: case UOP_JUMP:
+                    {
+                        if (u.imm != at || !(cc & u.a)) return 0;
+
+                        // The branch checks the limit after 'len' more instructions
+                        uint64_t iteration = len + 1;
+                        if (n >= end || end - n <= len) return 0;
+                        return (end - n - len) / iteration * iteration;
+                    }
+
+                    default:
+                        return 0;
+                }
+
+                // The base of LDR has to stay the same
+                if (load.kind == UOP_LDR && u.a == load.b) return 0;
+                fresh |= 1 << u.a;
+                cc = conditionOf(r[u.a]);
+            }
+            return 0;
+        }
+
+        /// @brief Enter an exception or interrupt handler: switch to the supervisor stack, push PSR and
+        ///        PC, and continue at the address in the interrupt vector table.
+        void exception(UInt vector) {
+            UInt old = psr;
+            if (old & 0x8000) {
+                savedUSP = reg[6];
+                reg[6] = savedSSP;
+            }
+            psr = old & 0x7FFF;
+
+            reg[6] -= 2;
+            write(reg[6] + 1, old);
+            write(reg[6], pc);
+            pc = mem[0x0100 | vector];
+        }
+
+        /// @brief Enter an interrupt handler, like an exception, and raise the priority to that of the
+        ///        interrupt.
+        void interrupt(UInt vector, UInt priority) {
+            exception(vector);
+            psr = (psr & 0xF8FF) | priority << 8;
+        }
+
+        UInt ioRead(UInt addr) {
+            switch (addr) {
+                case KBSR:
+                    // Looking may make a key come in
+                    if (mem[KBSR] & 0x4000) events.schedule(instructions, EVENT_INTERRUPT);
+                    if (console.available()) return 0x8000 | (mem[KBSR] & 0x4000);
+                    if (console.ended) waiting = true;
+                    return mem[KBSR] & 0x4000;
+
+                case KBDR:
+                    // The next key may interrupt again
+                    if (mem[KBSR] & 0x4000) events.schedule(instructions, EVENT_INTERRUPT);
+                    return console.take();
+
+                case DSR:
+                    return 0x8000;
+
+                case TMR:
+                {
+                    UInt v = mem[TMR];
+                    mem[TMR] &= 0x4000;
+                    return v;
+                }
+
+                default:
+                    return mem[addr];
+            }
+        }
+
+        void ioWrite(UInt addr, UInt value) {
+            switch (addr) {
+                case KBSR:
+                    mem[KBSR] = value & 0x4000;
+                    events.schedule(instructions, EVENT_INTERRUPT);
+                    break;
+
+                case DDR:
+                    console.put(value & 0xFF);
+                    break;
+
+                case TMR:
+                    mem[TMR] = (mem[TMR] & 0x8000) | (value & 0x4000);
+                    events.schedule(instructions, EVENT_INTERRUPT);
+                    break;
+
+                case TMI:
+                    mem[TMI] = value;
+                    tick = value ? instructions + value : UINT64_MAX;
+                    if (value) events.schedule(tick, EVENT_TIMER);
+                    break;
+
+                case KBDR:
+                case DSR:
+                    break;
+
+                default:
+                    mem[addr] = value;
+                    break;
+            }
+        }
+    };
+
+#ifndef LC3_JIT
+    inline Machine::~Machine() {
+    }
+#endif
+}
+
+#ifdef LC3_JIT
+#include "jit.hpp"
+#endif
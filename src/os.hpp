@@ -0,0 +1,235 @@
+#pragma once
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "builder.hpp"
+
+namespace lc3 {
+    // Where the operating system code starts, right after the trap and interrupt vector tables
+    const UInt OS_START = 0x0200;
+
+    // Stack of the supervisor, growing down, used by interrupts and exceptions
+    const UInt OS_STACK = 0x3000;
+
+    // Displayed by IN and HALT, also when they run natively
+    const char *const OS_IN_PROMPT = "\nInput a character> ";
+    const char *const OS_HALT_MESSAGE = "\n--- halting the LC-3 ---\n";
+
+    /// @brief Whether a trap vector has a routine that can run natively: GETC, OUT, PUTS, IN, PUTSP
+    ///        and HALT, x20 to x25.
+    inline constexpr bool isServiced(UInt vector) {
+        return vector >= 0x20 && vector <= 0x25;
+    }
+
+    /// @brief Builds the built-in operating system: the trap vector table at x0000, the interrupt
+    ///        vector table at x0100 and the service routines from x0200. The routines are the usual
+    ///        ones: GETC, OUT, PUTS, IN, PUTSP and HALT, polling the device registers. They only
+    ///        change R0 where the routine returns a value, and R7 (set by TRAP itself).
+    inline Image buildOS() {
+        CodeBuilder c(OS_START);
+
+        const UInt R0 = 0, R1 = 1, R2 = 2, R3 = 3, R4 = 4, R5 = 5, R7 = 7;
+
+        // Shared device register pointers
+        auto devices = [&](const string &p) {
+            c.label(p + "KBSR"); c.word(KBSR);
+            c.label(p + "KBDR"); c.word(KBDR);
+            c.label(p + "DSR");  c.word(DSR);
+            c.label(p + "DDR");  c.word(DDR);
+        };
+
+        // GETC: read a character into R0
+        c.label("GETC");
+        c.mem(LDI, R0, "GETC_KBSR");
+        c.br(3, "GETC");
+        c.mem(LDI, R0, "GETC_KBDR");
+        c.ret();
+        devices("GETC_");
+
+        // OUT: write the character in R0
+        c.label("OUT");
+        c.mem(ST, R1, "OUT_R1");
+        c.label("OUT_WAIT");
+        c.mem(LDI, R1, "OUT_DSR");
+        c.br(3, "OUT_WAIT");
+        c.mem(STI, R0, "OUT_DDR");
+        c.mem(LD, R1, "OUT_R1");
+        c.ret();
+        c.label("OUT_R1"); c.word(0);
+        devices("OUT_");
+
+        // PUTS: write the zero terminated string at R0, one character per word
+        c.label("PUTS");
+        c.mem(ST, R0, "PUTS_R0");
+        c.mem(ST, R1, "PUTS_R1");
+        c.mem(ST, R2, "PUTS_R2");
+        c.add(R1, R0, 0);
+        c.label("PUTS_LOOP");
+        c.based(LDR, R0, R1, 0);
+        c.br(2, "PUTS_DONE");
+        c.label("PUTS_WAIT");
+        c.mem(LDI, R2, "PUTS_DSR");
+        c.br(3, "PUTS_WAIT");
+        c.mem(STI, R0, "PUTS_DDR");
+        c.add(R1, R1, 1);
+        c.br(7, "PUTS_LOOP");
+        c.label("PUTS_DONE");
+        c.mem(LD, R0, "PUTS_R0");
+        c.mem(LD, R1, "PUTS_R1");
+        c.mem(LD, R2, "PUTS_R2");
+        c.ret();
+        c.label("PUTS_R0"); c.word(0);
+        c.label("PUTS_R1"); c.word(0);
+        c.label("PUTS_R2"); c.word(0);
+        devices("PUTS_");
+
+        // IN: prompt for a character, read it into R0 and echo it
+        c.label("IN");
+        c.mem(ST, R1, "IN_R1");
+        c.mem(ST, R2, "IN_R2");
+        c.mem(LEA, R1, "IN_PROMPT");
+        c.label("IN_LOOP");
+        c.based(LDR, R0, R1, 0);
+        c.br(2, "IN_KEY");
+        c.label("IN_WAIT");
+        c.mem(LDI, R2, "IN_DSR");
+        c.br(3, "IN_WAIT");
+        c.mem(STI, R0, "IN_DDR");
+        c.add(R1, R1, 1);
+        c.br(7, "IN_LOOP");
+        c.label("IN_KEY");
+        c.mem(LDI, R0, "IN_KBSR");
+        c.br(3, "IN_KEY");
+        c.mem(LDI, R0, "IN_KBDR");
+        c.label("IN_ECHO");
+        c.mem(LDI, R2, "IN_DSR");
+        c.br(3, "IN_ECHO");
+        c.mem(STI, R0, "IN_DDR");
+        c.andi(R1, R1, 0);
+        c.add(R1, R1, 10);
+        c.label("IN_NEWLINE");
+        c.mem(LDI, R2, "IN_DSR");
+        c.br(3, "IN_NEWLINE");
+        c.mem(STI, R1, "IN_DDR");
+        c.mem(LD, R1, "IN_R1");
+        c.mem(LD, R2, "IN_R2");
+        c.ret();
+        c.label("IN_R1"); c.word(0);
+        c.label("IN_R2"); c.word(0);
+        devices("IN_");
+        c.label("IN_PROMPT"); c.stringz(OS_IN_PROMPT);
+
+        // PUTSP: write the zero terminated string at R0, two characters per word, low byte first
+        c.label("PUTSP");
+        c.mem(ST, R0, "PUTSP_R0");
+        c.mem(ST, R1, "PUTSP_R1");
+        c.mem(ST, R2, "PUTSP_R2");
+        c.mem(ST, R3, "PUTSP_R3");
+        c.mem(ST, R4, "PUTSP_R4");
+        c.mem(ST, R5, "PUTSP_R5");
+        c.add(R1, R0, 0);
+        c.label("PUTSP_LOOP");
+        c.based(LDR, R3, R1, 0);
+        c.br(2, "PUTSP_DONE");
+        c.mem(LD, R2, "PUTSP_LOW");
+        c.andr(R0, R3, R2);
+        c.label("PUTSP_WAIT1");
+        c.mem(LDI, R2, "PUTSP_DSR");
+        c.br(3, "PUTSP_WAIT1");
+        c.mem(STI, R0, "PUTSP_DDR");
+        // Shift the high byte down, one bit at a time
+        c.andi(R0, R0, 0);
+        c.mem(LD, R4, "PUTSP_BIT8");
+        c.andi(R5, R5, 0);
+        c.add(R5, R5, 1);
+        c.label("PUTSP_SHIFT");
+        c.andr(R2, R3, R4);
+        c.br(2, "PUTSP_ZERO");
+        c.addr(R0, R0, R5);
+        c.label("PUTSP_ZERO");
+        c.addr(R5, R5, R5);
+        c.addr(R4, R4, R4);
+        c.br(5, "PUTSP_SHIFT");
+        c.add(R0, R0, 0);
+        c.br(2, "PUTSP_DONE");
+        c.label("PUTSP_WAIT2");
+        c.mem(LDI, R2, "PUTSP_DSR");
+        c.br(3, "PUTSP_WAIT2");
+        c.mem(STI, R0, "PUTSP_DDR");
+        c.add(R1, R1, 1);
+        c.br(7, "PUTSP_LOOP");
+        c.label("PUTSP_DONE");
+        c.mem(LD, R0, "PUTSP_R0");
+        c.mem(LD, R1, "PUTSP_R1");
+        c.mem(LD, R2, "PUTSP_R2");
+        c.mem(LD, R3, "PUTSP_R3");
+        c.mem(LD, R4, "PUTSP_R4");
+        c.mem(LD, R5, "PUTSP_R5");
+        c.ret();
+        c.label("PUTSP_R0"); c.word(0);
+        c.label("PUTSP_R1"); c.word(0);
+        c.label("PUTSP_R2"); c.word(0);
+        c.label("PUTSP_R3"); c.word(0);
+        c.label("PUTSP_R4"); c.word(0);
+        c.label("PUTSP_R5"); c.word(0);
+        c.label("PUTSP_LOW"); c.word(0x00FF);
+        c.label("PUTSP_BIT8"); c.word(0x0100);
+        devices("PUTSP_");
+
+        // HALT: print a message and stop the clock. R0 and R1 are restored before the clock stops,
+        // so only R7 is left changed, holding the value written to MCR.
+        c.label("HALT");
+        c.mem(ST, R0, "HALT_R0");
+        c.mem(ST, R1, "HALT_R1");
+        c.mem(LEA, R0, "HALT_MSG");
+        c.trap(0x22);
+        c.mem(LDI, R1, "HALT_MCR");
+        c.mem(LD, R0, "HALT_MASK");
+        c.andr(R7, R1, R0);
+        c.mem(LD, R0, "HALT_R0");
+        c.mem(LD, R1, "HALT_R1");
+        c.mem(STI, R7, "HALT_MCR");
+        c.br(7, "HALT");
+        c.label("HALT_R0"); c.word(0);
+        c.label("HALT_R1"); c.word(0);
+        c.label("HALT_MCR"); c.word(MCR);
+        c.label("HALT_MASK"); c.word(0x7FFF);
+        c.label("HALT_MSG"); c.stringz(OS_HALT_MESSAGE);
+
+        // Traps and interrupts without a routine, and exceptions, report and halt
+        auto fatal = [&](const string &name, const string &message) {
+            c.label(name);
+            c.mem(LEA, R0, name + "_MSG");
+            c.trap(0x22);
+            c.trap(0x25);
+            c.label(name + "_MSG"); c.stringz(message);
+        };
+
+        fatal("BAD_TRAP", "\n--- undefined trap executed ---\n");
+        fatal("BAD_INT", "\n--- unexpected interrupt ---\n");
+        fatal("PRIVILEGE", "\n--- privilege mode violation ---\n");
+        fatal("ILLEGAL", "\n--- illegal opcode ---\n");
+
+        vector<UInt> code = c.finish();
+
+        Image os(0x0000);
+        os.words.resize(OS_START, 0);
+
+        for (UInt v = 0; v < 0x100; v++)
+            os.words[v] = c.address("BAD_TRAP");
+        os.words[0x20] = c.address("GETC");
+        os.words[0x21] = c.address("OUT");
+        os.words[0x22] = c.address("PUTS");
+        os.words[0x23] = c.address("IN");
+        os.words[0x24] = c.address("PUTSP");
+        os.words[0x25] = c.address("HALT");
+
+        for (UInt v = 0; v < 0x100; v++)
+            os.words[0x100 + v] = c.address("BAD_INT");
+        os.words[0x100] = c.address("PRIVILEGE");
+        os.words[0x101] = c.address("ILLEGAL");
+
+        os.words.insert(os.words.end(), code.begin(), code.end());
+        return os;
+    }
+}
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <cstdint>
+#include <cctype>
+#include <cstdlib>
+#include <string>
+#include <sstream>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "lc3.hpp"
+
+namespace lc3 {
+    class PatternError {
+        public:
+        string problem;
+        PatternError(string problem): problem(problem) {
+        }
+    };
+
+    /// @brief A register operand that must hold the same register as every other operand with the same
+    ///        variable name, like the two 'Rx' in 'AND Rx Rx #0'.
+    struct Binding {
+        int var;
+        size_t word;  // Index of the word in the sequence
+        UInt shift;   // Position of the 3-bit register field
+    };
+
+    /// @brief A sequence of instruction shapes, compiled to a mask and value for each word. A word w
+    ///        matches when (w & mask) == value.
+    struct Pattern {
+        vector<UInt> mask;
+        vector<UInt> value;
+        vector<Binding> bindings;
+
+        size_t size() const {
+            return mask.size();
+        }
+
+        /// @brief Check the register variables of a match, given a function that reads the words of
+        ///        the sequence.
+        template <typename F>
+        bool bound(F word) const {
+            int regs[26];
+            for (int i = 0; i < 26; i++) regs[i] = -1;
+
+            for (const Binding &b : bindings) {
+                int r = getBits(word(b.word), b.shift + 2, b.shift);
+                if (regs[b.var] < 0) regs[b.var] = r;
+                else if (regs[b.var] != r) return false;
+            }
+            return true;
+        }
+    };
+
+    /// @brief Compile a pattern written in the assembly syntax lc3c prints, for example 'TRAP x25',
+    ///        'LDR R* R6' or 'AND Rx Rx #0; ADD Rx Rx #*'. Instructions are separated with ';'.
+    ///        Operands may be '*' to match anything, and registers may be a variable like 'Rx', which
+    ///        must be the same register everywhere it is used. Missing trailing operands match
+    ///        anything, as does a BR without any of n, z or p given as 'BR*'. A lone '*' matches any
+    ///        word. Only the fields lc3c prints are matched, unused bits are ignored.
+    /// @param source  The pattern
+    /// @return        The compiled pattern
+    inline Pattern compilePattern(const string &source) {
+        Pattern pat;
+
+        stringstream insns(source);
+        for (string text; getline(insns, text, ';');) {
+            // Brackets and commas only separate operands
+            for (char &c : text)
+                if (c == '[' || c == ']' || c == ',') c = ' ';
+
+            vector<string> tokens;
+            stringstream ts(text);
+            for (string tok; ts >> tok;) {
+                string up = tok;
+                for (char &c : up) c = toupper(c);
+                if (up != "OFFSET") tokens.push_back(tok);
+            }
+
+            if (tokens.empty())
+                throw PatternError("empty instruction in pattern '" + source + "'");
+
+            string name = tokens[0];
+            for (char &c : name) c = toupper(c);
+            size_t word = pat.mask.size();
+            size_t next = 1;
+
+            UInt mask = 0, value = 0;
+
+            // The next operand, or null if it is missing or '*'
+            auto operand = [&]() -> const string * {
+                if (next >= tokens.size()) return nullptr;
+                const string *t = &tokens[next++];
+                if (*t == "*") return nullptr;
+                return t;
+            };
+
+            auto field = [&](UInt v, UInt from, UInt to) {
+                UInt m = getBits(0xFFFF, from, to) << to;
+                mask |= m;
+                value = (value & ~m) | ((v << to) & m);
+            };
+
+            auto reg = [&](UInt shift) {
+                const string *t = operand();
+                if (t == nullptr) return;
+
+                if (t->length() != 2 || toupper((*t)[0]) != 'R')
+                    throw PatternError("expected a register, got '" + *t + "'");
+
+                char c = (*t)[1];
+                if (c >= '0' && c <= '7') {
+                    field(c - '0', shift + 2, shift);
+                } else if (c == '*') {
+                    // Any register
+                } else if (isalpha(c) && islower(c)) {
+                    pat.bindings.push_back({ c - 'a', word, shift });
+                } else {
+                    throw PatternError("expected a register, got '" + *t + "'");
+                }
+            };
+
+            auto number = [&](char prefix, int base, long lo, long hi, UInt from, UInt to) {
+                const string *t = operand();
+                if (t == nullptr) return;
+
+                string s = *t;
+                if (!s.empty() && toupper(s[0]) == toupper(prefix)) s = s.substr(1);
+                if (s == "*" || (!s.empty() && isalpha(s[0]) && base != 16)) return; // '#*' or '#imm'
+
+                char *p;
+                long v = strtol(s.c_str(), &p, base);
+                if (s.empty() || *p != 0 || v < lo || v > hi)
+                    throw PatternError("invalid operand '" + *t + "' for " + name);
+
+                field((UInt) v, from, to);
+            };
+
+            auto opcode = [&](UInt op) {
+                field(op, 15, 12);
+            };
+
+            if (name == "*") {
+                // Any word
+            } else if (name.rfind("BR", 0) == 0) {
+                opcode(BR);
+                string cond = name.substr(2);
+                if (cond != "*") {
+                    UInt nzp = 0;
+                    for (char c : cond) {
+                        if      (c == 'N') nzp |= 4;
+                        else if (c == 'Z') nzp |= 2;
+                        else if (c == 'P') nzp |= 1;
+                        else throw PatternError("unknown instruction '" + tokens[0] + "'");
+                    }
+                    field(nzp, 11, 9);
+                }
+                number(0, 10, -256, 255, 8, 0);
+            } else if (name == "ADD" || name == "AND") {
+                opcode(name == "ADD" ? ADD : AND);
+                reg(9);
+                reg(6);
+
+                if (next < tokens.size()) {
+                    const string &t = tokens[next];
+                    if (t == "*") {
+                        next++;
+                    } else if (toupper(t[0]) == 'R') {
+                        field(0, 5, 5);
+                        reg(0);
+                    } else {
+                        field(1, 5, 5);
+                        number('#', 10, -16, 15, 4, 0);
+                    }
+                }
+            } else if (name == "LD" || name == "LDI" || name == "ST" || name == "STI" || name == "LEA") {
+                if      (name == "LD")  opcode(LD);
+                else if (name == "LDI") opcode(LDI);
+                else if (name == "ST")  opcode(ST);
+                else if (name == "STI") opcode(STI);
+                else                    opcode(LEA);
+                reg(9);
+                number(0, 10, -256, 255, 8, 0);
+            } else if (name == "LDR" || name == "STR") {
+                opcode(name == "LDR" ? LDR : STR);
+                reg(9);
+                reg(6);
+                number('#', 10, -32, 31, 5, 0);
+            } else if (name == "NOT") {
+                opcode(NOT);
+                reg(9);
+                reg(6);
+            } else if (name == "JSR") {
+                opcode(JSR);
+                field(1, 11, 11);
+                number(0, 10, -1024, 1023, 10, 0);
+            } else if (name == "JSRR") {
+                opcode(JSR);
+                field(0, 11, 11);
+                reg(6);
+            } else if (name == "JMP") {
+                opcode(RET);
+                reg(6);
+            } else if (name == "RET") {
+                opcode(RET);
+                field(7, 8, 6);
+            } else if (name == "RTI") {
+                opcode(RTI);
+            } else if (name == "TRAP") {
+                opcode(TRAP);
+                number('x', 16, 0, 255, 7, 0);
+            } else {
+                throw PatternError("unknown instruction '" + tokens[0] + "'");
+            }
+
+            if (next < tokens.size())
+                throw PatternError("too many operands for " + name + ": '" + tokens[next] + "'");
+
+            pat.mask.push_back(mask);
+            pat.value.push_back(value);
+        }
+
+        if (pat.mask.empty())
+            throw PatternError("empty pattern");
+
+        return pat;
+    }
+
+    /// @brief Find all occurrences of a pattern in a range of words. The first word of the pattern is
+    ///        tested eight words at a time with SSE2 where available, the rest of the sequence and the
+    ///        register variables only for candidates.
+    /// @param words      The words to search
+    /// @param n          The amount of words
+    /// @param bigEndian  Whether the words are stored big-endian, as in memory mapped object files
+    /// @param pat        The pattern
+    /// @param found      Called with the index of the first word of every match
+    template <typename F>
+    void searchPattern(const UInt *words, size_t n, bool bigEndian, const Pattern &pat, F found) {
+        size_t k = pat.size();
+        if (n < k) return;
+
+        auto swap = [](UInt w) -> UInt {
+            return (UInt) ((w << 8) | (w >> 8));
+        };
+        auto read = [&](size_t i) -> UInt {
+            return bigEndian ? swap(words[i]) : words[i];
+        };
+
+        // Swap the first mask and value rather than every word
+        UInt mask0 = bigEndian ? swap(pat.mask[0]) : pat.mask[0];
+        UInt value0 = bigEndian ? swap(pat.value[0]) : pat.value[0];
+
+        size_t last = n - k; // Last index a match can start at
+
+        auto verify = [&](size_t i) {
+            for (size_t j = 1; j < k; j++) {
+                if ((read(i + j) & pat.mask[j]) != pat.value[j]) return;
+            }
+            if (!pat.bindings.empty() && !pat.bound([&](size_t j) { return read(i + j); }))
+                return;
+            found(i);
+        };
+
+        size_t i = 0;
+
+#if defined(__SSE2__)
+        const __m128i vmask = _mm_set1_epi16((short) mask0);
+        const __m128i vvalue = _mm_set1_epi16((short) value0);
+
+        for (; i + 8 <= last + 1; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *) (words + i));
+            __m128i eq = _mm_cmpeq_epi16(_mm_and_si128(v, vmask), vvalue);
+            unsigned bits = _mm_movemask_epi8(eq) & 0x5555;
+
+            while (bits) {
+                unsigned b = __builtin_ctz(bits);
+                bits &= bits - 1;
+                verify(i + b / 2);
+            }
+        }
+#endif
+
+        for (; i <= last; i++) {
+            if ((words[i] & mask0) == value0) verify(i);
+        }
+    }
+}
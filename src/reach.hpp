@@ -0,0 +1,82 @@
+#pragma once
+
+#include <bitset>
+#include <vector>
+
+#include "lc3.hpp"
+#include "image.hpp"
+#include "cfg.hpp"
+
+namespace lc3 {
+    /// @brief The words of an image that are reachable by statically known control flow from its
+    ///        origin. Memory is tracked as a bitset over the full 64K address space, so that no
+    ///        allocation depends on the image and the pass stays cheap over large batches of files.
+    struct Reachability {
+        bitset<0x10000> reached;
+        size_t count;
+
+        Reachability(const Image &image): Reachability(image, { image.origin }) {
+        }
+
+        /// @brief Reachability from other entry points than the origin, like the routines of an
+        ///        operating system image, which starts with its vector tables.
+        Reachability(const Image &image, const vector<UInt> &entries): count(0) {
+            if (image.size() == 0) return;
+
+            vector<UInt> work;
+            work.reserve(256);
+
+            auto visit = [&](UInt addr) {
+                if (!image.contains(addr) || reached.test(addr)) return;
+                reached.set(addr);
+                work.push_back(addr);
+            };
+
+            for (UInt e : entries) visit(e);
+
+            while (!work.empty()) {
+                UInt addr = work.back();
+                work.pop_back();
+                count++;
+
+                // Follow straight-line code without going through the worklist
+                for (;;) {
+                    Flow f = flowOf(addr, image.words[image.index(addr)]);
+
+                    if (f.jumps) visit(f.target);
+                    if (!f.falls) break;
+
+                    UInt next = addr + 1;
+                    if (!image.contains(next) || reached.test(next)) break;
+                    reached.set(next);
+                    count++;
+                    addr = next;
+                }
+            }
+        }
+
+        /// @brief Check whether the word at an address is reachable
+        bool test(UInt addr) const {
+            return reached.test(addr);
+        }
+
+        /// @brief The ranges of words in the image that are not reachable, as pairs of the first
+        ///        index and one past the last index.
+        vector<pair<size_t, size_t>> unreachable(const Image &image) const {
+            vector<pair<size_t, size_t>> ranges;
+            size_t n = image.size();
+
+            for (size_t i = 0; i < n; i++) {
+                if (reached.test(image.address(i))) continue;
+
+                size_t j = i + 1;
+                while (j < n && !reached.test(image.address(j))) j++;
+
+                ranges.push_back({ i, j });
+                i = j;
+            }
+
+            return ranges;
+        }
+    };
+}
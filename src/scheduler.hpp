@@ -0,0 +1,188 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lc3.hpp"
+#include "machine.hpp"
+
+namespace lc3 {
+    /// @brief Runs many machines on a few threads. Every machine is a coroutine without a stack of
+    ///        its own: Machine::run returns when its time slice is used up or when it waits for a
+    ///        key, and goes on where it stopped when it is run again. A machine that waits for input
+    ///        costs its state and nothing more, and no thread waits with it.
+    ///
+    ///        Machines that can run take turns in a queue, a slice each, and go to the back after
+    ///        their turn. Machines waiting for a key leave the queue until feed() gives them one.
+    ///        What a machine displays is collected after every slice, see take().
+    class Scheduler {
+        public:
+        // Instructions a machine runs before the next one gets a turn
+        static const uint64_t DEFAULT_SLICE = 1 << 16;
+
+        /// @brief Start the worker threads
+        /// @param threads  How many, at least one
+        /// @param slice    Instructions per turn
+        Scheduler(int threads, uint64_t slice = DEFAULT_SLICE): slice(slice), unfinished(0), stopping(false) {
+            for (int i = 0; i < (threads < 1 ? 1 : threads); i++)
+                workers.emplace_back([this]() { work(); });
+        }
+
+        Scheduler(const Scheduler &) = delete;
+
+        /// @brief Finish the turns that were started and stop the workers. Machines still waiting
+        ///        for keys are left as they are.
+        ~Scheduler() {
+            {
+                lock_guard<mutex> lock(m);
+                stopping = true;
+                queue.clear();
+            }
+            ready.notify_all();
+            for (thread &t : workers) t.join();
+        }
+
+        /// @brief Start running a machine, with its program loaded. Its console is taken over by
+        ///        the scheduler.
+        /// @param machine  The machine
+        /// @param limit    The amount of instructions it may execute, like Machine::run
+        /// @param keys     Keys it has from the start
+        /// @param closed   Whether those are all the keys it will get
+        /// @return         Its number, for the other methods
+        size_t add(unique_ptr<Machine> machine, uint64_t limit, const string &keys = "", bool closed = false) {
+            lock_guard<mutex> lock(m);
+            size_t id = tasks.size();
+            tasks.emplace_back();
+            Task &t = tasks.back();
+            t.machine = move(machine);
+            t.machine->console.out = nullptr;
+            t.limit = limit;
+            t.keys = keys;
+            t.closed = closed;
+            t.queued = true;
+            unfinished++;
+            queue.push_back(id);
+            ready.notify_one();
+            return id;
+        }
+
+        /// @brief Give a machine more keys, and run it again if it was waiting for them
+        /// @param close  Whether these are the last keys it will get. It ends with STOP_INPUT when
+        ///               it wants more.
+        void feed(size_t id, const string &keys, bool close = false) {
+            lock_guard<mutex> lock(m);
+            Task &t = tasks[id];
+            t.keys += keys;
+            t.closed |= close;
+            if (!t.queued && !t.done) {
+                t.queued = true;
+                queue.push_back(id);
+                ready.notify_one();
+            }
+        }
+
+        /// @brief Take what a machine displayed since the last call
+        string take(size_t id) {
+            lock_guard<mutex> lock(m);
+            string shown;
+            shown.swap(tasks[id].display);
+            return shown;
+        }
+
+        /// @brief Whether a machine has ended, and if so, why and after how many instructions
+        bool done(size_t id, Stop &stop, uint64_t &instructions) {
+            lock_guard<mutex> lock(m);
+            const Task &t = tasks[id];
+            if (!t.done) return false;
+            stop = t.stop;
+            instructions = t.instructions;
+            return true;
+        }
+
+        /// @brief Wait until at most a number of machines have not ended. Machines that wait for
+        ///        keys nobody feeds them never end.
+        void wait(size_t most = 0) {
+            unique_lock<mutex> lock(m);
+            idle.wait(lock, [&]() { return unfinished <= most; });
+        }
+
+        private:
+        struct Task {
+            unique_ptr<Machine> machine; // Released once it has ended
+            uint64_t limit;
+            uint64_t instructions = 0;   // Executed so far
+            string display;              // Not taken yet
+            string keys;                 // Fed but not yet given to the console
+            Stop stop = STOP_LIMIT;      // Why it ended
+            bool done = false;
+            bool closed = false;         // No more keys will come
+            bool queued = false;         // In the queue or running
+        };
+
+        uint64_t slice;
+
+        mutex m;
+        condition_variable ready; // Signalled when the queue gets a machine, or on stopping
+        condition_variable idle;  // Signalled when a machine ends
+        deque<Task> tasks;        // By number, a deque keeps them in place as more are added
+        deque<size_t> queue;      // The machines that can run, in turn
+        size_t unfinished;
+        bool stopping;
+        vector<thread> workers;
+
+        // The keyboard of machines that will get no more keys. Never read since their console has
+        // ended, but like with a file that ended, IN then shows its prompt before finding no key.
+        istringstream none;
+
+        void work() {
+            unique_lock<mutex> lock(m);
+            for (;;) {
+                ready.wait(lock, [&]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+
+                size_t id = queue.front();
+                queue.pop_front();
+                Task &t = tasks[id];
+                Machine &machine = *t.machine;
+
+                // The console has ended after the keys it has, so that the machine stops to wait
+                // for more instead of spinning until its slice is over
+                Console &console = machine.console;
+                console.input.erase(0, console.taken);
+                console.taken = 0;
+                console.input += t.keys;
+                t.keys.clear();
+                console.ended = true;
+                console.in = t.closed ? &none : nullptr;
+                uint64_t left = t.limit - machine.instructions;
+
+                lock.unlock();
+                Stop stop = machine.run(left < slice ? left : slice);
+                lock.lock();
+
+                t.display += console.output;
+                console.output.clear();
+                t.instructions = machine.instructions;
+
+                if ((stop == STOP_LIMIT && machine.instructions < t.limit) || (stop == STOP_INPUT && !t.keys.empty())) {
+                    queue.push_back(id);
+                } else if (stop == STOP_INPUT && !t.closed) {
+                    t.queued = false;
+                } else {
+                    t.stop = stop;
+                    t.done = true;
+                    t.machine.reset();
+                    unfinished--;
+                    idle.notify_all();
+                }
+            }
+        }
+    };
+}
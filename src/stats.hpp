@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "lc3.hpp"
+
+namespace lc3 {
+    /// @brief Counts of the different kinds of instructions in a program
+    struct MixSummary {
+        uint64_t total;
+        uint64_t opcodes[16];
+        uint64_t br[8];      // By nzp bits
+        uint64_t addImm, addReg;
+        uint64_t andImm, andReg;
+        uint64_t jsr, jsrr;
+        uint64_t ret, jmp;
+        uint64_t traps[256]; // By trap vector
+        uint64_t imm5[32];   // ADD/AND immediates, index 0 is #-16
+    };
+
+    /// @brief Collects the instruction mix of a stream of words.
+    ///
+    /// Counting does not classify words at all: it keeps a histogram over the full 16-bit word
+    /// space, so every word costs a single increment without any branches. Two interleaved tables
+    /// are used so that runs of the same word (which are common, think of NOPs and zeroed data) do
+    /// not serialize on one counter. All classification happens once per distinct word value, when
+    /// the summary is made.
+    class InstructionMix {
+        vector<uint32_t> hist;    // Two tables of 64K counters, interleaved per word
+        vector<uint64_t> folded;  // Counts moved out of 'hist' before it could overflow
+        uint64_t pending;
+
+        static const uint64_t FOLD_AT = 0x7FFFFFFF;
+
+        void fold() {
+            for (size_t i = 0; i < 0x10000; i++) {
+                folded[i] += (uint64_t) hist[i * 2] + hist[i * 2 + 1];
+                hist[i * 2] = hist[i * 2 + 1] = 0;
+            }
+            pending = 0;
+        }
+
+        public:
+        InstructionMix(): hist(0x20000, 0), folded(0x10000, 0), pending(0) {
+        }
+
+        /// @brief Count a single word
+        void add(UInt word) {
+            hist[word * 2]++;
+            if (++pending >= FOLD_AT) fold();
+        }
+
+        /// @brief Count a range of words
+        void add(const UInt *words, size_t n) {
+            while (n > 0) {
+                size_t chunk = min(n, (size_t) (FOLD_AT - pending) & ~(size_t) 1);
+                if (chunk == 0) {
+                    fold();
+                    continue;
+                }
+
+                uint32_t *h = hist.data();
+                size_t i = 0;
+                for (; i + 4 <= chunk; i += 4) {
+                    h[words[i] * 2]++;
+                    h[words[i + 1] * 2 + 1]++;
+                    h[words[i + 2] * 2]++;
+                    h[words[i + 3] * 2 + 1]++;
+                }
+                for (; i < chunk; i++)
+                    h[words[i] * 2]++;
+
+                pending += chunk;
+                words += chunk;
+                n -= chunk;
+            }
+        }
+
+        /// @brief Classify all counted words
+        MixSummary summary() const {
+            MixSummary s = {};
+
+            for (size_t w = 0; w < 0x10000; w++) {
+                uint64_t c = folded[w] + hist[w * 2] + hist[w * 2 + 1];
+                if (c == 0) continue;
+
+                UInt op = getBits(w, 15, 12);
+                s.total += c;
+                s.opcodes[op] += c;
+
+                switch (op) {
+                    case BR:
+                        s.br[getBits(w, 11, 9)] += c;
+                        break;
+
+                    case ADD:
+                    case AND:
+                        if (getBit(w, 5)) {
+                            (op == ADD ? s.addImm : s.andImm) += c;
+                            s.imm5[getBits(w, 4, 0) ^ 0x10] += c;
+                        } else {
+                            (op == ADD ? s.addReg : s.andReg) += c;
+                        }
+                        break;
+
+                    case JSR:
+                        (getBit(w, 11) ? s.jsr : s.jsrr) += c;
+                        break;
+
+                    case RET:
+                        (getBits(w, 8, 6) == 7 ? s.ret : s.jmp) += c;
+                        break;
+
+                    case TRAP:
+                        s.traps[getBits(w, 7, 0)] += c;
+                        break;
+                }
+            }
+
+            return s;
+        }
+    };
+}
@@ -0,0 +1,421 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lc3.hpp"
+
+namespace lc3 {
+    // A trace file starts with these bytes, and a version
+    const char TRACE_MAGIC[4] = { 'L', 'C', '3', 'T' };
+    const uint8_t TRACE_VERSION = 1;
+
+    // The first byte of a record. The low three bits are the register written, or the one stored.
+    const uint8_t TRACE_REG   = 0x08; // A register was written, its value follows
+    const uint8_t TRACE_JUMP  = 0x10; // The PC is not the one after the last record, the difference follows
+    const uint8_t TRACE_WORD  = 0x20; // The instruction word follows, the reader does not know it yet
+    const uint8_t TRACE_LOAD  = 0x40; // The address follows, the value is that of the register. A
+                                      // TRAP sets it when a native routine read a key into R0,
+                                      // which follows the value of R7.
+    const uint8_t TRACE_STORE = 0x80; // The address follows, and the value stored
+
+    /// @brief An instruction as it was executed
+    struct TraceRecord {
+        UInt pc;
+        UInt word;
+        bool writes; // Whether it wrote a register
+        UInt reg;    // Which one, or the one it stored
+        UInt value;  // The value written
+        bool loads;  // For a TRAP, that a native routine read a key from 'addr' into R0
+        bool stores;
+        UInt addr;   // The address it loaded from or stored to
+        UInt data;   // The value loaded or stored
+    };
+
+    /// @brief Records every instruction a machine executes, in a compact binary format: the PC only
+    ///        when it does not follow from the last one, the instruction word only when the reader
+    ///        does not know it yet, and every number as a varint of 7 bits a byte. Differences, of
+    ///        the PC and of memory addresses, are zigzag encoded so that small ones are small both
+    ///        ways. A record is 2 or 3 bytes for most instructions.
+    ///
+    ///        While the machine runs, a record is just the PC, the word, the value it wrote and the
+    ///        address it accessed, written straight into a ring of blocks of RECORDS_PER_BLOCK by
+    ///        the interpreter. They are encoded a block at a time, away from the machine: either a
+    ///        thread encodes and writes every block as soon as it is full, and the machine only waits
+    ///        when the ring is full, or only the most recent blocks are kept, and finish() encodes
+    ///        and writes the last records. The ring is lock-free, with a single producer and a
+    ///        single consumer.
+    ///
+    ///        Every block is encoded on its own, so that it can be read without the blocks before it:
+    ///        the first PC is a difference from 0, and the reader knows no instruction words. In a
+    ///        file, a block is the number of records, how many of those to skip, and the size in
+    ///        bytes, as varints, followed by the records.
+    class Tracer {
+        public:
+        static const uint32_t RECORDS_PER_BLOCK = 1 << 13;
+
+        // The ring when writing as it goes
+        static const size_t STREAM_BLOCKS = 64;
+
+        /// @brief Write every record to a stream, on a thread of its own
+        /// @param out  The stream, binary
+        Tracer(ostream &out): out(out), keep(0), ring(STREAM_BLOCKS) {
+            writeHeader();
+            begin(ring[0]);
+            writer = thread([this]() { drain(); });
+        }
+
+        /// @brief Keep at least the most recent records in memory, and write them with finish()
+        /// @param out   The stream, binary
+        /// @param keep  How many records
+        Tracer(ostream &out, uint64_t keep): out(out), keep(keep),
+                ring(keep / RECORDS_PER_BLOCK + (keep % RECORDS_PER_BLOCK != 0) + 1) {
+            writeHeader();
+            begin(ring[0]);
+        }
+
+        Tracer(const Tracer &) = delete;
+
+        ~Tracer() {
+            finish();
+        }
+
+        /// @brief A record as the machine writes it while it runs. Fields that do not apply to the
+        ///        instruction are left as they were.
+        struct Slot {
+            UInt pc;
+            UInt word;
+            UInt value; // Of the register written, or stored. R0 after a native GETC or IN.
+            UInt addr;  // Loaded from or stored to. KBDR after a native GETC or IN.
+        };
+
+        /// @brief Where the record of the next instruction goes
+        Slot *slot() {
+            return next;
+        }
+
+        /// @brief Add the record in slot(), once its instruction has executed
+        /// @return  Where the record of the next instruction goes
+        Slot *advance() {
+            if (++next == end) nextBlock();
+            return next;
+        }
+
+        /// @brief Write what is left, and wait until it is written. Only the first call does anything.
+        void finish() {
+            if (finished) return;
+            finished = true;
+            publish();
+
+            if (keep == 0) {
+                done.store(true, memory_order_release);
+                writer.join();
+                return;
+            }
+
+            // Skip the records before the last 'keep'
+            uint64_t h = head.load(memory_order_relaxed);
+            uint64_t total = 0;
+            for (uint64_t b = tail.load(memory_order_relaxed); b < h; b++) total += ring[b % ring.size()].size;
+            uint64_t skip = total > keep ? total - keep : 0;
+            for (uint64_t b = tail.load(memory_order_relaxed); b < h; b++) {
+                Block &blk = ring[b % ring.size()];
+                uint32_t skipped = skip < blk.size ? skip : blk.size;
+                skip -= skipped;
+                write(blk, skipped);
+            }
+            out.flush();
+        }
+
+        private:
+        // The flags of a record that follow from the opcode, and whether the register is in bits 11
+        // to 9 of the instruction
+        static constexpr uint8_t OPCODE_FLAGS[16] = {
+            0,                      // BR
+            TRACE_REG,              // ADD
+            TRACE_REG | TRACE_LOAD, // LD
+            TRACE_STORE,            // ST
+            TRACE_REG | 7,          // JSR
+            TRACE_REG,              // AND
+            TRACE_REG | TRACE_LOAD, // LDR
+            TRACE_STORE,            // STR
+            0,                      // RTI
+            TRACE_REG,              // NOT
+            TRACE_REG | TRACE_LOAD, // LDI
+            TRACE_STORE,            // STI
+            0,                      // JMP
+            0,                      // Reserved
+            TRACE_REG,              // LEA
+            TRACE_REG | 7           // TRAP
+        };
+        static const uint16_t REGISTER_FIELD = 1 << ADD | 1 << LD | 1 << ST | 1 << AND | 1 << LDR | 1 << STR
+            | 1 << NOT | 1 << LDI | 1 << STI | 1 << LEA;
+
+        // A header byte and five varints of at most 3 bytes, the last written as 4
+        static const size_t MAX_RECORD = 17;
+
+        struct Block {
+            vector<Slot> records = vector<Slot>(RECORDS_PER_BLOCK);
+            uint32_t size = 0;
+        };
+
+        ostream &out;
+        uint64_t keep;              // Records to keep, 0 when writing as it goes
+        vector<Block> ring;
+        atomic<uint64_t> head{0};   // Blocks filled, the next one is being filled
+        atomic<uint64_t> tail{0};   // Blocks written or dropped
+        atomic<bool> done{false};   // Set when the writer can stop once the ring is empty
+        thread writer;
+        bool finished = false;
+
+        Block *block;               // The block being filled
+        Slot *next;                 // Where its next record goes
+        Slot *end;
+
+        // For encoding: a block, and the words the reader knows, each with the generation of the
+        // block it knows it in, so that a new block forgets them all without clearing the table
+        vector<uint8_t> encoded = vector<uint8_t>(RECORDS_PER_BLOCK * MAX_RECORD);
+        vector<uint32_t> known = vector<uint32_t>(0x10000);
+        uint32_t generation = 0;
+
+        void writeHeader() {
+            out.write(TRACE_MAGIC, sizeof(TRACE_MAGIC));
+            out.put(TRACE_VERSION);
+        }
+
+        void begin(Block &b) {
+            block = &b;
+            next = b.records.data();
+            end = next + RECORDS_PER_BLOCK;
+        }
+
+        void publish() {
+            block->size = next - block->records.data();
+            head.store(head.load(memory_order_relaxed) + 1, memory_order_release);
+        }
+
+        __attribute__((noinline)) void nextBlock() {
+            publish();
+            uint64_t h = head.load(memory_order_relaxed);
+            if (keep == 0) {
+                while (h - tail.load(memory_order_acquire) >= ring.size()) this_thread::yield();
+            } else if (h - tail.load(memory_order_relaxed) >= ring.size()) {
+                tail.store(h - ring.size() + 1, memory_order_relaxed);
+            }
+            begin(ring[h % ring.size()]);
+        }
+
+        // Write the blocks as they are filled, until finish()
+        void drain() {
+            for (;;) {
+                uint64_t t = tail.load(memory_order_relaxed);
+                if (t < head.load(memory_order_acquire)) {
+                    write(ring[t % ring.size()], 0);
+                    tail.store(t + 1, memory_order_release);
+                } else if (done.load(memory_order_acquire)) {
+                    if (t == head.load(memory_order_acquire)) break;
+                } else {
+                    this_thread::sleep_for(chrono::microseconds(100));
+                }
+            }
+            out.flush();
+        }
+
+        // A varint of a word, without branches. Writes 4 bytes at once, records have room for that.
+        static uint8_t *varint(uint8_t *p, UInt v) {
+            uint32_t more = v >= 0x80, most = v >= 0x4000;
+            uint32_t bytes = (v & 0x7F) | more << 7 | (v << 1 & 0x7F00) | most << 15 | (uint32_t) (v >> 14) << 16;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            bytes = __builtin_bswap32(bytes);
+#endif
+            memcpy(p, &bytes, 4);
+            return p + 1 + more + most;
+        }
+
+        static uint8_t *varint32(uint8_t *p, uint32_t v) {
+            while (v >= 0x80) {
+                *p++ = v | 0x80;
+                v >>= 7;
+            }
+            *p++ = v;
+            return p;
+        }
+
+        static UInt zigzag(UInt v) {
+            return v << 1 ^ (UInt) ((Int) v >> 15);
+        }
+
+        // Encode a block and write it
+        void write(const Block &b, uint32_t skip) {
+            if (++generation == 0x10000) {
+                fill(known.begin(), known.end(), 0);
+                generation = 1;
+            }
+
+            // In locals, the bytes written may alias anything else
+            const Slot *records = b.records.data();
+            uint32_t size = b.size;
+            uint32_t *knownAt = known.data();
+            uint32_t stampBase = generation << 16;
+
+            UInt expected = 0, lastAddr = 0;
+            uint8_t *p = encoded.data();
+            for (uint32_t i = 0; i < size; i++) {
+                UInt pc = records[i].pc, word = records[i].word, value = records[i].value, addr = records[i].addr;
+                UInt op = word >> 12;
+                uint32_t stamp = stampBase | word;
+
+                uint8_t flags = OPCODE_FLAGS[op];
+                if (REGISTER_FIELD >> op & 1) flags |= getBits(word, 11, 9);
+                if (pc != expected) flags |= TRACE_JUMP;
+                if (knownAt[pc] != stamp) flags |= TRACE_WORD;
+
+                // A native GETC or IN wrote the key to R0, and R7 is the address after the TRAP
+                UInt key = value;
+                if (op == TRAP && addr == KBDR) {
+                    flags |= TRACE_LOAD;
+                    value = pc + 1;
+                }
+
+                *p++ = flags;
+                if (flags & TRACE_JUMP) p = varint(p, zigzag(pc - expected));
+                if (flags & TRACE_WORD) p = varint(p, word);
+                if (flags & (TRACE_LOAD | TRACE_STORE)) p = varint(p, zigzag(addr - lastAddr));
+                if (flags & (TRACE_REG | TRACE_STORE)) p = varint(p, value);
+                if (op == TRAP && (flags & TRACE_LOAD)) p = varint(p, key);
+
+                knownAt[pc] = stamp;
+                if (flags & (TRACE_LOAD | TRACE_STORE)) lastAddr = addr;
+                expected = pc + 1;
+            }
+
+            uint8_t header[3 * 5];
+            uint8_t *h = header;
+            h = varint32(h, size);
+            h = varint32(h, skip);
+            h = varint32(h, p - encoded.data());
+            out.write((const char *) header, h - header);
+            out.write((const char *) encoded.data(), p - encoded.data());
+        }
+    };
+
+    class TraceError {
+        public:
+        string problem;
+        TraceError(string problem): problem(problem) {
+        }
+    };
+
+    /// @brief Reads the records of a trace that a Tracer wrote, keeping the instruction words it
+    ///        was given like the tracer expects
+    class TraceReader {
+        public:
+        TraceReader(istream &in): in(in), at(0), left(0), skip(0), known(0x10000) {
+            char magic[sizeof(TRACE_MAGIC)];
+            if (!in.read(magic, sizeof(magic)) || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+                throw TraceError("not a trace");
+            if (in.get() != TRACE_VERSION)
+                throw TraceError("unsupported trace version");
+        }
+
+        /// @brief Read the next record, past those the tracer skips to keep the most recent ones
+        /// @return False at the end of the trace
+        bool next(TraceRecord &r) {
+            do {
+                while (left == 0) {
+                    if (!nextBlock()) return false;
+                }
+                read(r);
+                left--;
+            } while (skip > 0 && skip--);
+            return true;
+        }
+
+        private:
+        istream &in;
+        vector<uint8_t> data; // The block being read
+        size_t at;
+        uint32_t left;        // Records left in it
+        uint32_t skip;        // Records left to skip
+        UInt expected;
+        UInt lastAddr;
+        vector<UInt> known;   // The instruction words given in this block, by address
+
+        uint32_t varint() {
+            uint32_t v = 0;
+            for (int shift = 0; shift < 32; shift += 7) {
+                if (at == data.size()) throw TraceError("truncated record");
+                uint8_t b = data[at++];
+                v |= (uint32_t) (b & 0x7F) << shift;
+                if (!(b & 0x80)) return v;
+            }
+            throw TraceError("invalid number");
+        }
+
+        // A varint from the stream, for block headers. Sets 'ended' when the stream ends before it.
+        uint32_t streamVarint(bool &ended) {
+            uint32_t v = 0;
+            for (int shift = 0; shift < 32; shift += 7) {
+                int b = in.get();
+                if (b < 0) {
+                    ended = true;
+                    return 0;
+                }
+                v |= (uint32_t) (b & 0x7F) << shift;
+                if (!(b & 0x80)) return v;
+            }
+            throw TraceError("invalid number");
+        }
+
+        static UInt unzigzag(uint32_t v) {
+            return (UInt) (v >> 1) ^ (UInt) -(Int) (v & 1);
+        }
+
+        bool nextBlock() {
+            bool ended = false;
+            uint32_t records = streamVarint(ended);
+            if (ended) return false;
+            skip = streamVarint(ended);
+            uint32_t size = streamVarint(ended);
+            if (ended) throw TraceError("truncated block");
+
+            data.resize(size);
+            if (!in.read((char *) data.data(), size)) throw TraceError("truncated block");
+            at = 0;
+            left = records;
+            expected = 0;
+            lastAddr = 0;
+            return true;
+        }
+
+        void read(TraceRecord &r) {
+            if (at == data.size()) throw TraceError("truncated record");
+            uint8_t flags = data[at++];
+
+            r.pc = expected;
+            if (flags & TRACE_JUMP) r.pc += unzigzag(varint());
+            if (flags & TRACE_WORD) known[r.pc] = varint();
+            r.word = known[r.pc];
+
+            r.loads = flags & TRACE_LOAD;
+            r.stores = flags & TRACE_STORE;
+            if (r.loads || r.stores) {
+                lastAddr += unzigzag(varint());
+                r.addr = lastAddr;
+            }
+
+            r.writes = flags & TRACE_REG;
+            r.reg = flags & 7;
+            r.value = r.writes || r.stores ? varint() : 0;
+            r.data = r.loads && getBits(r.word, 15, 12) == TRAP ? varint() : r.value;
+            expected = r.pc + 1;
+        }
+    };
+}